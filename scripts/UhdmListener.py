@@ -1,5 +1,6 @@
 import config
 import file_utils
+import reachability
 
 
 def _get_listen_implementation(classname, name, vpi, type, card):
@@ -23,6 +24,60 @@ def _get_listen_implementation(classname, name, vpi, type, card):
     return listeners
 
 
+def _get_step_implementation(name, type, card, vector_ids):
+    steps = []
+
+    Name_ = name[:1].upper() + name[1:]
+
+    if card == '1':
+        steps.append(f'      if (const any *const {name}_ = object->{Name_}()) {{')
+        steps.append(f'        pushAny_({name}_);')
+        steps.append( '      }')
+    else:
+        steps.append(f'      if (const VectorOf{type} *const {name}_ = object->{Name_}()) {{')
+        steps.append(f'        enter{Name_}(object, *{name}_);')
+        steps.append(f'        pushElements_(object, {name}_, {vector_ids[(name, type)]});')
+        steps.append( '      }')
+
+    return steps
+
+
+def _get_relations(model):
+    relations = []
+    for key, value in model.allitems():
+        if key in ['class', 'obj_ref', 'class_ref', 'group_ref']:
+            name = value.get('name')
+            type = value.get('type')
+            card = value.get('card')
+
+            if (card == 'any') and not name.endswith('s'):
+                name += 's'
+
+            # The type filter of the walk goes by the type of the group.
+            relation_type = type
+            if key == 'group_ref':
+                type = 'any'
+
+            relations.append((name, type, card, relation_type))
+    return relations
+
+
+def _get_relation_types(model):
+    # vpiParent, walked by listenBaseClass_, leads back to where the walk
+    # comes from and is left out of the reachability.
+    return [relation_type for _, _, _, relation_type in _get_relations(model)]
+
+
+def _get_relation_count(models, classname):
+    # listenBaseClass_ walks vpiParent before any relation of the models.
+    count = 1
+    while classname:
+        model = models[classname]
+        count += len(_get_relations(model))
+        classname = model.get('extends')
+    return count
+
+
 def generate(models):
     private_declarations = []
     private_implementations = []
@@ -59,11 +114,12 @@ def generate(models):
                     if (card == 'any') and not name.endswith('s'):
                         name += 's'
 
+                    relation_type = type
                     if key == 'group_ref':
                         type = 'any'
 
                     listen_implementation = _get_listen_implementation(classname, name, vpi, type, card)
-                    private_implementations.extend(listen_implementation)
+                    private_implementations.extend(reachability.filter_relation(models, relation_type, listen_implementation, '  '))
 
                     if card == 'any' and listen_implementation:
                         vector_enters_leaves.add((name, type))
@@ -75,6 +131,10 @@ def generate(models):
             classnames.add(classname)
 
             public_implementations.append(f'void UhdmListener::listen{Classname_}(const {classname}* const object) {{')
+            public_implementations.append( '  if (iterative_) {')
+            public_implementations.append( '    walk_(object, true);')
+            public_implementations.append( '    return;')
+            public_implementations.append( '  }')
             public_implementations.append( '  callstack.push_back(object);')
             public_implementations.append(f'  enter{Classname_}(object);')
             public_implementations.append( '  if (visited.insert(object).second) {')
@@ -85,13 +145,58 @@ def generate(models):
             public_implementations.append(f'}}')
             public_implementations.append( '')
 
+    # The iterative walk, see walk_().
+    vector_ids = {key: index for index, key in enumerate(sorted(vector_enters_leaves))}
+
+    step_declarations = []
+    step_implementations = []
+    for model in models.values():
+        modeltype = model['type']
+        if modeltype == 'group_def':
+            continue
+
+        classname = model['name']
+        Classname_ = classname[:1].upper() + classname[1:]
+
+        if not (model.get('subclasses') or modeltype == 'obj_def'):
+            continue
+
+        baseclass = model.get('extends')
+        if baseclass:
+            Baseclass_ = baseclass[:1].upper() + baseclass[1:]
+            first_step = _get_relation_count(models, baseclass)
+        else:
+            Baseclass_ = 'BaseClass'
+            first_step = 1
+
+        step_declarations.append(f'  bool step{Classname_}_(const {classname}* const object, uint32_t step);')
+        step_implementations.append(f'bool UhdmListener::step{Classname_}_(const {classname}* const object, uint32_t step) {{')
+        step_implementations.append(f'  if (step < {first_step}) return step{Baseclass_}_(object, step);')
+        relations = _get_relations(model)
+        if relations:
+            step_implementations.append( '  switch (step) {')
+            for index, (name, type, card, relation_type) in enumerate(relations):
+                step_implementations.append(f'    case {first_step + index}:')
+                step_implementations.extend(reachability.filter_relation(models, relation_type, _get_step_implementation(name, type, card, vector_ids), '      '))
+                step_implementations.append( '      return true;')
+            step_implementations.append( '  }')
+        step_implementations.append( '  return false;')
+        step_implementations.append( '}')
+        step_implementations.append( '')
+
     any_implementation = []
+    enter_typed_implementation = []
+    leave_typed_implementation = []
+    step_any_implementation = []
     uhdm_enter_leave_declarations = []
     public_declarations = []
     for classname in sorted(classnames):
         Classname_ = classname[:1].upper() + classname[1:]
 
         any_implementation.append(f'  case UHDM_OBJECT_TYPE::uhdm{classname}: listen{Classname_}(static_cast<const {classname} *>(object)); break;')
+        enter_typed_implementation.append(f'  case UHDM_OBJECT_TYPE::uhdm{classname}: enter{Classname_}(static_cast<const {classname} *>(object)); return true;')
+        leave_typed_implementation.append(f'  case UHDM_OBJECT_TYPE::uhdm{classname}: leave{Classname_}(static_cast<const {classname} *>(object)); break;')
+        step_any_implementation.append(f'  case UHDM_OBJECT_TYPE::uhdm{classname}: return step{Classname_}_(static_cast<const {classname} *>(object), step);')
 
         uhdm_enter_leave_declarations.append(f'  virtual void enter{Classname_}(const {classname}* const object) {{}}')
         uhdm_enter_leave_declarations.append(f'  virtual void leave{Classname_}(const {classname}* const object) {{}}')
@@ -100,14 +205,18 @@ def generate(models):
         public_declarations.append(f'  void listen{Classname_}(const {classname} *const object);')
 
     enter_leave_vector_declarations = []
+    leave_vector_implementation = []
     for name, type in sorted(vector_enters_leaves):
         Name_ = name[:1].upper() + name[1:]
 
+        leave_vector_implementation.append(f'  case {vector_ids[(name, type)]}: leave{Name_}(object, *reinterpret_cast<const VectorOf{type} *>(objects)); break;')
+
         enter_leave_vector_declarations.append(f'  virtual void enter{Name_}(const any* const object, const VectorOf{type}& objects) {{}}')
         enter_leave_vector_declarations.append(f'  virtual void leave{Name_}(const any* const object, const VectorOf{type}& objects) {{}}')
         enter_leave_vector_declarations.append( '')
 
     private_declarations = sorted(private_declarations)
+    step_declarations = sorted(step_declarations)
 
    # UhdmListener.h
     with open(config.get_template_filepath('UhdmListener.h'), 'rt') as strm:
@@ -115,6 +224,7 @@ def generate(models):
 
     file_content = file_content.replace('<UHDM_PUBLIC_LISTEN_DECLARATIONS>', '\n'.join(public_declarations))
     file_content = file_content.replace('<UHDM_PRIVATE_LISTEN_DECLARATIONS>', '\n'.join(private_declarations))
+    file_content = file_content.replace('<UHDM_PRIVATE_STEP_DECLARATIONS>', '\n'.join(step_declarations))
     file_content = file_content.replace('<UHDM_ENTER_LEAVE_DECLARATIONS>', '\n'.join(uhdm_enter_leave_declarations))
     file_content = file_content.replace('<UHDM_ENTER_LEAVE_VECTOR_DECLARATIONS>', '\n'.join(enter_leave_vector_declarations))
     file_utils.set_content_if_changed(config.get_output_header_filepath('UhdmListener.h'), file_content)
@@ -126,6 +236,12 @@ def generate(models):
     file_content = file_content.replace('<UHDM_PRIVATE_LISTEN_IMPLEMENTATIONS>', '\n'.join(private_implementations))
     file_content = file_content.replace('<UHDM_PUBLIC_LISTEN_IMPLEMENTATIONS>', '\n'.join(public_implementations))
     file_content = file_content.replace('<UHDM_LISTENANY_IMPLEMENTATION>', '\n'.join(any_implementation))
+    file_content = file_content.replace('<UHDM_PRIVATE_STEP_IMPLEMENTATIONS>', '\n'.join(step_implementations))
+    file_content = file_content.replace('<UHDM_REACHABILITY_TABLE>', '\n'.join(reachability.get_reachability_table(models, _get_relation_types, 'UhdmListener')))
+    file_content = file_content.replace('<UHDM_ENTER_TYPED_IMPLEMENTATION>', '\n'.join(enter_typed_implementation))
+    file_content = file_content.replace('<UHDM_LEAVE_TYPED_IMPLEMENTATION>', '\n'.join(leave_typed_implementation))
+    file_content = file_content.replace('<UHDM_STEP_ANY_IMPLEMENTATION>', '\n'.join(step_any_implementation))
+    file_content = file_content.replace('<UHDM_LEAVE_VECTOR_IMPLEMENTATION>', '\n'.join(leave_vector_implementation))
     file_utils.set_content_if_changed(config.get_output_source_filepath('UhdmListener.cpp'), file_content)
 
     return True
@@ -1,5 +1,6 @@
 import config
 import file_utils
+import reachability
 
 
 def _get_listeners(classname, vpi, type, card):
@@ -18,35 +19,79 @@ def _get_listeners(classname, vpi, type, card):
       # Prevent stepping inside tasks while processing calls (task_call, method_task_call) to them
       return listeners
 
-    listeners.append(f'  if (vpiHandle itr = vpi_handle({vpi}, handle)) {{')
     if vpi == 'vpiHighConn':
-      listeners.append(f'    ignoreLastInstance(true);')
-    listeners.append(f'    listenAny(itr);')
+      listeners.append(f'  ignoreLastInstance(true);')
+    listeners.append(f'  listenRelation_(object, {vpi});')
     if vpi == 'vpiHighConn':
-      listeners.append(f'    ignoreLastInstance(false);')
-    listeners.append( '    vpi_free_object(itr);')
-    listeners.append( '  }')
+      listeners.append(f'  ignoreLastInstance(false);')
 
   else:
     if 'uhdmall' in vpi:
       listeners.append(f'  uhdmAllIterator = true;')
 
-    listeners.append(f'  if (vpiHandle itr = vpi_iterate({vpi}, handle)) {{')
-    listeners.append( '    while (vpiHandle obj = vpi_scan(itr)) {')
-    listeners.append(f'      listenAny(obj);')
-    listeners.append( '      vpi_free_object(obj);')
-    listeners.append( '    }')
-    listeners.append( '    vpi_free_object(itr);')
-    listeners.append( '  }')
+    listeners.append(f'  listenRelations_(object, {vpi});')
 
     if 'uhdmall' in vpi:
       listeners.append(f'  uhdmAllIterator = false;')
       listeners.append(f'  visited.clear();')
-      listeners.append(f'  visited.emplace((const any*)((const uhdm_handle*)handle)->object);')
+      listeners.append(f'  visited.emplace(object);')
 
   return listeners
 
 
+def _get_relation_types(model):
+  types = []
+  for key, value in model.allitems():
+    if key in ['class', 'obj_ref', 'class_ref', 'group_ref']:
+      if _get_listeners(model['name'], value.get('vpi'), value.get('type'), value.get('card')):
+        types.append(value.get('type'))
+  return types
+
+
+def _get_steps(classname, vpi, type, card):
+  # Same relations as _get_listeners(), see walk_().
+  if not _get_listeners(classname, vpi, type, card):
+    return []
+
+  steps = []
+  if card == '1':
+    if vpi == 'vpiHighConn':
+      steps.append(f'      ignoreLastInstance(true);')
+      steps.append(f'      pushEnd_(object, work_t::kind_t::EndIgnoreLastInstance);')
+    steps.append(f'      pushRelation_(object, {vpi});')
+
+  else:
+    if 'uhdmall' in vpi:
+      steps.append(f'      uhdmAllIterator = true;')
+      steps.append(f'      pushEnd_(object, work_t::kind_t::EndUhdmAllIterator);')
+    steps.append(f'      pushRelations_(object, {vpi});')
+
+  return steps
+
+
+def _get_relations(models, classname):
+  model = models[classname]
+  relations = []
+  for key, value in model.allitems():
+    if key in ['class', 'obj_ref', 'class_ref', 'group_ref']:
+      vpi  = value.get('vpi')
+      type = value.get('type')
+      card = value.get('card')
+
+      steps = _get_steps(classname, vpi, type, card)
+      if steps:
+        relations.append(reachability.filter_relation(models, type, steps, '      '))
+  return relations
+
+
+def _get_relation_count(models, classname):
+  count = 0
+  while classname:
+    count += len(_get_relations(models, classname))
+    classname = models[classname].get('extends')
+  return count
+
+
 def generate(models):
   private_declarations = []
   private_implementations = []
@@ -64,11 +109,11 @@ def generate(models):
     baseclass = model.get('extends')
 
     if model.get('subclasses') or modeltype == 'obj_def':
-      private_declarations.append(f'  void listen{Classname_}_(vpiHandle handle);')
-      private_implementations.append(f'void VpiListener::listen{Classname_}_(vpiHandle handle) {{')
+      private_declarations.append(f'  void listen{Classname_}_(const any* const object);')
+      private_implementations.append(f'void VpiListener::listen{Classname_}_(const any* const object) {{')
       if baseclass:
         Baseclass_ = baseclass[:1].upper() + baseclass[1:]
-        private_implementations.append(f'  listen{Baseclass_}_(handle);')
+        private_implementations.append(f'  listen{Baseclass_}_(object);')
 
       for key, value in model.allitems():
         if key in ['class', 'obj_ref', 'class_ref', 'group_ref']:
@@ -76,10 +121,7 @@ def generate(models):
           type = value.get('type')
           card = value.get('card')
 
-          if key == 'group_ref':
-            type = 'any'
-
-          private_implementations.extend(_get_listeners(classname, vpi, type, card))
+          private_implementations.extend(reachability.filter_relation(models, type, _get_listeners(classname, vpi, type, card), '  '))
 
       private_implementations.append( '}')
       private_implementations.append( '')
@@ -88,24 +130,68 @@ def generate(models):
       classnames.add(classname)
 
       public_implementations.append(f'void VpiListener::listen{Classname_}(vpiHandle handle) {{')
+      public_implementations.append( '  if (iterative_) {')
+      public_implementations.append( '    walk_(handle, true);')
+      public_implementations.append( '    return;')
+      public_implementations.append( '  }')
       public_implementations.append(f'  const {classname}* object = (const {classname}*) ((const uhdm_handle*)handle)->object;')
       public_implementations.append(f'  callstack.push_back(object);')
       public_implementations.append(f'  enter{Classname_}(object, handle);')
       public_implementations.append( '  if (visited.insert(object).second) {')
-      public_implementations.append(f'    listen{Classname_}_(handle);')
+      public_implementations.append(f'    listen{Classname_}_(object);')
       public_implementations.append( '  }')
       public_implementations.append(f'  leave{Classname_}(object, handle);')
       public_implementations.append(f'  callstack.pop_back();')
       public_implementations.append(f'}}')
       public_implementations.append( '')
 
+  # The iterative walk, see walk_().
+  step_declarations = []
+  step_implementations = []
+  for model in models.values():
+    modeltype = model['type']
+    if modeltype == 'group_def':
+      continue
+
+    classname = model['name']
+    Classname_ = classname[:1].upper() + classname[1:]
+
+    if not (model.get('subclasses') or modeltype == 'obj_def'):
+      continue
+
+    baseclass = model.get('extends')
+    first_step = _get_relation_count(models, baseclass) if baseclass else 0
+
+    step_declarations.append(f'  bool step{Classname_}_(const any* const object, uint32_t step);')
+    step_implementations.append(f'bool VpiListener::step{Classname_}_(const any* const object, uint32_t step) {{')
+    if baseclass and first_step:
+      Baseclass_ = baseclass[:1].upper() + baseclass[1:]
+      step_implementations.append(f'  if (step < {first_step}) return step{Baseclass_}_(object, step);')
+    relations = _get_relations(models, classname)
+    if relations:
+      step_implementations.append( '  switch (step) {')
+      for index, steps in enumerate(relations):
+        step_implementations.append(f'    case {first_step + index}:')
+        step_implementations.extend(steps)
+        step_implementations.append( '      return true;')
+      step_implementations.append( '  }')
+    step_implementations.append( '  return false;')
+    step_implementations.append( '}')
+    step_implementations.append( '')
+
   any_implementation = []
+  enter_typed_implementation = []
+  leave_typed_implementation = []
+  step_any_implementation = []
   enter_leave_declarations = []
   public_declarations = []
   for classname in sorted(classnames):
     Classname_ = classname[:1].upper() + classname[1:]
 
     any_implementation.append(f'    case UHDM_OBJECT_TYPE::uhdm{classname}: listen{Classname_}(handle); break;')
+    enter_typed_implementation.append(f'    case UHDM_OBJECT_TYPE::uhdm{classname}: enter{Classname_}(static_cast<const {classname}*>(object), handle); return true;')
+    leave_typed_implementation.append(f'    case UHDM_OBJECT_TYPE::uhdm{classname}: leave{Classname_}(static_cast<const {classname}*>(object), handle); break;')
+    step_any_implementation.append(f'    case UHDM_OBJECT_TYPE::uhdm{classname}: return step{Classname_}_(object, step);')
 
     enter_leave_declarations.append(f'  virtual void enter{Classname_}(const {classname}* object, vpiHandle handle) {{}}')
     enter_leave_declarations.append(f'  virtual void leave{Classname_}(const {classname}* object, vpiHandle handle) {{}}')
@@ -119,6 +205,7 @@ def generate(models):
 
   file_content = file_content.replace('<VPI_PUBLIC_LISTEN_DECLARATIONS>', '\n'.join(public_declarations))
   file_content = file_content.replace('<VPI_PRIVATE_LISTEN_DECLARATIONS>', '\n'.join(private_declarations))
+  file_content = file_content.replace('<VPI_PRIVATE_STEP_DECLARATIONS>', '\n'.join(step_declarations))
   file_content = file_content.replace('<VPI_ENTER_LEAVE_DECLARATIONS>', '\n'.join(enter_leave_declarations))
   file_utils.set_content_if_changed(config.get_output_header_filepath('VpiListener.h'), file_content)
 
@@ -129,6 +216,11 @@ def generate(models):
   file_content = file_content.replace('<VPI_PRIVATE_LISTEN_IMPLEMENTATIONS>', '\n'.join(private_implementations))
   file_content = file_content.replace('<VPI_PUBLIC_LISTEN_IMPLEMENTATIONS>', '\n'.join(public_implementations))
   file_content = file_content.replace('<VPI_LISTENANY_IMPLEMENTATION>', '\n'.join(any_implementation))
+  file_content = file_content.replace('<VPI_PRIVATE_STEP_IMPLEMENTATIONS>', '\n'.join(step_implementations))
+  file_content = file_content.replace('<VPI_REACHABILITY_TABLE>', '\n'.join(reachability.get_reachability_table(models, _get_relation_types, 'VpiListener')))
+  file_content = file_content.replace('<VPI_ENTER_TYPED_IMPLEMENTATION>', '\n'.join(enter_typed_implementation))
+  file_content = file_content.replace('<VPI_LEAVE_TYPED_IMPLEMENTATION>', '\n'.join(leave_typed_implementation))
+  file_content = file_content.replace('<VPI_STEP_ANY_IMPLEMENTATION>', '\n'.join(step_any_implementation))
   file_utils.set_content_if_changed(config.get_output_source_filepath('VpiListener.cpp'), file_content)
 
   return True
@@ -101,6 +101,24 @@ def generate(models):
         root_schema.append(f'  factory{Classname} @{root_schema_index} : List({Classname});')
         root_schema_index += 1
 
+    # Only set in files written by Serializer::SaveDelta(), after the
+    # factories so they don't renumber them.
+    for name, type in [('deltaBaseObjectId', 'UInt32'), ('deltaBaseSymbolCount', 'UInt32'),
+                       ('deltaObjects', 'List(ObjIndexType)'), ('deltaRemoved', 'List(ObjIndexType)')]:
+        root_schema.append(f'  {name} @{root_schema_index} : {type};')
+        root_schema_index += 1
+
+    # Symbols of full saves, replaces the symbols list, see
+    # SymbolFactory::WritePool().
+    root_schema.append(f'  symbolPool @{root_schema_index} : Data;')
+    root_schema_index += 1
+
+    # Unchanged objects of a delta whose UhdmId differs from their base
+    # version, see Serializer::SaveDelta().
+    for name, type in [('deltaRenumbered', 'List(ObjIndexType)'), ('deltaRenumberedIds', 'List(UInt64)')]:
+        root_schema.append(f'  {name} @{root_schema_index} : {type};')
+        root_schema_index += 1
+
     with open(config.get_template_filepath('UHDM.capnp'), 'rt') as strm:
         file_content = strm.read()
 
@@ -35,19 +35,26 @@ def _get_declarations(type, vpi, card, real_type=''):
             content.append(f'  {virtual}{type} {Vpi_}() const{final} {{ return {vpi}_; }}')
             content.append(f'  {virtual}bool {Vpi_}({type} data){final} {{\n    {check}{vpi}_ = data;\n    return true;\n  }}')
         else:
-            content.append(f'  {virtual}{type}* {Vpi_}() {final} {{ return {vpi}_; }}')
-            content.append(f'  {virtual}const {type}* {Vpi_}() const{final} {{ return {vpi}_; }}')
+            content.append(f'  {virtual}{type}* {Vpi_}() {final} {{\n    Materialize();\n    return {vpi}_;\n  }}')
+            content.append(f'  {virtual}const {type}* {Vpi_}() const{final} {{\n    Materialize();\n    return {vpi}_;\n  }}')
             content.append( '  template <typename T>')
             content.append(f'  T* {Vpi_}() {{')
+            content.append( '    Materialize();')
             content.append(f'    return ({vpi}_ == nullptr) ? nullptr : any_cast<T*>({vpi}_);')
             content.append( '  }')
             content.append( '  template <typename T>')
             content.append(f'  const T* {Vpi_}() const {{')
+            content.append( '    Materialize();')
             content.append(f'    return ({vpi}_ == nullptr) ? nullptr : any_cast<const T*>({vpi}_);')
             content.append( '  }')
             content.append(f'  {virtual}bool {Vpi_}({type}* data){final} {{\n    {check}{vpi}_ = data;\n    return true;\n  }}')
+    elif card == 'any' and config.compact_layout():
+        # Most relations of card any are left unset, they're kept with the
+        # client data rather than inline, see BaseClass::GetSparse().
+        content.append(f'  VectorOf{type}* {Vpi_}() const {{\n    Materialize();\n    return static_cast<VectorOf{type}*>(GetSparse(uhdm{vpi}));\n  }}')
+        content.append(f'  bool {Vpi_}(VectorOf{type}* data) {{\n    {check}SetSparse(uhdm{vpi}, data);\n    return true;\n  }}')
     elif card == 'any':
-        content.append(f'  VectorOf{type}* {Vpi_}() const {{ return {vpi}_; }}')
+        content.append(f'  VectorOf{type}* {Vpi_}() const {{\n    Materialize();\n    return {vpi}_;\n  }}')
         content.append(f'  bool {Vpi_}(VectorOf{type}* data) {{\n    {check}{vpi}_ = data;\n    return true;\n  }}')
 
     return '\n'.join(content)
@@ -78,16 +85,16 @@ def _get_implementations(classname, type, vpi, card):
         content.append(f'      const_cast<{classname}*>(this)->VpiFullName(fullName);')
         content.append( '    }')
         content.append( '  }')
-        content.append(f'  return serializer_->GetSymbol({vpi}_);')
+        content.append(f'  return GetSerializer()->GetSymbol({vpi}_);')
         content.append( '}')
     else:
         content.append(f'std::string_view {classname}::{Vpi_}() const {{')
-        content.append(f'  return {vpi}_ ? serializer_->GetSymbol({vpi}_) : kEmpty;')
+        content.append(f'  return {vpi}_ ? GetSerializer()->GetSymbol({vpi}_) : kEmpty;')
         content.append(f'}}')
 
     content.append('')
     content.append(f'bool {classname}::{Vpi_}(std::string_view data) {{')
-    content.append(f'  {vpi}_ = serializer_->MakeSymbol(data);')
+    content.append(f'  {vpi}_ = GetSerializer()->MakeSymbol(data);')
     content.append(f'  return true;')
     content.append(f'}}')
     content.append('')
@@ -113,7 +120,7 @@ def _get_data_member(type, vpi, card):
         else:
             content.append(f'  {type}{pointer} {vpi}_ = {default_assignment};')
 
-    elif card == 'any':
+    elif (card == 'any') and not config.compact_layout():
         content.append(f'  VectorOf{type}* {vpi}_ = nullptr;')
 
     return content
@@ -351,8 +358,9 @@ def _get_GetByVpiName_implementation(model):
                 if key != 'group_ref':
                     includes.add(value.get('type'))
 
-                content.append(f'  if ({name}_ != nullptr) {{')
-                content.append(f'    for (const BaseClass *ref : *{name}_) {{')
+                Name = name[:1].upper() + name[1:]
+                content.append(f'  if (const auto *const refs = {Name}()) {{')
+                content.append(f'    for (const BaseClass *ref : *refs) {{')
                 content.append(f'      if (ref->VpiName().compare(name) == 0) return ref;')
                 content.append( '    }')
                 content.append( '  }')
@@ -384,7 +392,7 @@ def _get_GetByVpiType_implementation(model, models):
                 case_bodies[vpi] = (case_bodies.get(vpi, (None, None))[0], name)
 
     content = []
-    content.append(f'std::tuple<const BaseClass*, UHDM_OBJECT_TYPE, const std::vector<const BaseClass*>*> {classname}::GetByVpiType(int32_t type) const {{')
+    content.append(f'std::tuple<const BaseClass*, UHDM_OBJECT_TYPE, const RelationVector<const BaseClass>*> {classname}::GetByVpiType(int32_t type) const {{')
 
     if (modeltype == 'obj_def') or case_bodies:
         content.append(f'  switch (type) {{')
@@ -392,12 +400,13 @@ def _get_GetByVpiType_implementation(model, models):
     if case_bodies:
         for vpi in sorted(case_bodies.keys()):
             name1, name_any = case_bodies[vpi]
+            Name_any = (name_any[:1].upper() + name_any[1:]) if name_any else None
             if name1 and name_any:
-                content.append(f'    case {vpi}: return std::make_tuple({name1}_, uhdm{name_any}, (const std::vector<const BaseClass*>*){name_any}_);')
+                content.append(f'    case {vpi}: return std::make_tuple({name1}_, uhdm{name_any}, (const RelationVector<const BaseClass>*){Name_any}());')
             elif name1:
                 content.append(f'    case {vpi}: return std::make_tuple({name1}_, static_cast<UHDM_OBJECT_TYPE>(0), nullptr);')
             else:
-                content.append(f'    case {vpi}: return std::make_tuple(nullptr, uhdm{name_any}, (const std::vector<const BaseClass*>*){name_any}_);')
+                content.append(f'    case {vpi}: return std::make_tuple(nullptr, uhdm{name_any}, (const RelationVector<const BaseClass>*){Name_any}());')
 
     if modeltype == 'obj_def' or case_bodies:
         content.append( '  }')
@@ -584,6 +593,33 @@ def _get_Compare_implementation(model):
     return content, includes
 
 
+def _get_RenumberSymbols_implementation(model):
+    classname = model['name']
+    symbols = []
+    for key, value in model.allitems():
+        if key != 'property':
+            continue
+
+        vpi = value.get('vpi')
+        type = value.get('type')
+        if (value.get('name') != 'type') and (value.get('card') == '1') and (type in ['string', 'value', 'delay']):
+            symbols.append(f'  {vpi}_ = renumbering->Renumber({vpi}_);')
+
+    if not symbols:
+        return []
+
+    content = [
+        f'void {classname}::RenumberSymbols(SymbolRenumbering* renumbering) {{',
+         '  basetype_t::RenumberSymbols(renumbering);',
+    ]
+    content.extend(symbols)
+    content.extend([
+        '}',
+        ''
+    ])
+    return content
+
+
 _cached_members = {}
 def _get_group_members_recursively(model, models):
     global _cached_members
@@ -712,7 +748,7 @@ def _generate_one_class(model, models, templates):
         declarations.append(f'  virtual {return_type}* DeepClone(BaseClass* parent, CloneContext* context) const override;')
 
     declarations.append('  virtual const BaseClass* GetByVpiName(std::string_view name) const override;')
-    declarations.append('  virtual std::tuple<const BaseClass*, UHDM_OBJECT_TYPE, const std::vector<const BaseClass*>*> GetByVpiType(int32_t type) const override;')
+    declarations.append('  virtual std::tuple<const BaseClass*, UHDM_OBJECT_TYPE, const RelationVector<const BaseClass>*> GetByVpiType(int32_t type) const override;')
     declarations.append('  virtual vpi_property_value_t GetVpiPropertyValue(int32_t property) const override;')
     declarations.append('  virtual int32_t Compare(const BaseClass* other, CompareContext* context) const override;')
 
@@ -731,6 +767,11 @@ def _generate_one_class(model, models, templates):
     implementations.extend(func_body)
     includes.update(func_includes)
 
+    func_body = _get_RenumberSymbols_implementation(model)
+    if func_body:
+        declarations.append('  virtual void RenumberSymbols(SymbolRenumbering* renumbering) override;')
+        implementations.extend(func_body)
+
     includes.update(forward_declares)
 
     is_class_def = modeltype == 'class_def'
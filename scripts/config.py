@@ -10,6 +10,8 @@ _templates_dirname = 'templates'
 _output_headers_dirname = 'uhdm'
 _output_sources_dirname = 'src'
 _verbose = True
+_compact_layout = False
+_pooled_relations = False
 
 _log_mutex = Lock()
 
@@ -32,6 +34,8 @@ def log(text, end='\n'):
 def configure(args=None):
     global _source_dirpath
     global _output_dirpath
+    global _compact_layout
+    global _pooled_relations
 
     if args:
         if args.source_dirpath:
@@ -40,6 +44,9 @@ def configure(args=None):
         if args.output_dirpath:
             _output_dirpath = args.output_dirpath
 
+        _compact_layout = getattr(args, 'compact_layout', False)
+        _pooled_relations = getattr(args, 'pooled_relations', False)
+
 
     output_headers_dirpath = os.path.join(_output_dirpath, _output_headers_dirname)
     if not os.path.exists(output_headers_dirpath):
@@ -52,6 +59,16 @@ def configure(args=None):
     print(f'Configuration update: srcdir={_source_dirpath}, headers={output_headers_dirpath}, sources={output_sources_dirpath}')
 
 
+def compact_layout():
+    global _compact_layout
+    return _compact_layout
+
+
+def pooled_relations():
+    global _pooled_relations
+    return _pooled_relations
+
+
 def get_source_dirpath():
     global _source_dirpath
     return _source_dirpath
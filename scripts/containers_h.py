@@ -24,8 +24,8 @@ def generate(models):
 
     containers = []
     for type in sorted(types):
-        containers.append(f'  typedef std::vector<{type}*> VectorOf{type};')
-        containers.append(f'  typedef std::vector<{type}*>::iterator VectorOf{type}Itr;')
+        containers.append(f'  typedef RelationVector<{type}> VectorOf{type};')
+        containers.append(f'  typedef VectorOf{type}::iterator VectorOf{type}Itr;')
         containers.append('')
     containers = '\n'.join(containers)
 
@@ -83,6 +83,10 @@ def _main():
     parser.add_argument('-output-dirpath', dest='output_dirpath', type=str, help='Output path')
     parser.add_argument('--parallel', dest='parallel', action='store_true', default=True)
     parser.add_argument('--source-dirpath', dest='source_dirpath', type=str, help='Path to UHDM source')
+    parser.add_argument('--compact-layout', dest='compact_layout', action='store_true', default=False,
+                        help='Smaller objects: no serializer pointer, interned locations, sparse relations')
+    parser.add_argument('--pooled-relations', dest='pooled_relations', action='store_true', default=False,
+                        help='Relation vectors allocated from per factory pools, see RelationPool')
     args = parser.parse_args()
     config.configure(args)
 
@@ -122,6 +126,8 @@ def _main():
             config.get_template_filepath('ElaboratorListener.h'): config.get_output_header_filepath('ElaboratorListener.h'),
             config.get_template_filepath('ExprEval.h'): config.get_output_header_filepath('ExprEval.h'),
             config.get_template_filepath('ExprEval.cpp'): config.get_output_source_filepath('ExprEval.cpp'),
+            config.get_template_filepath('BlockCodec.h'): config.get_output_header_filepath('BlockCodec.h'),
+            config.get_template_filepath('BlockCodec.cpp'): config.get_output_source_filepath('BlockCodec.cpp'),
             config.get_template_filepath('NumUtils.h'): config.get_output_header_filepath('NumUtils.h'),
             config.get_template_filepath('NumUtils.cpp'): config.get_output_source_filepath('NumUtils.cpp'),
             config.get_template_filepath('UhdmLint.h'): config.get_output_header_filepath('UhdmLint.h'),
@@ -130,11 +136,18 @@ def _main():
             config.get_template_filepath('UhdmAdjuster.cpp'): config.get_output_source_filepath('UhdmAdjuster.cpp'),
             config.get_template_filepath('SynthSubset.h'): config.get_output_header_filepath('SynthSubset.h'),
             config.get_template_filepath('SynthSubset.cpp'): config.get_output_source_filepath('SynthSubset.cpp'),
+            config.get_template_filepath('RelationPool.h'): config.get_output_header_filepath('RelationPool.h'),
+            config.get_template_filepath('RelationPool.cpp'): config.get_output_source_filepath('RelationPool.cpp'),
             config.get_template_filepath('RTTI.h'): config.get_output_header_filepath('RTTI.h'),
+            config.get_template_filepath('VisitedSet.h'): config.get_output_header_filepath('VisitedSet.h'),
+            config.get_template_filepath('VisitedSet.cpp'): config.get_output_source_filepath('VisitedSet.cpp'),
             config.get_template_filepath('SymbolId.h'): config.get_output_header_filepath('SymbolId.h'),
             config.get_template_filepath('SymbolId.cpp'): config.get_output_source_filepath('SymbolId.cpp'),
+            config.get_template_filepath('Serializer_restore.h'): config.get_output_source_filepath('Serializer_restore.h'),
             config.get_template_filepath('SymbolFactory.h'): config.get_output_header_filepath('SymbolFactory.h'),
             config.get_template_filepath('SymbolFactory.cpp'): config.get_output_source_filepath('SymbolFactory.cpp'),
+            config.get_template_filepath('ThreadPool.h'): config.get_output_header_filepath('ThreadPool.h'),
+            config.get_template_filepath('ParallelUhdmListener.h'): config.get_output_header_filepath('ParallelUhdmListener.h'),
             config.get_template_filepath('uhdm_vpi_user.h'): config.get_output_header_filepath('uhdm_vpi_user.h'),
             config.get_template_filepath('vpi_uhdm.h'): config.get_output_header_filepath('vpi_uhdm.h'),
 
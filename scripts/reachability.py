@@ -0,0 +1,136 @@
+import uhdm_types_h
+
+
+def _get_concrete_types(models, name, cache):
+    # The obj_def types an object declared of type name can be.
+    if name in cache:
+        return cache[name]
+
+    cache[name] = set()
+    model = models.get(name)
+    if not model:
+        return cache[name]
+
+    concrete = set()
+    if model['type'] == 'group_def':
+        for key, value in model.allitems():
+            if key in ['obj_ref', 'class_ref', 'group_ref']:
+                member = value.get('name')
+                if member not in models:
+                    member = value.get('type')
+                concrete.update(_get_concrete_types(models, member, cache))
+    else:
+        for classname in {name} | model['subclasses']:
+            if models[classname]['type'] == 'obj_def':
+                concrete.add(classname)
+
+    cache[name] = concrete
+    return concrete
+
+
+def get_reachability_table(models, get_relation_types, classname):
+    """
+    Returns the lines of the C++ definition of the static table of the types
+    that the walk of a listener can reach from each type, and of
+    <classname>::canReach(). get_relation_types(model) lists the types of the
+    relations of the model the walk follows.
+    """
+    type_map = uhdm_types_h.get_type_map(models)
+    first_id = min(type_map.values())
+    type_count = max(type_map.values()) - first_id + 1
+    word_count = (type_count + 63) // 64
+
+    def _bit(name):
+        return 1 << (type_map[f'uhdm{name}'] - first_id)
+
+    cache = {}
+    concretes = set()
+    for name in models:
+        concretes.update(_get_concrete_types(models, name, cache))
+
+    # Types of the objects the walk goes to from each concrete type.
+    targets = {}
+    for name in concretes:
+        targets[name] = set()
+        classname_ = name
+        while classname_:
+            model = models[classname_]
+            for type in get_relation_types(model):
+                targets[name].update(_get_concrete_types(models, type, cache))
+            classname_ = model.get('extends')
+
+    reach = {name: _bit(name) for name in concretes}
+    changed = True
+    while changed:
+        changed = False
+        for name in concretes:
+            bits = reach[name]
+            for target in targets[name]:
+                bits |= reach[target]
+            if bits != reach[name]:
+                reach[name] = bits
+                changed = True
+
+    # Rows and columns of the class and group types stand for all their
+    # concrete types.
+    rows = {}
+    for name in models:
+        bits = 0
+        for concrete in cache[name]:
+            bits |= reach[concrete]
+        rows[name] = bits
+
+    members = {name: sum(_bit(concrete) for concrete in cache[name]) for name in models}
+    for name, bits in rows.items():
+        for member, member_bits in members.items():
+            if bits & member_bits:
+                bits |= _bit(member)
+        rows[name] = bits
+
+    lines = []
+    lines.append(f'static constexpr uint32_t kFirstType = {first_id};')
+    lines.append(f'static constexpr uint32_t kTypeCount = {type_count};')
+    lines.append( '// Types reachable by the walk from each type, as bitmaps indexed by')
+    lines.append( '// type - kFirstType.')
+    lines.append(f'static const uint64_t kReachable[kTypeCount][{word_count}] = {{')
+    for typename, id in sorted(type_map.items(), key=lambda item: item[1]):
+        bits = rows.get(typename[4:], 0)
+        words = ', '.join([f'0x{(bits >> (64 * i)) & 0xFFFFFFFFFFFFFFFF:016x}' for i in range(word_count)])
+        lines.append(f'  /* {typename[4:]} */ {{{words}}},')
+    lines.append( '};')
+    lines.append( '')
+    lines.append(f'bool {classname}::canReach(UHDM_OBJECT_TYPE from, UHDM_OBJECT_TYPE to) {{')
+    lines.append( '  const uint32_t f = static_cast<uint32_t>(from) - kFirstType;')
+    lines.append( '  const uint32_t t = static_cast<uint32_t>(to) - kFirstType;')
+    lines.append( '  if ((f >= kTypeCount) || (t >= kTypeCount)) return false;')
+    lines.append( '  return ((kReachable[f][t / 64] >> (t % 64)) & 1) != 0;')
+    lines.append( '}')
+    lines.append( '')
+    lines.append(f'void {classname}::setTypeFilter(const std::unordered_set<UHDM_OBJECT_TYPE>& types) {{')
+    lines.append( '  relevant_.clear();')
+    lines.append( '  if (types.empty()) return;')
+    lines.append( '  relevant_.resize(kFirstType + kTypeCount, false);')
+    lines.append( '  for (uint32_t from = kFirstType; from < kFirstType + kTypeCount; ++from) {')
+    lines.append( '    for (UHDM_OBJECT_TYPE to : types) {')
+    lines.append( '      if (canReach(static_cast<UHDM_OBJECT_TYPE>(from), to)) {')
+    lines.append( '        relevant_[from] = true;')
+    lines.append( '        break;')
+    lines.append( '      }')
+    lines.append( '    }')
+    lines.append( '  }')
+    lines.append( '}')
+    return lines
+
+
+def filter_relation(models, type, lines, indent):
+    """
+    Wraps the lines walking a relation of the given type so that the walk
+    skips it when the type filter of the listener rules it out. Relations to
+    types outside of the models are always walked.
+    """
+    if not lines or type not in models:
+        return lines
+
+    return [f'{indent}if (isRelevant_(UHDM_OBJECT_TYPE::uhdm{type})) {{'] + \
+           [f'  {line}' for line in lines] + \
+           [f'{indent}}}']
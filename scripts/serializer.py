@@ -5,22 +5,46 @@ import file_utils
 import uhdm_types_h
 
 
+def _get_any_relation_count(model, models):
+    count = 0
+    while model:
+        for key, value in model.allitems():
+            if (key in ['class', 'obj_ref', 'class_ref', 'group_ref']) and (value.get('card') == 'any'):
+                count += 1
+        model = models.get(model.get('extends'))
+    return count
+
+
 def generate(models):
     factory_data_members = []
     factory_function_declarations = []
     factory_function_implementations = []
     factory_purge = []
+    factory_compact = []
     factory_gc = []
+    factory_renumber_symbols = []
     factory_stats = []
+    factory_bytes = []
+    factory_memory = []
     factory_get_object = []
+    factory_make_object = []
     factory_erase_object = []
 
     save_ids = []
+    save_layout = []
+    save_stream = []
+    save_shard = []
+    save_delta = []
+    delta_base = []
     save_objects = []
     saves_adapters = []
+    allocate_adapters = []
 
     restore_ids = []
+    restore_lazy_ids = []
     restore_objects = []
+    restore_object = []
+    restore_delta = []
     restore_adapters = []
 
     type_map = uhdm_types_h.get_type_map(models)
@@ -42,25 +66,48 @@ def generate(models):
             factory_function_declarations.append(f'  {classname}* Make{Classname_}();')
             factory_function_implementations.append(f'{classname}* Serializer::Make{Classname_}() {{ return Make<{classname}>(&{classname}Maker); }}')
             factory_get_object.append(f'    case UHDM_OBJECT_TYPE::uhdm{classname} /* = {type_map["uhdm" + classname]} */: return {classname}Maker.objects_[index];')
+            factory_make_object.append(f'    case UHDM_OBJECT_TYPE::uhdm{classname} /* = {type_map["uhdm" + classname]} */: return MakeAt(&{classname}Maker, index);')
             factory_erase_object.append(f'    case UHDM_OBJECT_TYPE::uhdm{classname} /* = {type_map["uhdm" + classname]} */: return {classname}Maker.Erase(static_cast<const {classname}*>(p));')
 
             save_ids.append(f'  {classname}Maker.MapToIndex(idMap);')
-            save_objects.append(f'  adapter.template operator()<{classname}, {Classname}>({classname}Maker, this, idMap, cap_root.initFactory{Classname}({classname}Maker.objects_.size()));')
-
-            restore_ids.append(f'  Make(&{classname}Maker, cap_root.getFactory{Classname}().size());')
-            restore_objects.append(f'  adapter.template operator()<{classname}, {Classname}>(cap_root.getFactory{Classname}(), this, {classname}Maker.objects_);')
+            save_objects.append(f'    adapter.template operator()<{classname}, {Classname}>({classname}Maker, this, cap_root.initFactory{Classname}({classname}Maker.objects_.size()));')
+            save_shard.append(f'    adapter.template operator()<{classname}, {Classname}>(shard.Objects(UHDM_OBJECT_TYPE::uhdm{classname}), this, cap_root.initFactory{Classname}(shard.Objects(UHDM_OBJECT_TYPE::uhdm{classname}).size()));')
+            save_delta.append(f'  adapter.template operator()<{classname}, {Classname}>({classname}Maker, this, base_root.getFactory{Classname}(), cap_root,')
+            save_delta.append(f'      [](UhdmRoot::Builder root, uint32_t n) {{ return root.initFactory{Classname}(n); }});')
+            save_stream.append(f'  adapter.template operator()<{classname}, {Classname}>({classname}Maker, this, &stream,')
+            save_stream.append(f'      [](UhdmRoot::Builder root, uint32_t n) {{ return root.initFactory{Classname}(n); }});')
+            delta_base.append(f'  plan.AddBase<{Classname}>(UHDM_OBJECT_TYPE::uhdm{classname}, base_root.getFactory{Classname}());')
+            save_layout.append(f'    adapter.template operator()<{classname}, {Classname}>({classname}Maker, this, cap_root.initFactory{Classname}({classname}Maker.objects_.size()), &tasks);')
+
+            restore_ids.append(f'    shard->SetOffset(UHDM_OBJECT_TYPE::uhdm{classname}, Make(&{classname}Maker, shard_root.getFactory{Classname}().size()));')
+            restore_lazy_ids.append(f'    context->InitLazySlots(UHDM_OBJECT_TYPE::uhdm{classname}, {classname}Maker.AddSlots(cap_root.getFactory{Classname}().size()), cap_root.getFactory{Classname}().size());')
+            restore_objects.append(f'    adapter.template operator()<{classname}, {Classname}>(shard_root.getFactory{Classname}(), this, {classname}Maker.objects_, shard->GetOffset(UHDM_OBJECT_TYPE::uhdm{classname}), &tasks);')
+            restore_delta.append(f'  adapter.template operator()<{classname}, {Classname}>(base_root.getFactory{Classname}(), delta_root.getFactory{Classname}(), this, &{classname}Maker, &layout, UHDM_OBJECT_TYPE::uhdm{classname}, &tasks);')
+            restore_object.append(f'    case UHDM_OBJECT_TYPE::uhdm{classname}: adapter(cap_root.getFactory{Classname}()[index], this, static_cast<{classname}*>(obj)); break;')
 
             factory_purge.append(f'  {classname}Maker.Purge();')
+            factory_compact.append(f'  {classname}Maker.Compact();')
             if classname != 'package':
-                factory_gc.append(f'  {classname}Maker.EraseIfNotIn(visited);')
-            factory_stats.append(f'  stats.insert(std::make_pair("{classname}", {classname}Maker.objects_.size()));')
+                factory_gc.append(f'  reclaimed += {classname}Maker.Sweep(TypeMarks(marks, UHDM_OBJECT_TYPE::uhdm{classname}));')
+            factory_renumber_symbols.append(f'  {classname}Maker.ForEach([&renumbering]({classname}* object) {{ object->RenumberSymbols(&renumbering); }});')
+            factory_stats.append(f'  stats.insert(std::make_pair("{classname}", {classname}Maker.Size()));')
+            if config.compact_layout():
+                factory_bytes.append(f'  bytes.emplace("{classname}", std::make_pair({classname}Maker.Bytes(), InlineLayoutSize(sizeof({classname}), {_get_any_relation_count(model, models)})));')
+            else:
+                factory_bytes.append(f'  bytes.emplace("{classname}", std::make_pair({classname}Maker.Bytes(), sizeof({classname})));')
+
+            factory_memory.append(f'  AddObjectUsage(&stats.m_objects, "{classname}", {classname}Maker);')
 
+        factory_memory.append(f'  AddRelationUsage(&stats.m_relations, "{classname}", {classname}VectMaker);')
         factory_data_members.append(f'  VectorOf{classname}Factory {classname}VectMaker;')
-        factory_function_declarations.append(f'  std::vector<{classname}*>* Make{Classname_}Vec();')
-        factory_function_implementations.append(f'std::vector<{classname}*>* Serializer::Make{Classname_}Vec() {{ return Make<{classname}>(&{classname}VectMaker); }}')
+        factory_function_declarations.append(f'  RelationVector<{classname}>* Make{Classname_}Vec();')
+        factory_function_implementations.append(f'RelationVector<{classname}>* Serializer::Make{Classname_}Vec() {{ return Make<{classname}>(&{classname}VectMaker); }}')
 
-        saves_adapters.append(f'  void operator()(const {classname} *const obj, Serializer *const serializer, const Serializer::IdMap &idMap, {Classname}::Builder builder) const {{')
-        saves_adapters.append(f'    operator()(static_cast<const {basename}*>(obj), serializer, idMap, builder.getBase());')
+        saves_adapters.append(f'  void operator()(const {classname} *const obj, Serializer *const serializer, {Classname}::Builder builder) const {{')
+        saves_adapters.append(f'    operator()(static_cast<const {basename}*>(obj), serializer, builder.getBase());')
+
+        allocate_adapters.append(f'  void Allocate(const {classname} *const obj, {Classname}::Builder builder) const {{')
+        allocate_adapters.append(f'    Allocate(static_cast<const {basename}*>(obj), builder.getBase());')
 
         restore_adapters.append(f'  void operator()({Classname}::Reader reader, Serializer *const serializer, {classname} *const obj) const {{')
         restore_adapters.append(f'    operator()(reader.getBase(), serializer, static_cast<{basename}*>(obj));')
@@ -78,8 +125,12 @@ def generate(models):
                 Vpi_ = vpi[:1].upper() + vpi[1:]
                 Vpi = Vpi_.replace('_', '')
 
-                if type in ['string', 'value', 'delay']:
-                    saves_adapters.append(f'    builder.set{Vpi}((RawSymbolId)serializer->symbolMaker.Make(obj->{Vpi_}()));')
+                if vpi == 'vpiFullName':
+                    # Saved as held, full names aren't computed to be saved.
+                    saves_adapters.append(f'    builder.set{Vpi}(SaveSymbolId(serializer, obj->{vpi}_));')
+                    restore_adapters.append(f'    obj->{Vpi_}(serializer->symbolMaker.GetSymbol(SymbolId(reader.get{Vpi}(), kUnknownRawSymbol)));')
+                elif type in ['string', 'value', 'delay']:
+                    saves_adapters.append(f'    builder.set{Vpi}(SaveSymbol(serializer, obj->{Vpi_}()));')
                     restore_adapters.append(f'    obj->{Vpi_}(serializer->symbolMaker.GetSymbol(SymbolId(reader.get{Vpi}(), kUnknownRawSymbol)));')
                 else:
                     saves_adapters.append(f'    builder.set{Vpi}(obj->{Vpi_}());')
@@ -108,40 +159,44 @@ def generate(models):
                     if key in ['class_ref', 'group_ref']:
                         saves_adapters.append(f'    if (obj->{Name_}() != nullptr) {{')
                         saves_adapters.append(f'      ::ObjIndexType::Builder tmp = builder.get{Name}();')
-                        saves_adapters.append(f'      tmp.setIndex(GetId(obj->{Name_}(), idMap));')
+                        saves_adapters.append(f'      tmp.setIndex(GetId(obj->{Name_}(), serializer));')
                         saves_adapters.append(f'      tmp.setType(static_cast<uint32_t>((obj->{Name_}())->UhdmType()));')
                         saves_adapters.append( '    }')
 
+                        allocate_adapters.append(f'    if (obj->{Name_}() != nullptr) builder.get{Name}();')
+
                         restore_adapters.append(f'    obj->{Name_}(({type}*)serializer->GetObject(reader.get{Name}().getType(), reader.get{Name}().getIndex() - 1));')
                     else:
-                        saves_adapters.append(f'    if (obj->{Name_}() != nullptr) builder.set{Name}(GetId(obj->{Name_}(), idMap));')
+                        saves_adapters.append(f'    if (obj->{Name_}() != nullptr) builder.set{Name}(GetId(obj->{Name_}(), serializer));')
 
                         restore_adapters.append(f'    if (reader.get{Name}()) {{')
-                        restore_adapters.append(f'      obj->{Name_}(serializer->{type}Maker.objects_[reader.get{Name}() - 1]);')
+                        restore_adapters.append(f'      obj->{Name_}(({type}*)serializer->GetObject(static_cast<uint32_t>(UHDM_OBJECT_TYPE::uhdm{type}), reader.get{Name}() - 1));')
                         restore_adapters.append( '    }')
 
                 else:
                     obj_key = '::ObjIndexType' if key in ['class_ref', 'group_ref'] else '::uint64_t'
 
-                    saves_adapters.append(f'    if (obj->{Name_}() != nullptr) {{')
-                    saves_adapters.append(f'      ::capnp::List<{obj_key}>::Builder {Name}s = builder.init{Name}(obj->{Name_}()->size());')
+                    # Empty vectors restore as nullptr, save them as such.
+                    saves_adapters.append(f'    if ((obj->{Name_}() != nullptr) && !obj->{Name_}()->empty()) {{')
+                    saves_adapters.append(f'      ::capnp::List<{obj_key}>::Builder {Name}s = builder.has{Name}() ? builder.get{Name}() : builder.init{Name}(obj->{Name_}()->size());')
+
+                    allocate_adapters.append(f'    if ((obj->{Name_}() != nullptr) && !obj->{Name_}()->empty()) builder.init{Name}(obj->{Name_}()->size());')
                     saves_adapters.append(f'      for (int32_t i = 0, n = obj->{Name_}()->size(); i < n; ++i) {{')
 
                     restore_adapters.append(f'    if (uint32_t n = reader.get{Name}().size()) {{')
-                    restore_adapters.append(f'      std::vector<{type}*>* vect = serializer->{type}VectMaker.Make();')
-                    restore_adapters.append(f'      vect->reserve(n);')
+                    restore_adapters.append(f'      RelationVector<{type}>* vect = MakeVect(&serializer->{type}VectMaker, n);')
                     restore_adapters.append(f'      for (uint32_t i = 0; i < n; ++i) {{')
 
                     if key in ['class_ref', 'group_ref']:
                         saves_adapters.append(f'        ::ObjIndexType::Builder tmp = {Name}s[i];')
-                        saves_adapters.append(f'        tmp.setIndex(GetId((*obj->{Name_}())[i], idMap));')
+                        saves_adapters.append(f'        tmp.setIndex(GetId((*obj->{Name_}())[i], serializer));')
                         saves_adapters.append(f'        tmp.setType(static_cast<uint32_t>(((BaseClass*)((*obj->{Name_}())[i]))->UhdmType()));')
 
-                        restore_adapters.append(f'        vect->emplace_back(({type}*)serializer->GetObject(reader.get{Name}()[i].getType(), reader.get{Name}()[i].getIndex() - 1));')
+                        restore_adapters.append(f'        AddObject(serializer, vect, reader.get{Name}()[i].getType(), reader.get{Name}()[i].getIndex() - 1);')
                     else:
-                        saves_adapters.append(f'        {Name}s.set(i, GetId((*obj->{Name_}())[i], idMap));')
+                        saves_adapters.append(f'        {Name}s.set(i, GetId((*obj->{Name_}())[i], serializer));')
 
-                        restore_adapters.append(f'        vect->emplace_back(serializer->{type}Maker.objects_[reader.get{Name}()[i] - 1]);')
+                        restore_adapters.append(f'        AddObject(serializer, vect, static_cast<uint32_t>(UHDM_OBJECT_TYPE::uhdm{type}), reader.get{Name}()[i] - 1);')
 
                     saves_adapters.append('      }')
                     saves_adapters.append('    }')
@@ -153,6 +208,9 @@ def generate(models):
         saves_adapters.append('  }')
         saves_adapters.append('')
 
+        allocate_adapters.append('  }')
+        allocate_adapters.append('')
+
         restore_adapters.append('  }')
         restore_adapters.append('')
 
@@ -172,9 +230,13 @@ def generate(models):
 
     file_content = file_content.replace('<CAPNP_ID>', '\n'.join(save_ids))
     file_content = file_content.replace('<FACTORY_GC>', '\n'.join(factory_gc))
+    file_content = file_content.replace('<FACTORY_RENUMBER_SYMBOLS>', '\n'.join(factory_renumber_symbols))
     file_content = file_content.replace('<UHDM_NAME_MAP>', '\n'.join(uhdm_name_map))
     file_content = file_content.replace('<FACTORY_PURGE>', '\n'.join(sorted(factory_purge)))
+    file_content = file_content.replace('<FACTORY_COMPACT>', '\n'.join(sorted(factory_compact)))
     file_content = file_content.replace('<FACTORY_STATS>', '\n'.join(sorted(factory_stats)))
+    file_content = file_content.replace('<FACTORY_BYTES>', '\n'.join(sorted(factory_bytes)))
+    file_content = file_content.replace('<FACTORY_MEMORY>', '\n'.join(factory_memory))
     file_content = file_content.replace('<FACTORY_ERASE_OBJECT>', '\n'.join(sorted(factory_erase_object)))
     file_utils.set_content_if_changed(config.get_output_source_filepath('Serializer.cpp'), file_content)
 
@@ -183,7 +245,12 @@ def generate(models):
         file_content = strm.read()
 
     file_content = file_content.replace('<CAPNP_SAVE>', '\n'.join(save_objects))
-    file_content = file_content.replace('<CAPNP_SAVE_ADAPTERS>', '\n'.join(saves_adapters))
+    file_content = file_content.replace('<CAPNP_SAVE_LAYOUT>', '\n'.join(save_layout))
+    file_content = file_content.replace('<CAPNP_SAVE_SHARD>', '\n'.join(save_shard))
+    file_content = file_content.replace('<CAPNP_SAVE_STREAM>', '\n'.join(save_stream))
+    file_content = file_content.replace('<CAPNP_SAVE_DELTA>', '\n'.join(save_delta))
+    file_content = file_content.replace('<CAPNP_DELTA_BASE>', '\n'.join(delta_base))
+    file_content = file_content.replace('<CAPNP_SAVE_ADAPTERS>', '\n'.join(saves_adapters + allocate_adapters))
     file_utils.set_content_if_changed(config.get_output_source_filepath('Serializer_save.cpp'), file_content)
 
     # Serializer_restore.cpp
@@ -191,10 +258,14 @@ def generate(models):
         file_content = strm.read()
 
     file_content = file_content.replace('<CAPNP_INIT_FACTORIES>', '\n'.join(sorted(restore_ids)))
+    file_content = file_content.replace('<CAPNP_INIT_LAZY_FACTORIES>', '\n'.join(sorted(restore_lazy_ids)))
+    file_content = file_content.replace('<CAPNP_RESTORE_OBJECT>', '\n'.join(sorted(restore_object)))
     file_content = file_content.replace('<CAPNP_RESTORE_FACTORIES>', '\n'.join(sorted(restore_objects)))
+    file_content = file_content.replace('<CAPNP_RESTORE_DELTA>', '\n'.join(sorted(restore_delta)))
     file_content = file_content.replace('<CAPNP_RESTORE_ADAPTERS>', '\n'.join(restore_adapters))
     file_content = file_content.replace('<FACTORY_FUNCTION_IMPLEMENTATIONS>', '\n'.join(factory_function_implementations))
     file_content = file_content.replace('<FACTORY_GET_OBJECT>', '\n'.join(sorted(factory_get_object)))
+    file_content = file_content.replace('<FACTORY_MAKE_OBJECT>', '\n'.join(sorted(factory_make_object)))
     file_utils.set_content_if_changed(config.get_output_source_filepath('Serializer_restore.cpp'), file_content)
 
     return True
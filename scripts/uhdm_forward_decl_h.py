@@ -12,7 +12,7 @@ def generate(models):
 
         if model_type != 'group_def' and classname != 'BaseClass':
             class_declarations.append(f'class {classname};')
-            container_factory_declarations.append(f'typedef FactoryT<std::vector<{classname} *>> VectorOf{classname}Factory;')
+            container_factory_declarations.append(f'typedef FactoryT<RelationVector<{classname}>> VectorOf{classname}Factory;')
 
             if model_type != 'class_def':
                 factory_declarations.append(f'typedef FactoryT<{classname}> {classname}Factory;')
@@ -9,7 +9,6 @@ _typename_map = OrderedDict()
 
 
 def get_type_map(models):
-    global _next_objectid
     global _typename_map
 
     if _typename_map:
@@ -30,10 +29,14 @@ def get_type_map(models):
 
                 typenames.add(f'uhdm{name}')
 
+    # Generators run in parallel, publish the map only once complete.
+    typename_map = OrderedDict()
+    objectid = _next_objectid
     for typename in sorted(typenames):
-        _typename_map[typename] = _next_objectid
-        _next_objectid += 1
+        typename_map[typename] = objectid
+        objectid += 1
 
+    _typename_map = typename_map
     return _typename_map
 
 
@@ -44,6 +47,8 @@ def generate(models):
         file_content = strm.read()
 
     file_content = file_content.replace('<DEFINES>', types)
+    file_content = file_content.replace('<COMPACT_LAYOUT>', '1' if config.compact_layout() else '0')
+    file_content = file_content.replace('<POOLED_RELATIONS>', '1' if config.pooled_relations() else '0')
     file_utils.set_content_if_changed(config.get_output_header_filepath('uhdm_types.h'), file_content)
     return True
 
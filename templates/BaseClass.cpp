@@ -26,21 +26,118 @@
 #include <uhdm/Serializer.h>
 
 namespace UHDM {
+#if UHDM_COMPACT_LAYOUT
 std::string_view BaseClass::VpiFile() const {
-  return vpiFile_ ? serializer_->GetSymbol(vpiFile_) : kEmpty;
+  const RawSymbolId file = GetLocation().m_file;
+  return (file != BadRawSymbolId)
+             ? GetSerializer()->GetSymbol(SymbolId(file, std::string_view()))
+             : kEmpty;
 }
 
 bool BaseClass::VpiFile(std::string_view data) {
-  vpiFile_ = serializer_->MakeSymbol(data);
+  ObjectLocation location = GetLocation();
+  location.m_file = (RawSymbolId)GetSerializer()->MakeSymbol(data);
+  SetLocation(location);
   return true;
 }
 
+void BaseClass::RenumberSymbols(SymbolRenumbering* renumbering) {
+  location_ = GetSerializer()->RenumberLocation(location_, renumbering);
+}
+
+ObjectLocation BaseClass::GetLocation() const {
+  return GetSerializer()->GetLocation(location_);
+}
+
+void BaseClass::SetLocation(const ObjectLocation& location) {
+  location_ = GetSerializer()->MakeLocation(location);
+}
+
+void BaseClass::SetSparse(uint32_t key, void* value) {
+  const uint32_t count = (sparse_ == nullptr) ? 0 : sparse_[0].m_key;
+  for (uint32_t i = 1; i <= count; ++i) {
+    if (sparse_[i].m_key != key) continue;
+    if (value != nullptr) {
+      sparse_[i].m_value = value;
+    } else {
+      sparse_[i] = sparse_[count];
+      if ((sparse_[0].m_key = count - 1) == 0) {
+        delete[] sparse_;
+        sparse_ = nullptr;
+      }
+    }
+    return;
+  }
+  if (value == nullptr) return;
+  // Full when count + 1, the slots in use, is a power of two.
+  if ((count & (count + 1)) == 0) {
+    SparseSlot* const grown = new SparseSlot[2 * (count + 1)];
+    for (uint32_t i = 1; i <= count; ++i) grown[i] = sparse_[i];
+    delete[] sparse_;
+    sparse_ = grown;
+  }
+  sparse_[count + 1] = {key, value};
+  sparse_[0] = {count + 1, nullptr};
+}
+
+size_t BaseClass::SparseBytes() const {
+  if (sparse_ == nullptr) return 0;
+  uint32_t capacity = 2;
+  while (capacity < sparse_[0].m_key + 1) capacity *= 2;
+  return capacity * sizeof(SparseSlot);
+}
+#else
+std::string_view BaseClass::VpiFile() const {
+  return vpiFile_ ? GetSerializer()->GetSymbol(vpiFile_) : kEmpty;
+}
+
+bool BaseClass::VpiFile(std::string_view data) {
+  vpiFile_ = GetSerializer()->MakeSymbol(data);
+  return true;
+}
+
+void BaseClass::RenumberSymbols(SymbolRenumbering* renumbering) {
+  vpiFile_ = renumbering->Renumber(vpiFile_);
+}
+#endif
+
+void BaseClass::MaterializeLazy_() const {
+  GetSerializer()->Materialize(this);
+}
+
+BaseClass& BaseClass::operator=(const BaseClass& rhs) {
+  if (this == &rhs) return *this;
+  // A lazily restored object is read before it is copied.
+  rhs.GetSerializer()->Materialize(&rhs);
+#if UHDM_COMPACT_LAYOUT
+  delete[] sparse_;
+  sparse_ = nullptr;
+  if (rhs.sparse_ != nullptr) {
+    const size_t slots = rhs.SparseBytes() / sizeof(SparseSlot);
+    sparse_ = new SparseSlot[slots];
+    std::copy(rhs.sparse_, rhs.sparse_ + rhs.sparse_[0].m_key + 1, sparse_);
+  }
+  location_ = rhs.location_;
+#else
+  serializer_ = rhs.serializer_;
+  clientData_ = rhs.clientData_;
+  vpiFile_ = rhs.vpiFile_;
+  vpiLineNo_ = rhs.vpiLineNo_;
+  vpiEndLineNo_ = rhs.vpiEndLineNo_;
+  vpiColumnNo_ = rhs.vpiColumnNo_;
+  vpiEndColumnNo_ = rhs.vpiEndColumnNo_;
+#endif
+  uhdmId_ = rhs.uhdmId_;
+  vpiParent_ = rhs.vpiParent_;
+  return *this;
+}
+
 const BaseClass* BaseClass::GetByVpiName(std::string_view name) const {
   return nullptr;
 }
 
 std::tuple<const BaseClass*, UHDM_OBJECT_TYPE,
-           const std::vector<const BaseClass*>*>
+           const RelationVector<const BaseClass>*>
 BaseClass::GetByVpiType(int32_t type) const {
   switch (type) {
     case vpiParent:
@@ -56,13 +153,13 @@ BaseClass::vpi_property_value_t BaseClass::GetVpiPropertyValue(
     int32_t property) const {
   switch (property) {
     case vpiLineNo:
-      return vpi_property_value_t(vpiLineNo_);
+      return vpi_property_value_t(VpiLineNo());
     case vpiColumnNo:
-      return vpi_property_value_t(vpiColumnNo_);
+      return vpi_property_value_t(VpiColumnNo());
     case vpiEndLineNo:
-      return vpi_property_value_t(vpiEndLineNo_);
+      return vpi_property_value_t(VpiEndLineNo());
     case vpiEndColumnNo:
-      return vpi_property_value_t(vpiEndColumnNo_);
+      return vpi_property_value_t(VpiEndColumnNo());
     case vpiType:
       return vpi_property_value_t(VpiType());
     case vpiFile: {
@@ -28,14 +28,21 @@
 #define UHDM_BASE_CLASS_H
 
 #include <uhdm/RTTI.h>
+#include <uhdm/RelationPool.h>
 #include <uhdm/SymbolFactory.h>
 #include <uhdm/uhdm_types.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <map>
+#include <new>
 #include <set>
 #include <string_view>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -53,6 +60,24 @@ typedef std::set<const BaseClass*> VisitedContainer;
 #endif
 typedef std::set<const BaseClass*> AnySet;
 
+#if UHDM_COMPACT_LAYOUT
+// In the compact layout, objects don't point to their serializer: factories
+// allocate them in slabs of kCompactSlabSize bytes, aligned on their size,
+// that start with the serializer of their objects.
+static constexpr size_t kCompactSlabSize = 1 << 16;
+
+// Where an object is in the sources. The compact layout keeps it interned by
+// the serializer, most objects share theirs with the ones elaborated from
+// the same source object.
+struct ObjectLocation {
+  RawSymbolId m_file = BadRawSymbolId;
+  uint32_t m_line = 0;
+  uint32_t m_endLine = 0;
+  uint16_t m_column = 0;
+  uint16_t m_endColumn = 0;
+};
+#endif
+
 class ClientData {
  public:
   virtual ~ClientData() = default;
@@ -91,14 +116,24 @@ class CompareContext : public RTTI {
 class BaseClass : public RTTI {
   UHDM_IMPLEMENT_RTTI(BaseClass, RTTI)
   friend Serializer;
+  template <typename T>
+  friend class FactoryT;
 
  public:
-  // Use implicit constructor to initialize all members
-  // BaseClass()
-
+  BaseClass() = default;
+  BaseClass(const BaseClass& rhs) = delete;
+#if UHDM_COMPACT_LAYOUT
+  virtual ~BaseClass() { delete[] sparse_; }
+
+  Serializer* GetSerializer() const {
+    return *reinterpret_cast<Serializer* const*>(
+        reinterpret_cast<uintptr_t>(this) & ~uintptr_t(kCompactSlabSize - 1));
+  }
+#else
   virtual ~BaseClass() = default;
 
   Serializer* GetSerializer() const { return serializer_; }
+#endif
 
   uint32_t UhdmId() const { return uhdmId_; }
   bool UhdmId(uint32_t data) {
@@ -106,14 +141,25 @@ class BaseClass : public RTTI {
     return true;
   }
 
-  BaseClass* VpiParent() { return vpiParent_; }
-  const BaseClass* VpiParent() const { return vpiParent_; }
+  // Position of the object in its factory, kept up to date by the factory.
+  uint32_t UhdmIndex() const { return uhdmIndex_; }
+
+  BaseClass* VpiParent() {
+    Materialize();
+    return vpiParent_;
+  }
+  const BaseClass* VpiParent() const {
+    Materialize();
+    return vpiParent_;
+  }
   template <typename T>
   T* VpiParent() {
+    Materialize();
     return (vpiParent_ == nullptr) ? nullptr : vpiParent_->template Cast<T*>();
   }
   template <typename T>
   const T* VpiParent() const {
+    Materialize();
     return (vpiParent_ == nullptr) ? nullptr
                                    : vpiParent_->template Cast<const T*>();
   }
@@ -125,6 +171,44 @@ class BaseClass : public RTTI {
   std::string_view VpiFile() const;
   bool VpiFile(std::string_view data);
 
+#if UHDM_COMPACT_LAYOUT
+  // Each setter interns a new location, set them all at once with
+  // SetLocation() where possible.
+  ObjectLocation GetLocation() const;
+  void SetLocation(const ObjectLocation& location);
+
+  uint32_t VpiLineNo() const { return GetLocation().m_line; }
+  bool VpiLineNo(uint32_t data) {
+    ObjectLocation location = GetLocation();
+    location.m_line = data;
+    SetLocation(location);
+    return true;
+  }
+
+  uint16_t VpiColumnNo() const { return GetLocation().m_column; }
+  bool VpiColumnNo(uint16_t data) {
+    ObjectLocation location = GetLocation();
+    location.m_column = data;
+    SetLocation(location);
+    return true;
+  }
+
+  uint32_t VpiEndLineNo() const { return GetLocation().m_endLine; }
+  bool VpiEndLineNo(uint32_t data) {
+    ObjectLocation location = GetLocation();
+    location.m_endLine = data;
+    SetLocation(location);
+    return true;
+  }
+
+  uint16_t VpiEndColumnNo() const { return GetLocation().m_endColumn; }
+  bool VpiEndColumnNo(uint16_t data) {
+    ObjectLocation location = GetLocation();
+    location.m_endColumn = data;
+    SetLocation(location);
+    return true;
+  }
+#else
   uint32_t VpiLineNo() const { return vpiLineNo_; }
   bool VpiLineNo(uint32_t data) {
     vpiLineNo_ = data;
@@ -148,6 +232,7 @@ class BaseClass : public RTTI {
     vpiEndColumnNo_ = data;
     return true;
   }
+#endif
 
   virtual std::string_view VpiName() const { return kEmpty; }
   virtual std::string_view VpiDefName() const { return kEmpty; }
@@ -155,15 +240,23 @@ class BaseClass : public RTTI {
   virtual uint32_t VpiType() const = 0;
   virtual UHDM_OBJECT_TYPE UhdmType() const = 0;
 
+#if UHDM_COMPACT_LAYOUT
+  ClientData* Data() { return static_cast<ClientData*>(GetSparse(0)); }
+  const ClientData* Data() const {
+    return static_cast<const ClientData*>(GetSparse(0));
+  }
+  void Data(ClientData* data) { SetSparse(0, data); }
+#else
   ClientData* Data() { return clientData_; }
   const ClientData* Data() const { return clientData_; }
   void Data(ClientData* data) { clientData_ = data; }
+#endif
 
   // TODO: Make the next three functions pure-virtual after transition to pygen.
   virtual const BaseClass* GetByVpiName(std::string_view name) const;
 
   virtual std::tuple<const BaseClass*, UHDM_OBJECT_TYPE,
-                     const std::vector<const BaseClass*>*>
+                     const RelationVector<const BaseClass>*>
   GetByVpiType(int32_t type) const;
 
   typedef std::variant<int64_t, const char*> vpi_property_value_t;
@@ -176,13 +269,54 @@ class BaseClass : public RTTI {
   virtual int32_t Compare(const BaseClass* other,
                           CompareContext* context) const;
 
+  // Replaces the ids of the symbols held by the object with their new ones,
+  // see Serializer::CompactSymbols().
+  virtual void RenumberSymbols(SymbolRenumbering* renumbering);
+
  protected:
   void DeepCopy(BaseClass* clone, BaseClass* parent,
                 CloneContext* context) const;
 
+  // Copies the content of rhs but not the identity of this object, which
+  // keeps its place in its factory. Used by DeepClone(), reads rhs first if
+  // it was lazily restored.
+  BaseClass& operator=(const BaseClass& rhs);
+
   std::string ComputeFullName() const;
 
+  // Relation getters read the objects this one refers to if a lazy restore
+  // left them pending, see Serializer::SetLazyRestoreEnabled(), so chains of
+  // accessors never return unread objects. A single load when no lazy
+  // restore is pending in the process.
+  void Materialize() const {
+    if (lazyRestores_.load(std::memory_order_relaxed) != 0) MaterializeLazy_();
+  }
+
+#if UHDM_COMPACT_LAYOUT
+  void SetSerializer(Serializer* serial) {
+    *reinterpret_cast<Serializer**>(reinterpret_cast<uintptr_t>(this) &
+                                    ~uintptr_t(kCompactSlabSize - 1)) = serial;
+  }
+
+  // The client data, key 0, and the relations of card any, keyed by their
+  // UHDM_OBJECT_TYPE, that are set. sparse_[0].m_key is their count, the
+  // array holds the next power of two slots.
+  struct SparseSlot {
+    uint32_t m_key;
+    void* m_value;
+  };
+  void* GetSparse(uint32_t key) const {
+    if (sparse_ == nullptr) return nullptr;
+    for (uint32_t i = 1, n = sparse_[0].m_key; i <= n; ++i) {
+      if (sparse_[i].m_key == key) return sparse_[i].m_value;
+    }
+    return nullptr;
+  }
+  void SetSparse(uint32_t key, void* value);
+  size_t SparseBytes() const;
+#else
   void SetSerializer(Serializer* serial) { serializer_ = serial; }
+#endif
 
   static int32_t SafeCompare(const BaseClass* lhs, const BaseClass* rhs,
                              CompareContext* context) {
@@ -200,9 +334,9 @@ class BaseClass : public RTTI {
 
   template <typename T>
   static int32_t SafeCompare(const BaseClass* lhs_obj,
-                             const std::vector<T*>* lhs,
+                             const RelationVector<T>* lhs,
                              const BaseClass* rhs_obj,
-                             const std::vector<T*>* rhs,
+                             const RelationVector<T>* rhs,
                              CompareContext* context) {
     if ((lhs != nullptr) && (rhs != nullptr)) {
       int32_t r = 0;
@@ -225,10 +359,19 @@ class BaseClass : public RTTI {
   }
 
  protected:
+#if UHDM_COMPACT_LAYOUT
+  SparseSlot* sparse_ = nullptr;
+
+  uint32_t uhdmId_ = 0;
+  uint32_t uhdmIndex_ = 0;
+  BaseClass* vpiParent_ = nullptr;
+  uint32_t location_ = 0;  // Interned by the serializer, 0 if none
+#else
   Serializer* serializer_ = nullptr;
   ClientData* clientData_ = nullptr;
 
   uint32_t uhdmId_ = 0;
+  uint32_t uhdmIndex_ = 0;
   BaseClass* vpiParent_ = nullptr;
   SymbolId vpiFile_;
 
@@ -236,68 +379,246 @@ class BaseClass : public RTTI {
   uint32_t vpiEndLineNo_ = 0;
   uint16_t vpiColumnNo_ = 0;
   uint16_t vpiEndColumnNo_ = 0;
+#endif
+
+ private:
+  void MaterializeLazy_() const;
+
+  // Serializers of the process with a lazy restore pending.
+  static inline std::atomic<uint32_t> lazyRestores_{0};
 };
 
 template <typename T>
 class FactoryT final {
   friend Serializer;
-  // TODO: make this an arena: iinstead of pointers, store the
-  // objects directly with placement-new'ed object using emplace_back()
-  // One less indirection and a lot less overhead.
-  // (dqque guarantees pointer stability; however, we'd need to
-  // do something special in Erase() - can't re-arrange).
+  // Objects are placement-new'ed into slabs that are never moved, so their
+  // addresses are stable. Slabs start small, as most factories only hold a
+  // handful of objects, and double up to kMaxSlabSize objects. Erased slots
+  // are reused by the next Make().
+  // Erase() leaves a nullptr tombstone in objects_, Compact() removes them
+  // and renumbers the remaining objects. Use ForEach() to skip tombstones.
+  // In the compact layout, objects are rather allocated in kCompactSlabSize
+  // slabs holding their serializer, see BaseClass::GetSerializer().
   typedef std::deque<T*> objects_t;
+  static constexpr size_t kMinSlabSize = 16;
+  static constexpr size_t kMaxSlabSize = 8192;
+
+  static constexpr bool CompactSlabs() {
+#if UHDM_COMPACT_LAYOUT
+    return std::is_base_of_v<BaseClass, T>;
+#else
+    return false;
+#endif
+  }
 
  public:
+  FactoryT() = default;
+  FactoryT(const FactoryT&) = delete;
+  FactoryT& operator=(const FactoryT&) = delete;
+  ~FactoryT() { Purge(); }
+
   T* Make() {
-    T* obj = new T;
+    T* obj = nullptr;
+    if constexpr (IsPooledRelationVector<T>::value) {
+      if (pool_ == nullptr) pool_.reset(new RelationPool);
+      obj = new (Allocate()) T(typename T::allocator_type(pool_.get()));
+    } else {
+      obj = new (Allocate()) T;
+    }
     objects_.push_back(obj);
+    Reindex(objects_.size() - 1);
+    return obj;
+  }
+
+  // Appends count empty slots, tombstones until MakeAt() fills them in any
+  // order, for the objects of a lazy restore. Returns the index of the first.
+  size_t AddSlots(size_t count) {
+    const size_t offset = objects_.size();
+    objects_.resize(offset + count, nullptr);
+    dead_ += count;
+    return offset;
+  }
+
+  T* MakeAt(size_t index) {
+    T* const obj = new (Allocate()) T;
+    objects_[index] = obj;
+    --dead_;
+    if constexpr (std::is_base_of_v<BaseClass, T>) {
+      obj->uhdmIndex_ = static_cast<uint32_t>(index);
+    }
     return obj;
   }
 
   bool Erase(const T* obj) {
-    for (typename objects_t::const_iterator itr = objects_.begin();
-         itr != objects_.end(); ++itr) {
-      if ((*itr) == obj) {
-        delete obj;
-        objects_.erase(itr);
-        return true;
-      }
+    typename objects_t::size_type index = 0;
+    if constexpr (std::is_base_of_v<BaseClass, T>) {
+      index = obj->uhdmIndex_;
+      if ((index >= objects_.size()) || (objects_[index] != obj)) return false;
+    } else {
+      while ((index < objects_.size()) && (objects_[index] != obj)) ++index;
+      if (index == objects_.size()) return false;
     }
-    return false;
+    Destroy(objects_[index]);
+    objects_[index] = nullptr;
+    ++dead_;
+    return true;
   }
 
-  void EraseIfNotIn(const AnySet &container) {
-    objects_t keepers;
-    for (typename objects_t::reference obj : objects_) {
-      if (container.find(obj) == container.end()) {
-        delete obj;
-      } else {
-        keepers.emplace_back(obj);
-      }
+  void Compact() {
+    if (dead_ == 0) return;
+    objects_.erase(std::remove(objects_.begin(), objects_.end(), nullptr),
+                   objects_.end());
+    dead_ = 0;
+    Reindex(0);
+  }
+
+  // Number of live objects.
+  size_t Size() const { return objects_.size() - dead_; }
+
+  // Bytes held by the live objects, not counting what they point to but
+  // the sparse relations of the compact layout.
+  size_t Bytes() const {
+    size_t bytes = Size() * sizeof(T);
+#if UHDM_COMPACT_LAYOUT
+    if constexpr (std::is_base_of_v<BaseClass, T>) {
+      ForEach([&bytes](const T* obj) { bytes += obj->SparseBytes(); });
     }
-    keepers.swap(objects_);
+#endif
+    return bytes;
   }
 
-  void MapToIndex(std::map<const BaseClass*, uint32_t>& table, uint32_t index = 1) const {
+  // Bytes taken by the slabs, used or not.
+  size_t ReservedBytes() const { return reserved_; }
+
+  // Buffers of the relation vectors made so far, nullptr if none or not
+  // pooled.
+  const RelationPool* Pool() const { return pool_.get(); }
+
+  template <typename F>
+  void ForEach(F f) const {
     for (typename objects_t::const_reference obj : objects_) {
-      table.emplace(obj, index++);
+      if (obj != nullptr) f(obj);
     }
   }
 
-  void Purge() {
-    for (typename objects_t::reference obj : objects_) {
-      delete obj;
+  // Destroys the objects whose index isn't set in marks. Their slots go back
+  // to the free list of the factory, the slabs are kept. Returns the bytes
+  // reclaimed, as counted by Bytes().
+  size_t Sweep(const std::vector<bool>& marks) {
+    size_t swept = 0;
+    size_t bytes = 0;
+    for (size_t i = 0, n = objects_.size(); i < n; ++i) {
+      T* const obj = objects_[i];
+      if ((obj == nullptr) || ((i < marks.size()) && marks[i])) continue;
+#if UHDM_COMPACT_LAYOUT
+      if constexpr (std::is_base_of_v<BaseClass, T>) {
+        bytes += obj->SparseBytes();
+      }
+#endif
+      Destroy(obj);
+      objects_[i] = nullptr;
+      ++swept;
     }
+    dead_ += swept;
+    Compact();
+    return bytes + swept * sizeof(T);
+  }
+
+  void MapToIndex(std::vector<std::pair<const BaseClass*, uint32_t>>& table) const {
+    ForEach([&table](const T* obj) {
+      table.emplace_back(obj, obj->uhdmIndex_ + 1);
+    });
+  }
+
+  void Purge() {
+    ForEach([](T* obj) { obj->~T(); });
     objects_.clear();
+    dead_ = 0;
+    for (void* slab : slabs_) {
+      ::operator delete(slab, std::align_val_t(SlabAlignment()));
+    }
+    slabs_.clear();
+    reserved_ = 0;
+    free_.clear();
+    next_ = end_ = nullptr;
+    pool_.reset();
   }
 
  private:
+  void* Allocate() {
+    if (!free_.empty()) {
+      T* const slot = free_.back();
+      free_.pop_back();
+      return slot;
+    }
+    if (next_ == end_) {
+      if constexpr (CompactSlabs()) {
+#if UHDM_COMPACT_LAYOUT
+        static_assert(kCompactSlabHeader + 16 * sizeof(T) <= kCompactSlabSize);
+        char* const slab = static_cast<char*>(::operator new(
+            kCompactSlabSize, std::align_val_t(kCompactSlabSize)));
+        *reinterpret_cast<Serializer**>(slab) = nullptr;
+        next_ = reinterpret_cast<T*>(slab + kCompactSlabHeader);
+        end_ = next_ + (kCompactSlabSize - kCompactSlabHeader) / sizeof(T);
+        slabs_.push_back(slab);
+        reserved_ += kCompactSlabSize;
+#endif
+      } else {
+        const size_t size =
+            slabs_.empty() ? kMinSlabSize
+                           : std::min(2 * lastSlabSize_, kMaxSlabSize);
+        next_ = static_cast<T*>(
+            ::operator new(size * sizeof(T), std::align_val_t(alignof(T))));
+        end_ = next_ + size;
+        slabs_.push_back(next_);
+        reserved_ += size * sizeof(T);
+        lastSlabSize_ = size;
+      }
+    }
+    return next_++;
+  }
+
+  static constexpr size_t SlabAlignment() {
+#if UHDM_COMPACT_LAYOUT
+    if constexpr (CompactSlabs()) return kCompactSlabSize;
+#endif
+    return alignof(T);
+  }
+
+#if UHDM_COMPACT_LAYOUT
+  // Room for the serializer, rounded up to the alignment of the objects.
+  static constexpr size_t kCompactSlabHeader =
+      (sizeof(Serializer*) + alignof(T) - 1) / alignof(T) * alignof(T);
+#endif
+
+  void Destroy(T* obj) {
+    obj->~T();
+    free_.push_back(obj);
+  }
+
+  void Reindex(typename objects_t::size_type from) {
+    if constexpr (std::is_base_of_v<BaseClass, T>) {
+      for (typename objects_t::size_type n = objects_.size(); from < n; ++from) {
+        if (objects_[from] != nullptr) objects_[from]->uhdmIndex_ = static_cast<uint32_t>(from);
+      }
+    }
+  }
+
   objects_t objects_;
+  size_t dead_ = 0;
+  std::vector<void*> slabs_;
+  size_t reserved_ = 0;  // Bytes of the slabs
+  std::vector<T*> free_;
+  T* next_ = nullptr;
+  T* end_ = nullptr;
+  size_t lastSlabSize_ = 0;
+  // Buffers of the vectors of a factory of relation vectors, released once
+  // the vectors are destroyed by Purge().
+  std::unique_ptr<RelationPool> pool_;
 };
 
-typedef FactoryT<std::vector<BaseClass*>> VectorOfBaseClassFactory;
-typedef FactoryT<std::vector<BaseClass*>> VectorOfanyFactory;
+typedef FactoryT<RelationVector<BaseClass>> VectorOfBaseClassFactory;
+typedef FactoryT<RelationVector<BaseClass>> VectorOfanyFactory;
 }  // namespace UHDM
 
 UHDM_IMPLEMENT_RTTI_CAST_FUNCTIONS(clonecontext_cast, UHDM::CloneContext)
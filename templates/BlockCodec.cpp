@@ -0,0 +1,155 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <uhdm/BlockCodec.h>
+
+#include <cstring>
+
+namespace UHDM {
+namespace BlockCodec {
+// A kLz block is a series of sequences. Each sequence is a token byte, whose
+// high nibble is the literal count and low nibble the match length minus
+// kMinMatch, the literals, then a 2 bytes little endian match offset. A
+// nibble of 15 is followed by extra length bytes, added up while they are
+// 255. The last sequence has literals only and ends the block.
+static constexpr uint32_t kHashBits = 14;
+static constexpr size_t kMinMatch = 4;
+static constexpr size_t kMaxOffset = 65535;
+
+static uint32_t Load32(const uint8_t* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static void PutLength(std::vector<char>* out, size_t length) {
+  for (length -= 15; length >= 255; length -= 255) out->push_back('\xff');
+  out->push_back(static_cast<char>(length));
+}
+
+static void PutSequence(std::vector<char>* out, const uint8_t* literals,
+                        size_t literalCount, size_t offset, size_t length) {
+  const size_t matchCode = (length == 0) ? 0 : length - kMinMatch;
+  out->push_back(static_cast<char>(((literalCount < 15 ? literalCount : 15) << 4) |
+                                   (matchCode < 15 ? matchCode : 15)));
+  if (literalCount >= 15) PutLength(out, literalCount);
+  out->insert(out->end(), literals, literals + literalCount);
+  if (length == 0) return;
+  out->push_back(static_cast<char>(offset & 0xff));
+  out->push_back(static_cast<char>(offset >> 8));
+  if (matchCode >= 15) PutLength(out, matchCode);
+}
+
+static bool GetLength(const uint8_t*& ip, const uint8_t* end, size_t* length) {
+  if (*length != 15) return true;
+  uint8_t byte = 0;
+  do {
+    if (ip == end) return false;
+    byte = *ip++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+static void LzCompress(const uint8_t* in, size_t size, std::vector<char>* out) {
+  std::vector<uint32_t> table(1 << kHashBits, 0);  // Position + 1, 0 if none
+  size_t anchor = 0;
+  size_t ip = 0;
+  while (ip + kMinMatch <= size) {
+    const uint32_t sequence = Load32(in + ip);
+    const uint32_t hash = (sequence * 2654435761U) >> (32 - kHashBits);
+    const size_t candidate = table[hash];
+    table[hash] = static_cast<uint32_t>(ip + 1);
+    if ((candidate != 0) && (ip - (candidate - 1) <= kMaxOffset) &&
+        (Load32(in + candidate - 1) == sequence)) {
+      const size_t match = candidate - 1;
+      size_t length = kMinMatch;
+      while ((ip + length < size) && (in[match + length] == in[ip + length])) {
+        ++length;
+      }
+      PutSequence(out, in + anchor, ip - anchor, ip - match, length);
+      ip += length;
+      anchor = ip;
+    } else {
+      ++ip;
+    }
+  }
+  PutSequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+static bool LzDecompress(const uint8_t* ip, const uint8_t* end, uint8_t* out,
+                         size_t rawSize) {
+  uint8_t* op = out;
+  uint8_t* const oend = out + rawSize;
+  while (ip < end) {
+    const uint8_t token = *ip++;
+    size_t literalCount = token >> 4;
+    if (!GetLength(ip, end, &literalCount)) return false;
+    if ((static_cast<size_t>(end - ip) < literalCount) ||
+        (static_cast<size_t>(oend - op) < literalCount)) {
+      return false;
+    }
+    std::memcpy(op, ip, literalCount);
+    ip += literalCount;
+    op += literalCount;
+    if (ip == end) break;  // Last sequence
+
+    if (end - ip < 2) return false;
+    const size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+    ip += 2;
+    size_t length = token & 0x0f;
+    if (!GetLength(ip, end, &length)) return false;
+    length += kMinMatch;
+    if ((offset == 0) || (offset > static_cast<size_t>(op - out)) ||
+        (static_cast<size_t>(oend - op) < length)) {
+      return false;
+    }
+    // Byte by byte, the match may overlap the bytes it produces.
+    const uint8_t* match = op - offset;
+    for (size_t i = 0; i < length; ++i) *op++ = *match++;
+  }
+  return op == oend;
+}
+
+void Compress(Codec codec, const char* data, size_t size,
+              std::vector<char>* out) {
+  switch (codec) {
+    case Codec::kLz:
+      LzCompress(reinterpret_cast<const uint8_t*>(data), size, out);
+      break;
+    default:
+      out->insert(out->end(), data, data + size);
+      break;
+  }
+}
+
+bool Decompress(Codec codec, const char* data, size_t size, char* out,
+                size_t rawSize) {
+  switch (codec) {
+    case Codec::kLz:
+      return LzDecompress(reinterpret_cast<const uint8_t*>(data),
+                          reinterpret_cast<const uint8_t*>(data) + size,
+                          reinterpret_cast<uint8_t*>(out), rawSize);
+    case Codec::kNone:
+      if (size != rawSize) return false;
+      std::memcpy(out, data, size);
+      return true;
+    default:
+      return false;
+  }
+}
+}  // namespace BlockCodec
+}  // namespace UHDM
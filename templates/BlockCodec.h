@@ -0,0 +1,94 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef UHDM_BLOCKCODEC_H
+#define UHDM_BLOCKCODEC_H
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace UHDM {
+namespace BlockCodec {
+// Codecs of the blocks of a compressed save, see Serializer::SaveFormat.
+// kNone: blocks are stored as is.
+// kLz: built-in byte oriented LZ77 (LZ4 style sequences, 64KB window),
+//      fast to decode and good on the repetitive capnp words of a design.
+enum class Codec : uint32_t { kNone = 0, kLz = 1 };
+
+// Size of the uncompressed blocks of a compressed save.
+static constexpr size_t kBlockSize = 1 << 20;
+
+// Layout of a compressed save: a FileHeader, one BlockEntry per block, then
+// the encoded blocks. Blocks are independent, so they can be decoded
+// concurrently and any of them found without decoding the others.
+// Integers are stored little endian, like the capnp words they contain,
+// see ConvertByteOrder().
+struct FileHeader {
+  char m_magic[8];
+  uint32_t m_codec;
+  uint32_t m_blockCount;
+  uint64_t m_rawSize;  // Size of the uncompressed message
+};
+
+struct BlockEntry {
+  uint64_t m_offset;  // From the start of the file
+  uint32_t m_size;
+  uint32_t m_rawSize;
+};
+
+// Converts an integer between the host byte order and little endian, both
+// ways. A no-op on little endian hosts.
+template <typename T>
+T LittleEndian(T value) {
+  static_assert(std::is_unsigned_v<T>, "T must be an unsigned integer");
+  uint8_t bytes[sizeof(T)];
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+  std::memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+// Converts the integers of a header or an entry between the host byte
+// order and the one of the files, both ways.
+inline void ConvertByteOrder(FileHeader* header) {
+  header->m_codec = LittleEndian(header->m_codec);
+  header->m_blockCount = LittleEndian(header->m_blockCount);
+  header->m_rawSize = LittleEndian(header->m_rawSize);
+}
+
+inline void ConvertByteOrder(BlockEntry* entry) {
+  entry->m_offset = LittleEndian(entry->m_offset);
+  entry->m_size = LittleEndian(entry->m_size);
+  entry->m_rawSize = LittleEndian(entry->m_rawSize);
+}
+
+// Appends the encoding of [data, data + size) to out.
+void Compress(Codec codec, const char* data, size_t size,
+              std::vector<char>* out);
+
+// Decodes [data, data + size) into exactly rawSize bytes at out.
+// Returns false if the input is corrupt or doesn't decode to rawSize bytes.
+bool Decompress(Codec codec, const char* data, size_t size, char* out,
+                size_t rawSize);
+}  // namespace BlockCodec
+}  // namespace UHDM
+
+#endif  // UHDM_BLOCKCODEC_H
@@ -4609,7 +4609,7 @@ expr *ExprEval::reduceExpr(const any *result, bool &invalidValue,
   } else if (objtype == UHDM_OBJECT_TYPE::uhdmfunc_call) {
     func_call *scall = (func_call *)result;
     const std::string_view name = scall->VpiName();
-    std::vector<any *> *args = scall->Tf_call_args();
+    VectorOfany *args = scall->Tf_call_args();
     function *actual_func = nullptr;
     if (task_func *func = getTaskFunc(name, inst)) {
       actual_func = any_cast<function *>(func);
@@ -5751,7 +5751,7 @@ void ExprEval::evalStmt(std::string_view funcName, Scopes &scopes,
   }
 }
 
-expr *ExprEval::evalFunc(function *func, std::vector<any *> *args,
+expr *ExprEval::evalFunc(function *func, VectorOfany *args,
                          bool &invalidValue, const any *inst, any *pexpr,
                          bool muteError) {
   if (func == nullptr) {
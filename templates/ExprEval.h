@@ -136,7 +136,7 @@ class ExprEval {
 
   typedef std::vector<const instance*> Scopes;
 
-  UHDM::expr* evalFunc(UHDM::function* func, std::vector<UHDM::any*>* args,
+  UHDM::expr* evalFunc(UHDM::function* func, UHDM::VectorOfany* args,
                        bool& invalidValue, const any* inst, UHDM::any* pexpr,
                        bool muteError = false);
 
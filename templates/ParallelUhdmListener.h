@@ -0,0 +1,124 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef UHDM_PARALLELUHDMLISTENER_H
+#define UHDM_PARALLELUHDMLISTENER_H
+#pragma once
+
+#include <uhdm/Serializer.h>
+#include <uhdm/ThreadPool.h>
+#include <uhdm/UhdmListener.h>
+#include <uhdm/design.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+namespace UHDM {
+// Walks the independent subtrees of a design on several threads, for
+// analyses that only read the model. Each top module, package, class,
+// interface, program, udp and module of the design is walked by a listener
+// of its own, created by the factory, and the rest of the design by one
+// more listener. Each listener has its own visited set, its callstack starts
+// at the root of its subtree, and it skips the design and the other roots,
+// see UhdmListener::setSkipped(). Other objects reached from several
+// subtrees, like shared typespecs, are walked by each of their listeners,
+// possibly at the same time: callbacks must not call VpiFullName() or
+// vpi_get_str(vpiFullName), which store the full names they compute.
+// The listeners are then handed to the reduction on the calling thread, in
+// the order of the subtrees and the design last, so the result doesn't
+// depend on the number of threads.
+template <typename T>
+class ParallelUhdmListener final {
+  static_assert(std::is_base_of_v<UhdmListener, T>,
+                "T must be a UhdmListener");
+
+ public:
+  typedef std::function<std::unique_ptr<T>()> factory_t;
+  typedef std::function<void(T& listener)> reduce_t;
+
+  // A threadCount of 0 uses one thread per hardware core. The factory is
+  // called from the threads of the pool; without one, listeners are default
+  // constructed.
+  explicit ParallelUhdmListener(uint32_t threadCount = 0,
+                                factory_t factory = nullptr)
+      : m_threadCount(threadCount), m_factory(std::move(factory)) {
+    if (!m_factory) m_factory = []() { return std::make_unique<T>(); };
+  }
+
+  void listenDesign(const design* const object, const reduce_t& reduce) {
+    // Lazy restore reads the objects as they are first walked, which
+    // isn't thread safe.
+    object->GetSerializer()->MaterializeAll();
+
+    // Top modules first, they are the most expensive.
+    std::vector<const any*> roots;
+    std::unordered_set<const any*> added;
+    AddRoots(object->TopModules(), &roots, &added);
+    AddRoots(object->AllPackages(), &roots, &added);
+    AddRoots(object->AllClasses(), &roots, &added);
+    AddRoots(object->AllInterfaces(), &roots, &added);
+    AddRoots(object->AllPrograms(), &roots, &added);
+    AddRoots(object->AllUdps(), &roots, &added);
+    AddRoots(object->AllModules(), &roots, &added);
+
+    // Each walk skips the design and the roots but the one it starts from.
+    added.emplace(object);
+    std::vector<std::unique_ptr<T>> listeners(roots.size() + 1);
+    std::vector<ThreadPool::task_t> tasks;
+    tasks.reserve(listeners.size());
+    for (size_t i = 0; i < roots.size(); ++i) {
+      tasks.emplace_back([this, &roots, &listeners, &added, i]() {
+        listeners[i] = m_factory();
+        listeners[i]->setSkipped(&added);
+        listeners[i]->listenAny(roots[i]);
+        listeners[i]->setSkipped(nullptr);
+      });
+    }
+    tasks.emplace_back([this, &added, &listeners, object]() {
+      std::unique_ptr<T>& listener = listeners.back();
+      listener = m_factory();
+      listener->setSkipped(&added);
+      listener->listenDesign(object);
+      listener->setSkipped(nullptr);
+    });
+    ThreadPool(m_threadCount).Run(tasks);
+
+    if (reduce) {
+      for (std::unique_ptr<T>& listener : listeners) reduce(*listener);
+    }
+  }
+
+ private:
+  template <typename U>
+  static void AddRoots(const RelationVector<U>* objects,
+                       std::vector<const any*>* roots,
+                       std::unordered_set<const any*>* added) {
+    if (objects == nullptr) return;
+    for (const U* object : *objects) {
+      if (added->insert(object).second) roots->emplace_back(object);
+    }
+  }
+
+  const uint32_t m_threadCount;
+  factory_t m_factory;
+};
+}  // namespace UHDM
+
+#endif  // UHDM_PARALLELUHDMLISTENER_H
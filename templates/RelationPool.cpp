@@ -0,0 +1,88 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <uhdm/RelationPool.h>
+
+#include <algorithm>
+#include <new>
+
+namespace UHDM {
+size_t RelationPool::SizeClass(size_t size, size_t* capacity) {
+  if (size <= kExactSizes) {
+    *capacity = (size == 0) ? 1 : size;
+    return *capacity - 1;
+  }
+  size_t sizeClass = kExactSizes;
+  for (*capacity = 2 * kExactSizes; *capacity < size; *capacity *= 2) {
+    ++sizeClass;
+  }
+  return sizeClass;
+}
+
+void* RelationPool::Allocate(size_t size) {
+  if (size > kMaxPooledSize) return ::operator new(size * sizeof(void*));
+  size_t capacity = 0;
+  const size_t sizeClass = SizeClass(size, &capacity);
+  m_used += capacity;
+  if (void* const buffer = m_free[sizeClass]) {
+    m_free[sizeClass] = *static_cast<void**>(buffer);
+    return buffer;
+  }
+  if (static_cast<size_t>(m_end - m_next) < capacity) {
+    // What is left of the current chunk goes to the free lists.
+    while (m_next != m_end) {
+      size_t rest = 0;
+      size_t restClass = SizeClass(m_end - m_next, &rest);
+      if (rest > static_cast<size_t>(m_end - m_next)) {
+        restClass = SizeClass(rest / 2, &rest);
+      }
+      *m_next = m_free[restClass];
+      m_free[restClass] = m_next;
+      m_next += rest;
+    }
+    const size_t chunkSize = std::max(
+        capacity, kFirstChunkSize
+                      << std::min<size_t>(m_chunks.size(), kChunkDoublings));
+    m_chunks.emplace_back(new void*[chunkSize]);
+    m_reserved += chunkSize;
+    m_next = m_chunks.back().get();
+    m_end = m_next + chunkSize;
+  }
+  void** const buffer = m_next;
+  m_next += capacity;
+  return buffer;
+}
+
+void RelationPool::Deallocate(void* buffer, size_t size) {
+  if (size > kMaxPooledSize) {
+    ::operator delete(buffer);
+    return;
+  }
+  size_t capacity = 0;
+  const size_t sizeClass = SizeClass(size, &capacity);
+  m_used -= capacity;
+  *static_cast<void**>(buffer) = m_free[sizeClass];
+  m_free[sizeClass] = buffer;
+}
+
+size_t RelationPool::ReservedBytes() const {
+  return m_reserved * sizeof(void*);
+}
+
+size_t RelationPool::UsedBytes() const {
+  return m_used * sizeof(void*);
+}
+}  // namespace UHDM
@@ -0,0 +1,145 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef UHDM_RELATIONPOOL_H
+#define UHDM_RELATIONPOOL_H
+#pragma once
+
+#include <uhdm/uhdm_types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace UHDM {
+// Buffers of the relation vectors of one factory, that is of one element
+// type in one serializer. They are carved out of large chunks, one after
+// the other, so the lists restored or built together sit next to each
+// other in memory, and freed buffers are kept in per size free lists for
+// the next vectors of the factory. The chunks go back to the system with
+// the pool, when the factory is purged.
+// Not thread safe, no more than the factory: the parallel restore reserves
+// the vectors under the lock of their factory.
+class RelationPool final {
+ public:
+  // Buffers of up to kExactSizes pointers are handed out at their size,
+  // bigger ones rounded up to a power of two; beyond kMaxPooledSize they
+  // come straight from the heap.
+  static constexpr size_t kExactSizes = 16;
+  static constexpr size_t kMaxPooledSize = 4096;
+  // Chunks double in size, in pointers, kChunkDoublings times from the
+  // first one.
+  static constexpr size_t kFirstChunkSize = 1 << 10;
+  static constexpr size_t kChunkDoublings = 6;
+
+  RelationPool() = default;
+  RelationPool(const RelationPool&) = delete;
+  RelationPool& operator=(const RelationPool&) = delete;
+
+  void* Allocate(size_t size);
+  void Deallocate(void* buffer, size_t size);
+
+  // Bytes taken from the system, and of those, the ones held by vectors.
+  size_t ReservedBytes() const;
+  size_t UsedBytes() const;
+
+ private:
+  static constexpr size_t kSizeClasses = kExactSizes + 8;  // Then 32 to 4096
+
+  // Size class of a buffer of size pointers, and the pointers it holds.
+  static size_t SizeClass(size_t size, size_t* capacity);
+
+  void* m_free[kSizeClasses] = {};  // Each free buffer points to the next
+  std::vector<std::unique_ptr<void*[]>> m_chunks;
+  void** m_next = nullptr;
+  void** m_end = nullptr;
+  size_t m_reserved = 0;  // In pointers
+  size_t m_used = 0;
+};
+
+// Allocator of the relation vectors generated with --pooled-relations,
+// drawing from the RelationPool of their factory, or from the heap without
+// one. Copies of a vector are allocated from the heap, as they may outlive
+// the factory; moves and swaps carry the pool along.
+template <typename T>
+class RelationAllocator {
+ public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+  typedef std::false_type is_always_equal;
+  static_assert(sizeof(T) == sizeof(void*), "Relations hold pointers");
+
+  RelationAllocator() noexcept = default;
+  explicit RelationAllocator(RelationPool* pool) noexcept : m_pool(pool) {}
+  template <typename U>
+  RelationAllocator(const RelationAllocator<U>& other) noexcept
+      : m_pool(other.Pool()) {}
+
+  RelationAllocator select_on_container_copy_construction() const {
+    return RelationAllocator();
+  }
+
+  T* allocate(size_t n) {
+    return static_cast<T*>((m_pool != nullptr)
+                               ? m_pool->Allocate(n)
+                               : ::operator new(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) {
+    if (m_pool != nullptr) {
+      m_pool->Deallocate(p, n);
+    } else {
+      ::operator delete(p);
+    }
+  }
+
+  RelationPool* Pool() const { return m_pool; }
+
+  template <typename U>
+  bool operator==(const RelationAllocator<U>& other) const noexcept {
+    return m_pool == other.Pool();
+  }
+  template <typename U>
+  bool operator!=(const RelationAllocator<U>& other) const noexcept {
+    return m_pool != other.Pool();
+  }
+
+ private:
+  RelationPool* m_pool = nullptr;
+};
+
+// Type of the relations of card any, VectorOfxxx. Grows like any vector,
+// copying its elements to a bigger buffer.
+#if UHDM_POOLED_RELATIONS
+template <typename T>
+using RelationVector = std::vector<T*, RelationAllocator<T*>>;
+#else
+template <typename T>
+using RelationVector = std::vector<T*>;
+#endif
+
+// Vectors whose factory gives them a RelationPool, see FactoryT::Make().
+template <typename T>
+struct IsPooledRelationVector : std::false_type {};
+template <typename T>
+struct IsPooledRelationVector<std::vector<T, RelationAllocator<T>>>
+    : std::true_type {};
+}  // namespace UHDM
+
+#endif /* UHDM_RELATIONPOOL_H */
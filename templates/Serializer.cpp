@@ -27,6 +27,8 @@
 #include <uhdm/vpi_visitor.h>
 
 #include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <map>
@@ -37,44 +39,159 @@
 
 namespace UHDM {
 
-const uint32_t Serializer::kVersion = 1;
+const uint32_t Serializer::kVersion = 2;
+const uint32_t Serializer::kMinVersion = 1;
 
-void Serializer::GarbageCollect() {
-  if (!m_enableGC) return;
+static const std::vector<bool>& TypeMarks(const std::vector<std::vector<bool>>& marks, UHDM_OBJECT_TYPE type) {
+  static const std::vector<bool> kNone;
+  const uint32_t index = static_cast<uint32_t>(type);
+  return (index < marks.size()) ? marks[index] : kNone;
+}
 
-  UhdmListener* const listener = new UhdmListener();
-  for (auto d : designMaker.objects_) {
-    listener->listenDesign(d);
-  }
+uint64_t Serializer::GarbageCollect() {
+  if (!m_enableGC) return 0;
+  MaterializeAll();
 
-  const AnySet visited(listener->getVisited().begin(), listener->getVisited().end());
-  delete listener;
+  // Mark everything reachable from the designs in per type bitmaps, indexed
+  // by the object index in its factory.
+  std::vector<std::vector<bool>> marks;
+  {
+    UhdmListener listener(VisitedSet::Kind::Indexed);
+    designMaker.ForEach([&listener](const design* d) { listener.listenDesign(d); });
+    for (const any* object : listener.getVisited()) {
+      const uint32_t type = static_cast<uint32_t>(object->UhdmType());
+      if (type >= marks.size()) marks.resize(type + 1);
+      std::vector<bool>& typeMarks = marks[type];
+      if (object->UhdmIndex() >= typeMarks.size()) typeMarks.resize(object->UhdmIndex() + 1);
+      typeMarks[object->UhdmIndex()] = true;
+    }
+  }
 
+  uint64_t reclaimed = 0;
 <FACTORY_GC>
+  return reclaimed;
+}
+
+uint32_t Serializer::CompactSymbols() {
+  assert(m_symbolLayers.empty());
+  MaterializeAll();
+
+  SymbolRenumbering renumbering(symbolMaker.Size());
+#if UHDM_COMPACT_LAYOUT
+  m_renumberedLocations.reset(new SymbolFactory);
+  m_locationIds.assign(m_locationMaker->Size(), 0);
+#endif
+<FACTORY_RENUMBER_SYMBOLS>
+#if UHDM_COMPACT_LAYOUT
+  m_locationMaker = std::move(m_renumberedLocations);
+  std::vector<uint32_t>().swap(m_locationIds);
+#endif
+  return symbolMaker.Renumber(renumbering);
+}
+
+#if UHDM_COMPACT_LAYOUT
+static uint32_t InternLocation(SymbolFactory* factory,
+                               const ObjectLocation& location) {
+  static_assert(sizeof(ObjectLocation) == 16, "ObjectLocation has padding");
+  static const ObjectLocation kNoLocation;
+  if (std::memcmp(&location, &kNoLocation, sizeof(location)) == 0) return 0;
+  return (RawSymbolId)factory->Make(std::string_view(
+      reinterpret_cast<const char*>(&location), sizeof(location)));
+}
+
+uint32_t Serializer::MakeLocation(const ObjectLocation& location) {
+  return InternLocation(m_locationMaker.get(), location);
 }
 
+ObjectLocation Serializer::GetLocation(uint32_t id) const {
+  ObjectLocation location;
+  if (id == 0) return location;
+  const std::string_view bytes =
+      m_locationMaker->GetSymbol(SymbolId(id, std::string_view()));
+  if (bytes.size() == sizeof(location)) {
+    std::memcpy(&location, bytes.data(), sizeof(location));
+  }
+  return location;
+}
+
+uint32_t Serializer::GetLocationCount() const {
+  return static_cast<uint32_t>(m_locationMaker->Size()) - 1;
+}
+
+uint32_t Serializer::RenumberLocation(uint32_t id,
+                                      SymbolRenumbering* renumbering) {
+  if ((id == 0) || (id >= m_locationIds.size())) return 0;
+  uint32_t& mapped = m_locationIds[id];
+  if (mapped == 0) {
+    ObjectLocation location = GetLocation(id);
+    location.m_file = (RawSymbolId)renumbering->Renumber(
+        SymbolId(location.m_file, std::string_view()));
+    mapped = InternLocation(m_renumberedLocations.get(), location);
+  }
+  return mapped;
+}
+#endif
+
 void DefaultErrorHandler(ErrorType errType, const std::string& errorMsg, const any* object1, const any* object2) {
   std::cerr << errorMsg << std::endl;
 }
 
 SymbolId Serializer::MakeSymbol(std::string_view symbol) {
-  return symbolMaker.Make(symbol);
+  return m_symbolLayers.empty() ? symbolMaker.Make(symbol)
+                                : m_symbolLayers.back()->Make(symbol);
 }
 
 std::string_view Serializer::GetSymbol(SymbolId id) const {
-  return symbolMaker.GetSymbol(id);
+  return m_symbolLayers.empty() ? symbolMaker.GetSymbol(id)
+                                : m_symbolLayers.back()->GetSymbol(id);
 }
 
 SymbolId Serializer::GetSymbolId(std::string_view symbol) const {
-  return symbolMaker.GetId(symbol);
+  return m_symbolLayers.empty() ? symbolMaker.GetId(symbol)
+                                : m_symbolLayers.back()->GetId(symbol);
 }
 
-vpiHandle Serializer::MakeUhdmHandle(UHDM_OBJECT_TYPE type, const void* object) {
+void Serializer::PushSymbolLayer() {
+  // Objects read lazily while the layer is pushed would make their symbols
+  // in it, and lose them when it is popped.
+  MaterializeAll();
+  const SymbolFactory& below =
+      m_symbolLayers.empty() ? symbolMaker : *m_symbolLayers.back();
+  m_symbolLayers.emplace_back(new SymbolFactory(below));
+}
+
+void Serializer::PopSymbolLayer(bool keep) {
+  if (m_symbolLayers.empty()) return;
+  std::unique_ptr<SymbolFactory> layer = std::move(m_symbolLayers.back());
+  m_symbolLayers.pop_back();
+  if (!keep) return;
+
+  // The layer below didn't grow since the push, its next ids are the ones
+  // of the layer.
+  SymbolFactory& below =
+      m_symbolLayers.empty() ? symbolMaker : *m_symbolLayers.back();
+  for (RawSymbolId id = 0, n = layer->Size(); id < n; ++id) {
+    const SymbolId kept = below.registerSymbol(layer->RawSymbol(id));
+    assert((RawSymbolId)kept == id + layer->m_idOffset);
+    (void)kept;
+  }
+}
+
+vpiHandle Serializer::MakeUhdmHandle(UHDM_OBJECT_TYPE type,
+                                     const BaseClass* object) {
+  Materialize(object);
   return uhdm_handleMaker.Make(type, object);
 }
 
 Serializer::IdMap Serializer::AllObjects() const {
+  // Objects of a lazy restore that weren't reached yet don't exist yet.
+  const_cast<Serializer*>(this)->MaterializeAll();
+
+  uint32_t objectCount = 0;
+  for (const auto& entry : ObjectStats()) objectCount += entry.second;
+
   IdMap idMap;
+  idMap.reserve(objectCount);
 <CAPNP_ID>
   return idMap;
 }
@@ -99,10 +216,25 @@ std::map<std::string, uint32_t, std::less<>> Serializer::ObjectStats() const {
   return stats;
 }
 
+#if UHDM_COMPACT_LAYOUT
+// Size an object would take in the default layout, with its serializer,
+// client data, location and relations of card any inline.
+static size_t InlineLayoutSize(size_t size, size_t relations) {
+  size += sizeof(Serializer*) + sizeof(ClientData*) + sizeof(SymbolId) +
+          sizeof(ObjectLocation) - sizeof(RawSymbolId) +
+          relations * sizeof(void*) - sizeof(void*) - sizeof(uint32_t);
+  return (size + alignof(void*) - 1) / alignof(void*) * alignof(void*);
+}
+#endif
+
 void Serializer::PrintStats(std::ostream& strm,
                             std::string_view infoText) const {
   strm << "=== UHDM Object Stats Begin (" << infoText << ") ===" << std::endl;
   auto stats = ObjectStats();
+  // By class, the bytes its objects take, and what each one would take in
+  // the default layout.
+  std::map<std::string_view, std::pair<size_t, size_t>> bytes;
+<FACTORY_BYTES>
   std::vector<std::string_view> names;
   names.reserve(stats.size());
   std::transform(stats.begin(), stats.end(), std::back_inserter(names),
@@ -110,23 +242,139 @@ void Serializer::PrintStats(std::ostream& strm,
                    return std::string_view(pair.first);
                  });
   std::sort(names.begin(), names.end());
+  // The longest model name is
+  // "enum_struct_union_packed_array_typespec_group"
+#if UHDM_COMPACT_LAYOUT
+  strm << std::setw(48) << std::left << "object" << std::setw(10)
+       << std::right << "count" << std::setw(10) << "bytes/obj" << std::setw(10)
+       << "default" << std::endl;
+#else
+  strm << std::setw(48) << std::left << "object" << std::setw(10)
+       << std::right << "count" << std::setw(10) << "bytes/obj" << std::endl;
+#endif
+  uint64_t totalCount = 0;
+  uint64_t totalBytes = 0;
+  [[maybe_unused]] uint64_t totalDefaultBytes = 0;
   for (std::string_view name : names) {
     auto it = stats.find(name);
     if (it->second > 0) {
-      // The longest model name is
-      // "enum_struct_union_packed_array_typespec_group"
-      strm << std::setw(48) << std::left << name << std::setw(8) << std::right
-           << it->second << std::endl;
+      const std::pair<size_t, size_t>& size = bytes[name];
+      totalCount += it->second;
+      totalBytes += size.first;
+      totalDefaultBytes += size.second * it->second;
+      strm << std::setw(48) << std::left << name << std::setw(10) << std::right
+           << it->second << std::setw(10) << size.first / it->second;
+#if UHDM_COMPACT_LAYOUT
+      strm << std::setw(10) << size.second;
+#endif
+      strm << std::endl;
     }
   }
+  strm << std::setw(48) << std::left << "total" << std::setw(10) << std::right
+       << totalCount << std::setw(10)
+       << (totalCount ? totalBytes / totalCount : 0);
+#if UHDM_COMPACT_LAYOUT
+  strm << std::setw(10) << (totalCount ? totalDefaultBytes / totalCount : 0)
+       << std::endl;
+  strm << std::setw(48) << std::left << "locations" << std::setw(10)
+       << std::right << GetLocationCount() << std::setw(10)
+       << sizeof(ObjectLocation);
+#endif
+  strm << std::endl;
   strm << "=== UHDM Object Stats End ===" << std::endl;
 }
 
+// Objects of a factory: their slabs, and in the compact layout their
+// sparse relations.
+template <typename T>
+static void AddObjectUsage(
+    std::map<std::string, Serializer::MemoryUsage, std::less<>>* usages,
+    std::string_view name, const FactoryT<T>& factory) {
+  if (factory.ReservedBytes() == 0) return;
+  Serializer::MemoryUsage& usage = usages->emplace(name, Serializer::MemoryUsage()).first->second;
+  usage.m_count += factory.Size();
+  usage.m_bytes += factory.ReservedBytes() + factory.Bytes() - factory.Size() * sizeof(T);
+  usage.m_usedBytes += factory.Bytes();
+}
+
+// Vectors of a factory, and the buffers of their elements.
+template <typename T>
+static void AddRelationUsage(
+    std::map<std::string, Serializer::MemoryUsage, std::less<>>* usages,
+    std::string_view name, const FactoryT<RelationVector<T>>& factory) {
+  if (factory.ReservedBytes() == 0) return;
+  Serializer::MemoryUsage& usage = usages->emplace(name, Serializer::MemoryUsage()).first->second;
+  usage.m_count += factory.Size();
+  usage.m_bytes += factory.ReservedBytes();
+  usage.m_usedBytes += factory.Bytes();
+  factory.ForEach([&usage](const RelationVector<T>* vect) {
+    usage.m_bytes += vect->capacity() * sizeof(T*);
+    usage.m_usedBytes += vect->size() * sizeof(T*);
+  });
+}
+
+Serializer::MemoryUsages Serializer::MemoryStats() const {
+  MemoryUsages stats;
+<FACTORY_MEMORY>
+  AddRelationUsage(&stats.m_relations, "any", anyVectMaker);
+
+  uint64_t usedBytes = 0;
+  stats.m_symbols.m_count = symbolMaker.Size();
+  stats.m_symbols.m_bytes = symbolMaker.Bytes(&usedBytes);
+  stats.m_symbols.m_usedBytes = usedBytes;
+  for (const std::unique_ptr<SymbolFactory>& layer : m_symbolLayers) {
+    stats.m_symbols.m_count += layer->Size();
+    stats.m_symbols.m_bytes += layer->Bytes(&usedBytes);
+    stats.m_symbols.m_usedBytes += usedBytes;
+  }
+#if UHDM_COMPACT_LAYOUT
+  stats.m_locations.m_count = GetLocationCount();
+  stats.m_locations.m_bytes = m_locationMaker->Bytes(&usedBytes);
+  stats.m_locations.m_usedBytes = usedBytes;
+#endif
+  stats.m_handles.m_count = uhdm_handleMaker.LiveCount();
+  stats.m_handles.m_bytes = stats.m_handles.m_count * sizeof(uhdm_handle);
+  stats.m_handles.m_usedBytes = stats.m_handles.m_bytes;
+  return stats;
+}
+
+void Serializer::PrintMemoryStats(std::ostream& strm,
+                                  std::string_view infoText) const {
+  strm << "=== UHDM Memory Stats Begin (" << infoText << ") ===" << std::endl;
+  const MemoryUsages stats = MemoryStats();
+  MemoryUsage total;
+  auto print = [&strm, &total](std::string_view name, const MemoryUsage& usage) {
+    total.m_count += usage.m_count;
+    total.m_bytes += usage.m_bytes;
+    total.m_usedBytes += usage.m_usedBytes;
+    strm << std::setw(48) << std::left << name << std::setw(10) << std::right
+         << usage.m_count << std::setw(14) << usage.m_bytes << std::setw(14)
+         << usage.m_usedBytes << std::endl;
+  };
+  strm << std::setw(48) << std::left << "storage" << std::setw(10)
+       << std::right << "count" << std::setw(14) << "bytes" << std::setw(14)
+       << "used" << std::endl;
+  for (const auto& [name, usage] : stats.m_objects) print(name, usage);
+  for (const auto& [name, usage] : stats.m_relations) {
+    print(std::string("VectorOf").append(name), usage);
+  }
+  print("symbols", stats.m_symbols);
+#if UHDM_COMPACT_LAYOUT
+  print("locations", stats.m_locations);
+#endif
+  print("handles", stats.m_handles);
+  strm << std::setw(48) << std::left << "total" << std::setw(10) << std::right
+       << total.m_count << std::setw(14) << total.m_bytes << std::setw(14)
+       << total.m_usedBytes << std::endl;
+  strm << "=== UHDM Memory Stats End ===" << std::endl;
+}
+
 bool Serializer::Erase(const BaseClass* p) {
   if (p == nullptr) {
     return true;
   }
 
+  if (m_restoreContext != nullptr) ForgetLazyObject(p);
   switch (p->UhdmType()) {
 <FACTORY_ERASE_OBJECT>
     default: return false;
@@ -137,9 +385,18 @@ Serializer::~Serializer() {
   Purge();
 }
 
+void Serializer::Compact() {
+<FACTORY_COMPACT>
+}
+
 void Serializer::Purge() {
+  ReleaseRestoreContext();
   anyVectMaker.Purge();
+  m_symbolLayers.clear();
   symbolMaker.Purge();
+#if UHDM_COMPACT_LAYOUT
+  m_locationMaker->Purge();
+#endif
   uhdm_handleMaker.Purge();
 <FACTORY_PURGE>
 }
@@ -27,6 +27,7 @@
 #ifndef UHDM_SERIALIZER_H
 #define UHDM_SERIALIZER_H
 
+#include <uhdm/BlockCodec.h>
 #include <uhdm/SymbolFactory.h>
 #include <uhdm/containers.h>
 #include <uhdm/vpi_uhdm.h>
@@ -35,8 +36,10 @@
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #define UHDM_MAX_BIT_WIDTH (1024 * 1024)
@@ -67,7 +70,8 @@ enum ErrorType {
   UHDM_NON_TEMPORAL_SEQUENCE_USE = 730,
   UHDM_NON_POSITIVE_VALUE = 731,
   UHDM_SIGNED_UNSIGNED_PORT_CONN = 732,
-  UHDM_FORCING_UNSIGNED_TYPE = 733
+  UHDM_FORCING_UNSIGNED_TYPE = 733,
+  UHDM_UNSUPPORTED_LAZY_RESTORE = 734
 };
 
 #ifndef SWIG
@@ -84,9 +88,26 @@ class FactoryT;
 
 class Serializer final {
  public:
-  using IdMap = std::map<const BaseClass*, uint32_t>;
+  using IdMap = std::vector<std::pair<const BaseClass*, uint32_t>>;
   static constexpr uint32_t kBadIndex = static_cast<uint32_t>(-1);
+  // Version of the files Save() writes. Version 1 files hold their
+  // symbols in a list rather than a pool, Restore() still reads them.
   static const uint32_t kVersion;
+  static const uint32_t kMinVersion;
+
+#ifndef SWIG
+  // On-disk encoding produced by Save().
+  // kPacked: capnp packed encoding; smallest files, must be decoded on Restore.
+  // kFlat: raw capnp words behind a short header; RestoreMapped() can
+  //        serve it directly from a read-only memory mapping.
+  // kCompressed: raw capnp words split in blocks, each compressed with the
+  //        codec set by SetCompressionCodec(), behind a block index.
+  // kStreamed: Save() writes the factory lists in chunks of raw capnp words,
+  //        each as soon as it is built, and frees it, so the whole message
+  //        is never held in memory. Read like kFlat files, always
+  //        eagerly. The files of SaveShards() are written in kFlat instead.
+  enum class SaveFormat { kPacked, kFlat, kCompressed, kStreamed };
+#endif
 
   Serializer() = default;
   ~Serializer();
@@ -94,10 +115,77 @@ class Serializer final {
 #ifndef SWIG
   void Save(const std::filesystem::path& filepath);
   void Save(const std::string& filepath);
+  // Saves the designs split in shards, one per top level module instance,
+  // package and class definition, each holding the objects whose nearest
+  // such ancestor (through VpiParent) it is. Shard 0 holds the designs, the
+  // objects under none of them and the symbols. The directory receives one
+  // file per shard, in the format set by SetSaveFormat(), and a manifest
+  // (kShardManifest) listing the shards and the shards they refer to.
+  void SaveShards(const std::filesystem::path& directory);
+  // Saves what changed since the file at basepath was written: the objects
+  // that aren't in it or differ from their saved version, the objects of
+  // the base that are gone, and the symbols the base doesn't have. Objects
+  // are matched to the base by type, name, location and parent path, so
+  // the base can be any file of the same design, written by a serializer
+  // that numbered the objects differently, but not streamed. Unchanged
+  // objects whose UhdmId differs only record their id.
+  void SaveDelta(const std::filesystem::path& basepath,
+                 const std::filesystem::path& filepath);
   void Purge();
+  // Drops the slots left behind by Erase() and renumbers the objects.
+  // Save() compacts before writing.
+  void Compact();
 
   void SetGCEnabled(bool enabled) { m_enableGC = enabled; }
-  void GarbageCollect();
+  // With symbol GC enabled, saves compact the symbols first, see
+  // CompactSymbols(). Disabled by default as it invalidates the SymbolIds
+  // and symbol views handed out before.
+  void SetSymbolGCEnabled(bool enabled) { m_enableSymbolGC = enabled; }
+  void SetSaveFormat(SaveFormat format) { m_saveFormat = format; }
+  SaveFormat GetSaveFormat() const { return m_saveFormat; }
+  void SetCompressionCodec(BlockCodec::Codec codec) { m_compressionCodec = codec; }
+
+  // Number of threads used by Save() to write and by Restore()/RestoreMapped()
+  // to read the object lists, 0 meaning one per hardware core. Defaults
+  // to 1. Lazy restore always reads on the calling thread.
+  void SetThreadCount(uint32_t count) { m_threadCount = count; }
+  uint32_t GetThreadCount() const { return m_threadCount; }
+
+  // With lazy restore enabled, Restore()/RestoreMapped() only read the
+  // designs. Any other object is created when first referenced and its
+  // content is read from the file when it is first reached through a
+  // vpiHandle (vpi_handle/vpi_scan), the listeners, DeepClone(), the
+  // relation getters or Materialize(), along with the content of the
+  // objects it refers to. Lazy restore isn't thread safe, so passes walking
+  // the model on several threads call MaterializeAll() first. Save(),
+  // GarbageCollect() and AllObjects() read everything. Files written by SaveShards(), SaveDelta()
+  // or in SaveFormat::kStreamed are restored eagerly, which is reported to
+  // the error handler as UHDM_UNSUPPORTED_LAZY_RESTORE.
+  void SetLazyRestoreEnabled(bool enabled) { m_enableLazyRestore = enabled; }
+  void Materialize(const BaseClass* object) {
+    if (m_restoreContext != nullptr) MaterializeObject(object);
+  }
+  void MaterializeAll();
+  // Returns the bytes of the objects freed to the factories, which leave the
+  // used bytes of MemoryStats(). The slabs are kept for the objects made
+  // afterwards.
+  uint64_t GarbageCollect();
+  // Drops the symbols no object holds and renumbers the others densely, in
+  // the order the objects hold them. Returns the number of symbols dropped.
+  uint32_t CompactSymbols();
+
+  // Symbol layers, for speculative passes. While a layer is pushed, new
+  // symbols are made in it and those below can't grow. Popping it drops its
+  // symbols at once, and with them the SymbolIds made since the push, unless
+  // keep is set: they then move to the layer below under the same ids.
+  // Pushing reads all the objects of a lazy restore. Save(), SaveShards(),
+  // SaveDelta() and CompactSymbols() expect no layer pushed, Purge() pops
+  // them all.
+  void PushSymbolLayer();
+  void PopSymbolLayer(bool keep = false);
+  uint32_t GetSymbolLayerCount() const {
+    return static_cast<uint32_t>(m_symbolLayers.size());
+  }
 
   void SetErrorHandler(ErrorHandler handler) { m_errorHandler = handler; }
   ErrorHandler GetErrorHandler() { return m_errorHandler; }
@@ -107,30 +195,105 @@ class Serializer final {
 
   const std::vector<vpiHandle> Restore(const std::filesystem::path& filepath);
   const std::vector<vpiHandle> Restore(const std::string& filepath);
+
+  // Restore a file written with SaveFormat::kFlat by memory mapping it
+  // instead of reading and unpacking it. Pages of the mapping are shared by
+  // all processes reading the same file. Falls back to Restore() for files
+  // in the packed format.
+  const std::vector<vpiHandle> RestoreMapped(
+      const std::filesystem::path& filepath);
+  const std::vector<vpiHandle> RestoreMapped(const std::string& filepath);
+
+#ifndef SWIG
+  // Restores shard 0 and the named shards of a SaveShards() directory, along
+  // with the shards they refer to. References from shard 0 into shards that
+  // weren't restored are dropped. Always restores eagerly.
+  const std::vector<vpiHandle> RestoreShards(
+      const std::filesystem::path& directory,
+      const std::vector<std::string>& names);
+  static constexpr std::string_view kShardManifest = "manifest.txt";
+
+  // Restores the file at basepath with a delta written by SaveDelta()
+  // against it layered over it. Files of the base in SaveFormat::kFlat are
+  // memory mapped. Always restores eagerly.
+  const std::vector<vpiHandle> RestoreDelta(
+      const std::filesystem::path& basepath,
+      const std::filesystem::path& deltapath);
+#endif
   std::map<std::string, uint32_t, std::less<>> ObjectStats() const;
   void PrintStats(std::ostream& strm, std::string_view infoText) const;
 
+#ifndef SWIG
+  // Memory held by one kind of storage: m_bytes is all of it, unused
+  // capacity included, m_usedBytes what the live content takes.
+  struct MemoryUsage {
+    uint64_t m_count = 0;  // Objects, vectors, symbols or handles
+    uint64_t m_bytes = 0;
+    uint64_t m_usedBytes = 0;
+  };
+  struct MemoryUsages {
+    // By class, the objects in their factory slabs.
+    std::map<std::string, MemoryUsage, std::less<>> m_objects;
+    // By element class, the relation vectors and their buffers, capacity
+    // against size.
+    std::map<std::string, MemoryUsage, std::less<>> m_relations;
+    MemoryUsage m_symbols;    // With the symbol layers
+    MemoryUsage m_locations;  // Compact layout only
+    MemoryUsage m_handles;    // vpiHandles made and not released yet
+  };
+  MemoryUsages MemoryStats() const;
+  void PrintMemoryStats(std::ostream& strm, std::string_view infoText) const;
+#endif
+
 #ifndef SWIG
  private:
   template <typename T>
   T* Make(FactoryT<T>* const factory);
 
+  // Returns the number of objects the factory had before.
   template <typename T>
-  void Make(FactoryT<T>* const factory, uint32_t count);
+  uint32_t Make(FactoryT<T>* const factory, uint32_t count);
 
   template <typename T>
-  std::vector<T*>* Make(FactoryT<std::vector<T*>>* const factory);
+  RelationVector<T>* Make(FactoryT<RelationVector<T>>* const factory);
+
+  // In a slot of FactoryT::AddSlots(), its UhdmId is the one restored.
+  template <typename T>
+  T* MakeAt(FactoryT<T>* const factory, uint32_t index);
 
  public:
-  <FACTORY_FUNCTION_DECLARATIONS> std::vector<any*>* MakeAnyVec() {
+  <FACTORY_FUNCTION_DECLARATIONS> VectorOfany* MakeAnyVec() {
     return anyVectMaker.Make();
   }
 
+  // Safe to call from several threads at once, see SymbolFactory.
   SymbolId MakeSymbol(std::string_view symbol);
   std::string_view GetSymbol(SymbolId id) const;
   SymbolId GetSymbolId(std::string_view symbol) const;
 
-  vpiHandle MakeUhdmHandle(UHDM_OBJECT_TYPE type, const void* object);
+#if UHDM_COMPACT_LAYOUT
+  // Locations of the objects, interned. Id 0 is the empty location. Safe to
+  // call from several threads at once, like MakeSymbol().
+  uint32_t MakeLocation(const ObjectLocation& location);
+  ObjectLocation GetLocation(uint32_t id) const;
+  uint32_t GetLocationCount() const;
+  // The id of the location with its file renumbered, during CompactSymbols().
+  uint32_t RenumberLocation(uint32_t id, SymbolRenumbering* renumbering);
+#endif
+
+  // Handle of an object, restored first if it is still pending. The handles
+  // made for the objects of a serializer are released before it is
+  // destroyed, they are counted by its MemoryStats().
+  vpiHandle MakeUhdmHandle(UHDM_OBJECT_TYPE type, const BaseClass* object);
+  // Iterator over a relation vector of the objects of this serializer, whose
+  // elements are of the given type.
+  vpiHandle MakeUhdmIterator(UHDM_OBJECT_TYPE type, const void* objects) {
+    return uhdm_handleMaker.Make(type, objects);
+  }
+  // Number of vpiHandles made for the objects of this serializer, by
+  // MakeUhdmHandle(), MakeUhdmIterator(), vpi_handle(), vpi_iterate(),
+  // vpi_scan()...
+  uint64_t GetMadeHandleCount() const { return uhdm_handleMaker.MadeCount(); }
 
   bool Erase(const BaseClass* p);
 
@@ -141,16 +304,59 @@ class Serializer final {
   struct RestoreAdapter;
   friend struct RestoreAdapter;
 
+  // Owns the capnp message reader (and its backing file or mapping)
+  // for the duration of a restore.
+  struct RestoreContext;
+
+  // Assignment of the objects to shards while saving them, see SaveShards().
+  struct ShardPlan;
+
+  // Matching of the objects to the base of a delta, see SaveDelta().
+  struct DeltaPlan;
+
+  // Leading words of files written in SaveFormat::kFlat and kCompressed.
+  static constexpr std::string_view kFlatFileHeader = "UHDMFLAT";
+  static constexpr std::string_view kCompressedFileHeader = "UHDMBLKZ";
+  // Leading word of files written by SaveDelta(), a packed message follows.
+  static constexpr std::string_view kDeltaFileHeader = "UHDMDLTA";
+  // Leading and last word of files written in SaveFormat::kStreamed.
+  static constexpr std::string_view kStreamFileHeader = "UHDMSTRM";
+
  private:
-  BaseClass* GetObject(uint32_t objectType, uint32_t index) const;
+  BaseClass* GetObject(uint32_t objectType, uint64_t id);
+  BaseClass* MakeObject(uint32_t objectType, uint32_t index);
+  BaseClass* GetLazyObject(uint32_t objectType, uint32_t index);
+  bool ReadLazyObject(const BaseClass* object, std::vector<const BaseClass*>* referenced);
+  void MaterializeObject(const BaseClass* object);
+  void ForgetLazyObject(const BaseClass* object);
+
+  void SaveStreamed(const std::string& filepath);
+  const std::vector<vpiHandle> Restore(RestoreContext* const context);
+  void ReleaseRestoreContext();
 
   uint64_t m_version = 0;
   uint32_t m_objId = 0;
+  uint32_t m_threadCount = 1;
   bool m_enableGC = true;
+  bool m_enableSymbolGC = false;
+  bool m_enableLazyRestore = false;
+  SaveFormat m_saveFormat = SaveFormat::kPacked;
+  BlockCodec::Codec m_compressionCodec = BlockCodec::Codec::kLz;
+  RestoreContext* m_restoreContext = nullptr;
+  ShardPlan* m_shardPlan = nullptr;
+  DeltaPlan* m_deltaPlan = nullptr;
   ErrorHandler m_errorHandler = DefaultErrorHandler;
 
   VectorOfanyFactory anyVectMaker;
   SymbolFactory symbolMaker;
+  // Pushed by PushSymbolLayer(), each one a snapshot of the one below.
+  std::vector<std::unique_ptr<SymbolFactory>> m_symbolLayers;
+#if UHDM_COMPACT_LAYOUT
+  std::unique_ptr<SymbolFactory> m_locationMaker{new SymbolFactory};
+  // While CompactSymbols() runs, the renumbered locations and their new ids.
+  std::unique_ptr<SymbolFactory> m_renumberedLocations;
+  std::vector<uint32_t> m_locationIds;
+#endif
   uhdm_handleFactory uhdm_handleMaker;
 <FACTORY_DATA_MEMBERS>
 #endif
@@ -32,16 +32,28 @@
 #if defined(_MSC_VER)
   #include <io.h>
 #else
+  #include <sys/mman.h>
   #include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
 #include <vector>
 
 #include <capnp/message.h>
 #include <capnp/serialize-packed.h>
+#include <capnp/serialize.h>
 
 #include "UHDM.capnp.h"
+#include "Serializer_restore.h"
+#include <uhdm/ThreadPool.h>
 #include <uhdm/uhdm.h>
 
 #include "uhdm/config.h"
@@ -58,20 +70,79 @@ inline T* Serializer::Make(FactoryT<T>* const factory) {
 }
 
 template <typename T>
-void Serializer::Make(FactoryT<T>* const factory, uint32_t count) {
+uint32_t Serializer::Make(FactoryT<T>* const factory, uint32_t count) {
+  const uint32_t offset = static_cast<uint32_t>(factory->objects_.size());
   for (uint32_t i = 0; i < count; ++i) Make(factory);
+  return offset;
 }
 
 template <typename T>
-inline std::vector<T*>* Serializer::Make(FactoryT<std::vector<T*>>* const factory) {
+inline RelationVector<T>* Serializer::Make(FactoryT<RelationVector<T>>* const factory) {
   return factory->Make();
 }
 
-BaseClass* Serializer::GetObject(uint32_t objectType, uint32_t index) const {
+template <typename T>
+inline T* Serializer::MakeAt(FactoryT<T>* const factory, uint32_t index) {
+  T* const obj = factory->MakeAt(index);
+  obj->SetSerializer(this);
+  return obj;
+}
+
+BaseClass* Serializer::MakeObject(uint32_t objectType, uint32_t index) {
+  switch (static_cast<UHDM_OBJECT_TYPE>(objectType)) {
+<FACTORY_MAKE_OBJECT>
+    default: return nullptr;
+  }
+}
+
+BaseClass* Serializer::GetLazyObject(uint32_t objectType, uint32_t index) {
+  if (objectType >= m_restoreContext->m_lazySlots.size()) return nullptr;
+  std::vector<BaseClass*>& slots = m_restoreContext->m_lazySlots[objectType];
+  if (index >= slots.size()) return nullptr;
+
+  BaseClass*& slot = slots[index];
+  if (slot == nullptr) {
+    if (m_restoreContext->m_erased.count((static_cast<uint64_t>(objectType) << 32) | index) != 0) return nullptr;
+    // Create the object now, its content is read on first use. It goes to
+    // its slot in the factory, as if restored eagerly.
+    slot = MakeObject(objectType, m_restoreContext->GetOffset(static_cast<UHDM_OBJECT_TYPE>(objectType)) + index);
+    m_restoreContext->m_entries.emplace(slot, index);
+    m_restoreContext->m_pending.emplace(slot);
+  }
+  if (m_restoreContext->m_referenced != nullptr) m_restoreContext->m_referenced->emplace_back(slot);
+  return slot;
+}
+
+void Serializer::ForgetLazyObject(const BaseClass* object) {
+  auto it = m_restoreContext->m_entries.find(object);
+  if (it == m_restoreContext->m_entries.end()) return;
+
+  const uint32_t objectType = static_cast<uint32_t>(object->UhdmType());
+  m_restoreContext->m_lazySlots[objectType][it->second] = nullptr;
+  m_restoreContext->m_erased.emplace((static_cast<uint64_t>(objectType) << 32) | it->second);
+  m_restoreContext->m_entries.erase(it);
+  m_restoreContext->m_pending.erase(object);
+  m_restoreContext->m_unread.erase(object);
+}
+
+BaseClass* Serializer::GetObject(uint32_t objectType, uint64_t id) {
+  // Only files of a sharded save use the upper half, for the shard.
+  uint32_t index = static_cast<uint32_t>(id);
   if (index == kBadIndex) {
     return nullptr;
   }
 
+  if (m_restoreContext != nullptr) {
+    if (m_restoreContext->m_lazy) {
+      return GetLazyObject(objectType, index);
+    }
+    if (!m_restoreContext->m_shards.empty()) {
+      const RestoreContext* const shard = m_restoreContext->GetShard(id >> 32);
+      if (shard == nullptr) return nullptr;  // Not restored
+      index += shard->GetOffset(static_cast<UHDM_OBJECT_TYPE>(objectType));
+    }
+  }
+
   // TODO: have objectTyp enum UHDM_OBJECT_TYPE type in the first place
   switch (static_cast<UHDM_OBJECT_TYPE>(objectType)) {
 <FACTORY_GET_OBJECT>
@@ -81,61 +152,647 @@ BaseClass* Serializer::GetObject(uint32_t objectType, uint32_t index) const {
 
 <FACTORY_FUNCTION_IMPLEMENTATIONS>
 
+// Where the objects of a delta go in the factories restored from its base,
+// see Serializer::RestoreDelta().
+struct DeltaLayout final {
+  explicit DeltaLayout(UhdmRoot::Reader delta) {
+    for (::ObjIndexType::Reader object : delta.getDeltaObjects()) {
+      m_targets[object.getType()].emplace_back(object.getIndex());
+    }
+    for (::ObjIndexType::Reader object : delta.getDeltaRemoved()) {
+      m_removed[object.getType()].emplace_back(object.getIndex());
+    }
+    const ::capnp::List<::ObjIndexType>::Reader renumbered = delta.getDeltaRenumbered();
+    const ::capnp::List<uint64_t>::Reader ids = delta.getDeltaRenumberedIds();
+    for (uint32_t index = 0, n = std::min(renumbered.size(), ids.size()); index < n; ++index) {
+      m_renumbered[renumbered[index].getType()].emplace_back(renumbered[index].getIndex(), ids[index]);
+    }
+  }
+
+  // By type: layered index of the objects of the delta lists, base objects
+  // removed by the delta and base objects not to read.
+  std::unordered_map<uint32_t, std::vector<uint64_t>> m_targets;
+  std::unordered_map<uint32_t, std::vector<uint64_t>> m_removed;
+  std::unordered_map<uint32_t, std::vector<bool>> m_skipped;
+  std::vector<const BaseClass*> m_erased;
+  // By type: base objects the delta keeps but gives another UhdmId, and the
+  // objects with that id, set once read.
+  std::unordered_map<uint32_t, std::vector<std::pair<uint64_t, uint64_t>>> m_renumbered;
+  std::vector<std::pair<BaseClass*, uint64_t>> m_uhdmIds;
+};
+
 struct Serializer::RestoreAdapter {
+  // Appends the object of the given id to a restored vector. Null entries
+  // keep their place, only references into the shards that aren't restored
+  // are left out.
+  template <typename T>
+  static void AddObject(Serializer *const serializer, RelationVector<T>* vect, uint32_t objectType, uint64_t id) {
+    BaseClass* const item = serializer->GetObject(objectType, id);
+    if ((item == nullptr) && (serializer->m_restoreContext != nullptr) &&
+        serializer->m_restoreContext->IsInUnrestoredShard(id)) {
+      return;
+    }
+    vect->emplace_back(static_cast<T*>(item));
+  }
+
   void operator()(Any::Reader reader, Serializer *const serializer, BaseClass *const obj) const {
     obj->VpiParent(serializer->GetObject(reader.getVpiParent().getType(), reader.getVpiParent().getIndex() - 1));
+#if UHDM_COMPACT_LAYOUT
+    ObjectLocation location;
+    location.m_file = (RawSymbolId)serializer->MakeSymbol(serializer->symbolMaker.GetSymbol(SymbolId(reader.getVpiFile(), kUnknownRawSymbol)));
+    location.m_line = reader.getVpiLineNo();
+    location.m_column = reader.getVpiColumnNo();
+    location.m_endLine = reader.getVpiEndLineNo();
+    location.m_endColumn = reader.getVpiEndColumnNo();
+    obj->SetLocation(location);
+#else
     obj->VpiFile(serializer->symbolMaker.GetSymbol(SymbolId(reader.getVpiFile(), kUnknownRawSymbol)));
     obj->VpiLineNo(reader.getVpiLineNo());
     obj->VpiColumnNo(reader.getVpiColumnNo());
     obj->VpiEndLineNo(reader.getVpiEndLineNo());
     obj->VpiEndColumnNo(reader.getVpiEndColumnNo());
+#endif
     obj->UhdmId(reader.getUhdmId());
   };
 
 <CAPNP_RESTORE_ADAPTERS>
 
+  // Queues the restore of a factory list, whose objects start at offset in
+  // the factory, split in chunks of kChunkSize objects. All objects exist at
+  // this point and every chunk only writes into its own objects, so chunks
+  // can run concurrently.
   template<typename T, typename U, typename = typename std::enable_if<std::is_base_of<BaseClass, T>::value>::type>
-  void operator()(typename ::capnp::List<U>::Reader reader, Serializer *serializer, typename FactoryT<T>::objects_t &objects) const {
-    uint32_t index = 0;
-    for (typename U::Reader obj : reader)
-      operator()(obj, serializer, objects[index++]);
+  void operator()(typename ::capnp::List<U>::Reader reader, Serializer *serializer, typename FactoryT<T>::objects_t &objects,
+                  uint32_t offset, std::vector<ThreadPool::task_t> *tasks) const {
+    for (uint32_t begin = 0, n = reader.size(); begin < n; begin += kChunkSize) {
+      const uint32_t end = std::min(n, begin + kChunkSize);
+      tasks->emplace_back([this, reader, serializer, &objects, offset, begin, end]() {
+        for (uint32_t index = begin; index < end; ++index)
+          operator()(reader[index], serializer, objects[offset + index]);
+      });
+    }
   }
+
+  // Makes the objects of a base factory list with a delta layered over it
+  // and queues their restore, see RestoreDelta(). Base objects the delta
+  // replaces or removes aren't read, removed ones are erased afterwards.
+  template<typename T, typename U, typename = typename std::enable_if<std::is_base_of<BaseClass, T>::value>::type>
+  void operator()(typename ::capnp::List<U>::Reader base, typename ::capnp::List<U>::Reader delta, Serializer *serializer,
+                  FactoryT<T> *factory, DeltaLayout *layout, UHDM_OBJECT_TYPE type, std::vector<ThreadPool::task_t> *tasks) const {
+    const uint32_t slot = static_cast<uint32_t>(type);
+    const std::vector<uint64_t>& targets = layout->m_targets[slot];
+    std::vector<bool>& skipped = layout->m_skipped[slot];
+    const uint64_t limit = uint64_t(base.size()) + delta.size();
+    uint32_t count = base.size();
+    skipped.resize(base.size(), false);
+    for (uint64_t target : targets) {
+      if (target >= limit) continue;
+      count = std::max(count, static_cast<uint32_t>(target + 1));
+      if (target < base.size()) skipped[target] = true;
+    }
+    for (uint64_t index : layout->m_removed[slot]) {
+      if (index < base.size()) skipped[index] = true;
+    }
+
+    serializer->Make(factory, count);
+    typename FactoryT<T>::objects_t &objects = factory->objects_;
+    for (uint64_t index : layout->m_removed[slot]) {
+      if (index < base.size()) layout->m_erased.emplace_back(objects[index]);
+    }
+    for (const std::pair<uint64_t, uint64_t>& renumbered : layout->m_renumbered[slot]) {
+      if (renumbered.first < base.size()) layout->m_uhdmIds.emplace_back(objects[renumbered.first], renumbered.second);
+    }
+
+    for (uint32_t begin = 0, n = base.size(); begin < n; begin += kChunkSize) {
+      const uint32_t end = std::min(n, begin + kChunkSize);
+      tasks->emplace_back([this, base, serializer, &objects, &skipped, begin, end]() {
+        for (uint32_t index = begin; index < end; ++index)
+          if (!skipped[index]) operator()(base[index], serializer, objects[index]);
+      });
+    }
+    for (uint32_t begin = 0, n = std::min<size_t>(delta.size(), targets.size()); begin < n; begin += kChunkSize) {
+      const uint32_t end = std::min(n, begin + kChunkSize);
+      tasks->emplace_back([this, delta, serializer, &objects, &targets, limit, begin, end]() {
+        for (uint32_t index = begin; index < end; ++index)
+          if (targets[index] < limit) operator()(delta[index], serializer, objects[targets[index]]);
+      });
+    }
+  }
+
+  // Vector factories, and the pools of their buffers, are shared between
+  // the chunks: making a vector and reserving its size elements take the
+  // lock its factory hashes to. Filling it doesn't grow it past size.
+  template<typename T>
+  RelationVector<T>* MakeVect(FactoryT<RelationVector<T>> *const factory, uint32_t size) const {
+    std::unique_lock<std::mutex> guard;
+    if (m_vectLocks != nullptr) {
+      const size_t slot = (reinterpret_cast<uintptr_t>(factory) / sizeof(*factory)) % m_vectLocks->size();
+      guard = std::unique_lock<std::mutex>((*m_vectLocks)[slot]);
+    }
+    RelationVector<T>* const vect = factory->Make();
+    vect->reserve(size);
+    return vect;
+  }
+
+  static constexpr uint32_t kChunkSize = 4096;
+  std::array<std::mutex, 64> *m_vectLocks = nullptr;
 };
 
+bool Serializer::ReadLazyObject(const BaseClass* object, std::vector<const BaseClass*>* referenced) {
+  if (m_restoreContext->m_pending.erase(object) == 0) return false;
+
+  BaseClass* const obj = const_cast<BaseClass*>(object);
+  const uint32_t index = m_restoreContext->m_entries[object];
+  UhdmRoot::Reader cap_root = m_restoreContext->m_root;
+  RestoreAdapter adapter;
+  m_restoreContext->m_referenced = referenced;
+  switch (obj->UhdmType()) {
+<CAPNP_RESTORE_OBJECT>
+    default: break;
+  }
+  m_restoreContext->m_referenced = nullptr;
+  return true;
+}
+
+// The objects an object refers to are read along with it, so that the
+// relations of an object reached through a handle, a listener or a clone
+// can be followed one step through plain accessors. Their own relations are
+// read when they are reached in turn.
+void Serializer::MaterializeObject(const BaseClass* object) {
+  if ((object == nullptr) || !m_restoreContext->m_lazy) return;
+
+  std::vector<const BaseClass*> referenced;
+  if (!ReadLazyObject(object, &referenced)) {
+    auto it = m_restoreContext->m_unread.find(object);
+    if (it == m_restoreContext->m_unread.end()) return;
+    referenced = std::move(it->second);
+    m_restoreContext->m_unread.erase(it);
+  }
+
+  for (const BaseClass* ref : referenced) {
+    std::vector<const BaseClass*> unread;
+    if (ReadLazyObject(ref, &unread) && !unread.empty()) {
+      m_restoreContext->m_unread.emplace(ref, std::move(unread));
+    }
+  }
+}
+
+void Serializer::MaterializeAll() {
+  if (m_restoreContext == nullptr) return;
+
+  if (m_restoreContext->m_lazy) {
+    std::vector<std::vector<BaseClass*>>& lazySlots = m_restoreContext->m_lazySlots;
+    for (uint32_t objectType = 0, n = lazySlots.size(); objectType < n; ++objectType) {
+      for (uint32_t index = 0, m = lazySlots[objectType].size(); index < m; ++index) {
+        if (const BaseClass* const object = GetLazyObject(objectType, index)) ReadLazyObject(object, nullptr);
+      }
+    }
+  }
+  ReleaseRestoreContext();
+}
+
+void Serializer::ReleaseRestoreContext() {
+  if ((m_restoreContext != nullptr) && m_restoreContext->m_lazy) {
+    --BaseClass::lazyRestores_;
+  }
+  delete m_restoreContext;
+  m_restoreContext = nullptr;
+}
+
 const std::vector<vpiHandle> Serializer::Restore(const std::filesystem::path& filepath) {
     return Restore( filepath.string());
 }
+
+// Reads size bytes at offset from the start of the file.
+static bool ReadAt(int32_t fileid, uint64_t offset, char* out, size_t size) {
+  if (static_cast<uint64_t>(lseek(fileid, offset, SEEK_SET)) != offset) return false;
+  while (size > 0) {
+    const auto count = read(fileid, out, static_cast<uint32_t>(std::min<size_t>(size, 1 << 30)));
+    if (count <= 0) return false;
+    out += count;
+    size -= count;
+  }
+  return true;
+}
+
+// Reads a file written in SaveFormat::kCompressed into a word aligned
+// buffer. The blocks are read through the index, one batch of a block per
+// thread at a time, and the batch is decoded concurrently, so besides the
+// message only one encoded block per thread is held.
+static bool ReadCompressedMessage(int32_t fileid, uint32_t threadCount, kj::Array<::capnp::word>* words) {
+  struct stat status;
+  if (fstat(fileid, &status) != 0) return false;
+  const uint64_t fileSize = static_cast<uint64_t>(status.st_size);
+
+  BlockCodec::FileHeader header;
+  if ((fileSize < sizeof(header)) || !ReadAt(fileid, 0, reinterpret_cast<char*>(&header), sizeof(header))) return false;
+  BlockCodec::ConvertByteOrder(&header);
+  const uint64_t indexEnd = sizeof(header) + uint64_t(header.m_blockCount) * sizeof(BlockCodec::BlockEntry);
+  if ((indexEnd > fileSize) || ((header.m_rawSize % sizeof(::capnp::word)) != 0)) return false;
+
+  std::vector<BlockCodec::BlockEntry> entries(header.m_blockCount);
+  if (!ReadAt(fileid, sizeof(header), reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(BlockCodec::BlockEntry))) return false;
+  uint64_t rawSize = 0;
+  for (BlockCodec::BlockEntry& entry : entries) {
+    BlockCodec::ConvertByteOrder(&entry);
+    if ((entry.m_offset < indexEnd) || (entry.m_offset + entry.m_size > fileSize) ||
+        (rawSize + entry.m_rawSize > header.m_rawSize)) {
+      return false;
+    }
+    rawSize += entry.m_rawSize;
+  }
+  if (rawSize != header.m_rawSize) return false;
+
+  *words = kj::heapArray<::capnp::word>(header.m_rawSize / sizeof(::capnp::word));
+  char* const output = reinterpret_cast<char*>(words->begin());
+  const BlockCodec::Codec codec = static_cast<BlockCodec::Codec>(header.m_codec);
+  const ThreadPool pool(threadCount);
+  std::vector<std::vector<char>> blocks(std::min<size_t>(pool.GetThreadCount(), entries.size()));
+  std::vector<char> decoded(blocks.size(), 0);  // Not vector<bool>, written concurrently
+  std::vector<ThreadPool::task_t> tasks;
+  uint64_t rawOffset = 0;
+  for (size_t first = 0; first < entries.size(); first += blocks.size()) {
+    tasks.clear();
+    for (size_t i = 0; (i < blocks.size()) && (first + i < entries.size()); ++i) {
+      const BlockCodec::BlockEntry& entry = entries[first + i];
+      blocks[i].resize(entry.m_size);
+      if (!ReadAt(fileid, entry.m_offset, blocks[i].data(), entry.m_size)) return false;
+      tasks.emplace_back([&blocks, &decoded, &entry, codec, output, rawOffset, i]() {
+        decoded[i] = BlockCodec::Decompress(codec, blocks[i].data(), blocks[i].size(), output + rawOffset, entry.m_rawSize);
+      });
+      rawOffset += entry.m_rawSize;
+    }
+    pool.Run(tasks);
+    if (std::find(decoded.begin(), decoded.begin() + tasks.size(), 0) != decoded.begin() + tasks.size()) return false;
+  }
+  return true;
+}
+
+std::unique_ptr<Serializer::RestoreContext> Serializer::RestoreContext::Open(const std::string& filepath, uint32_t threadCount) {
+  int32_t fileid = open(filepath.c_str(), O_RDONLY | O_BINARY);
+  if (fileid < 0) return nullptr;
+
+  static_assert(kCompressedFileHeader.size() == kFlatFileHeader.size());
+  static_assert(kDeltaFileHeader.size() == kFlatFileHeader.size());
+  static_assert(kStreamFileHeader.size() == kFlatFileHeader.size());
+  char header[kFlatFileHeader.size()];
+  const bool hasHeader = (read(fileid, header, sizeof(header)) == sizeof(header));
+  std::unique_ptr<RestoreContext> context = std::make_unique<RestoreContext>();
+
+  if (hasHeader && (kCompressedFileHeader.compare(0, sizeof(header), header, sizeof(header)) == 0)) {
+    const bool valid = ReadCompressedMessage(fileid, threadCount, &context->m_buffer);
+    close(fileid);
+    if (!valid) return nullptr;
+    context->m_reader = std::make_unique<::capnp::FlatArrayMessageReader>(
+        context->m_buffer.asPtr(), GetReaderOptions());
+    return context;
+  }
+
+  if (hasHeader && (kDeltaFileHeader.compare(0, sizeof(header), header, sizeof(header)) == 0)) {
+    // A packed message follows the header.
+    context->m_delta = true;
+    context->m_fileid = fileid;
+    context->m_reader = std::make_unique<::capnp::PackedFdMessageReader>(
+        fileid, GetReaderOptions());
+    return context;
+  }
+
+  const bool streamed = hasHeader && (kStreamFileHeader.compare(0, sizeof(header), header, sizeof(header)) == 0);
+  if (!hasHeader || (!streamed && (kFlatFileHeader.compare(0, sizeof(header), header, sizeof(header)) != 0))) {
+    // Not a flat file, use the regular (packed) reader.
+    lseek(fileid, 0, SEEK_SET);
+    context->m_fileid = fileid;
+    context->m_reader = std::make_unique<::capnp::PackedFdMessageReader>(
+        fileid, GetReaderOptions());
+    return context;
+  }
+
+  struct stat status;
+  if (fstat(fileid, &status) != 0) {
+    close(fileid);
+    return nullptr;
+  }
+
+  const size_t size = static_cast<size_t>(status.st_size);
+  const char* const content = context->Map(fileid, size);
+  close(fileid);
+
+  if (!streamed) {
+    const kj::ArrayPtr<const ::capnp::word> words(
+        reinterpret_cast<const ::capnp::word*>(content + kFlatFileHeader.size()),
+        (size - kFlatFileHeader.size()) / sizeof(::capnp::word));
+    context->m_reader = std::make_unique<::capnp::FlatArrayMessageReader>(
+        words, GetReaderOptions());
+    return context;
+  }
+
+  // The footer locates the entries, the last one is the root message and
+  // the others the chunks, restored as parts of it.
+  static_assert(kStreamFileHeader.size() == sizeof(StreamFooter::m_magic));
+  StreamFooter footer;
+  if (size < kStreamFileHeader.size() + sizeof(footer)) return nullptr;
+  std::memcpy(&footer, content + size - sizeof(footer), sizeof(footer));
+  ConvertByteOrder(&footer);
+  const size_t entriesEnd = size - sizeof(footer);
+  if ((kStreamFileHeader.compare(0, sizeof(footer.m_magic), footer.m_magic, sizeof(footer.m_magic)) != 0) ||
+      (footer.m_entryCount == 0) ||
+      (footer.m_entryCount > (entriesEnd - kStreamFileHeader.size()) / sizeof(StreamEntry))) {
+    return nullptr;
+  }
+
+  const size_t entriesBegin = entriesEnd - footer.m_entryCount * sizeof(StreamEntry);
+  for (uint64_t i = 0; i < footer.m_entryCount; ++i) {
+    StreamEntry entry;
+    std::memcpy(&entry, content + entriesBegin + i * sizeof(entry), sizeof(entry));
+    ConvertByteOrder(&entry);
+    if ((entry.m_offset < kStreamFileHeader.size()) || (entry.m_offset > entriesBegin) ||
+        (entry.m_offset % sizeof(::capnp::word) != 0) ||
+        (entry.m_words > (entriesBegin - entry.m_offset) / sizeof(::capnp::word))) {
+      return nullptr;
+    }
+
+    const kj::ArrayPtr<const ::capnp::word> words(
+        reinterpret_cast<const ::capnp::word*>(content + entry.m_offset), entry.m_words);
+    std::unique_ptr<::capnp::MessageReader> reader =
+        std::make_unique<::capnp::FlatArrayMessageReader>(words, GetReaderOptions());
+    if (i + 1 == footer.m_entryCount) {
+      context->m_reader = std::move(reader);
+    } else {
+      context->m_shardFiles.emplace_back(std::make_unique<RestoreContext>())->m_reader = std::move(reader);
+    }
+  }
+  return context;
+}
+
+const char* Serializer::RestoreContext::Map(int32_t fileid, size_t size) {
+#if !defined(_MSC_VER)
+  void* const mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fileid, 0);
+  if (mapping != MAP_FAILED) {
+    m_mapping.reset(mapping, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+    return static_cast<const char*>(mapping);
+  }
+#endif
+  // No mapping available; read the file into a word aligned buffer instead.
+  m_buffer = kj::heapArray<::capnp::word>(
+      (size + sizeof(::capnp::word) - 1) / sizeof(::capnp::word));
+  char* const buffer = reinterpret_cast<char*>(m_buffer.begin());
+  lseek(fileid, 0, SEEK_SET);
+  size_t offset = 0;
+  while (offset < size) {
+    const auto count = read(fileid, buffer + offset, static_cast<uint32_t>(size - offset));
+    if (count <= 0) break;
+    offset += count;
+  }
+  return buffer;
+}
+
+bool Serializer::RestoreContext::LoadSymbols(UhdmRoot::Reader root, SymbolFactory* symbols) const {
+  const ::capnp::Data::Reader pool = root.getSymbolPool();
+  if (pool.size() == 0) {
+    // Written before symbol pools.
+    for (const auto& symbol : root.getSymbols()) {
+      symbols->Make(symbol.cStr());
+    }
+    return true;
+  }
+
+  const char* data = reinterpret_cast<const char*>(pool.begin());
+  std::shared_ptr<const void> owner = m_mapping;
+  if ((owner == nullptr) || ((reinterpret_cast<uintptr_t>(data) % sizeof(uint64_t)) != 0)) {
+    // The message goes away with the restore, keep a copy.
+    std::shared_ptr<uint64_t[]> copy(new uint64_t[(pool.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t)]);
+    std::memcpy(copy.get(), data, pool.size());
+    data = reinterpret_cast<const char*>(copy.get());
+    owner = std::move(copy);
+  }
+  return symbols->AdoptPool(std::move(owner), data, pool.size());
+}
+
+uint32_t Serializer::RestoreContext::SymbolCount(UhdmRoot::Reader root) {
+  const ::capnp::Data::Reader pool = root.getSymbolPool();
+  if (pool.size() == 0) return root.getSymbols().size();
+  return SymbolFactory::PoolSymbolCount(reinterpret_cast<const char*>(pool.begin()), pool.size());
+}
+
 const std::vector<vpiHandle> Serializer::Restore(const std::string& filepath) {
   Purge();
+  std::unique_ptr<RestoreContext> context = RestoreContext::Open(filepath, m_threadCount);
+  if (context == nullptr) return {};
+  return Restore(context.release());
+}
+
+const std::vector<vpiHandle> Serializer::RestoreMapped(const std::filesystem::path& filepath) {
+    return RestoreMapped( filepath.string());
+}
+
+const std::vector<vpiHandle> Serializer::RestoreMapped(const std::string& filepath) {
+  // Restore() maps flat files already.
+  return Restore(filepath);
+}
+
+const std::vector<vpiHandle> Serializer::RestoreShards(const std::filesystem::path& directory,
+                                                       const std::vector<std::string>& names) {
+  Purge();
+
+  struct Shard final {
+    std::string m_name;
+    std::string m_file;
+    std::vector<uint32_t> m_dependencies;
+  };
+  std::vector<Shard> shards;
+  std::ifstream manifest(directory / kShardManifest);
+  std::string line;
+  while (std::getline(manifest, line)) {
+    std::istringstream fields(line);
+    std::string id, kind, dependencies;
+    Shard shard;
+    std::getline(fields, id, '\t');
+    std::getline(fields, kind, '\t');
+    std::getline(fields, shard.m_name, '\t');
+    std::getline(fields, shard.m_file, '\t');
+    std::getline(fields, dependencies, '\t');
+    // Shards are listed in order of their ids.
+    if (std::strtoul(id.c_str(), nullptr, 10) != shards.size()) return {};
+
+    std::istringstream dependencyList(dependencies);
+    std::string dependency;
+    while (std::getline(dependencyList, dependency, ',')) {
+      shard.m_dependencies.emplace_back(std::strtoul(dependency.c_str(), nullptr, 10));
+    }
+    shards.emplace_back(std::move(shard));
+  }
+  if (shards.empty()) return {};
+
+  // Shard 0 always, the named shards and the shards they refer to.
+  std::vector<bool> selected(shards.size(), false);
+  std::vector<uint32_t> pending;
+  selected[0] = true;
+  for (uint32_t id = 1, n = shards.size(); id < n; ++id) {
+    if (std::find(names.begin(), names.end(), shards[id].m_name) != names.end()) {
+      pending.emplace_back(id);
+    }
+  }
+  while (!pending.empty()) {
+    const uint32_t id = pending.back();
+    pending.pop_back();
+    if (selected[id]) continue;
+    selected[id] = true;
+    for (uint32_t dependency : shards[id].m_dependencies) {
+      if (dependency < shards.size()) pending.emplace_back(dependency);
+    }
+  }
+
+  std::unique_ptr<RestoreContext> context = RestoreContext::Open((directory / shards[0].m_file).string(), m_threadCount);
+  if (context == nullptr) return {};
+  context->m_shards.resize(shards.size(), nullptr);
+  context->m_shards[0] = context.get();
+  for (uint32_t id = 1, n = shards.size(); id < n; ++id) {
+    if (!selected[id]) continue;
+    std::unique_ptr<RestoreContext> shard = RestoreContext::Open((directory / shards[id].m_file).string(), m_threadCount);
+    if (shard == nullptr) return {};
+    context->m_shards[id] = shard.get();
+    context->m_shardFiles.emplace_back(std::move(shard));
+  }
+  return Restore(context.release());
+}
+
+const std::vector<vpiHandle> Serializer::Restore(RestoreContext* const context) {
+  ReleaseRestoreContext();
+  m_restoreContext = context;
+
   std::vector<vpiHandle> designs;
-  const std::string file = filepath;
-  int32_t fileid = open(file.c_str(), O_RDONLY | O_BINARY);
-  ::capnp::ReaderOptions options;
-  options.traversalLimitInWords = ULLONG_MAX;
-  options.nestingLimit = 1024;
-  ::capnp::PackedFdMessageReader message(fileid, options);
-  UhdmRoot::Reader cap_root = message.getRoot<UhdmRoot>();
+  UhdmRoot::Reader cap_root = context->m_reader->getRoot<UhdmRoot>();
   m_version = cap_root.getVersion();
-  if (m_version != kVersion) return designs;
+  // A delta can't be restored without its base, see RestoreDelta().
+  bool compatible = RestoreContext::IsReadable(cap_root) && !context->m_delta;
+  for (const std::unique_ptr<RestoreContext>& shard : context->m_shardFiles) {
+    compatible = compatible && !shard->m_delta && RestoreContext::IsReadable(shard->m_reader->getRoot<UhdmRoot>());
+  }
+  if (!compatible) {
+    ReleaseRestoreContext();
+    return designs;
+  }
 
-  const ::capnp::List<::capnp::Text>::Reader& symbols = cap_root.getSymbols();
-  for (const auto& symbol : symbols) {
-    symbolMaker.Make(symbol.cStr());
+  if (!context->LoadSymbols(cap_root, &symbolMaker)) {
+    ReleaseRestoreContext();
+    return designs;
   }
 
+  const bool lazy = context->m_shards.empty() && context->m_shardFiles.empty();
+  if (m_enableLazyRestore && !lazy) {
+    m_errorHandler(ErrorType::UHDM_UNSUPPORTED_LAZY_RESTORE,
+                   "Shards and streamed files are restored eagerly", nullptr, nullptr);
+  }
+  if (m_enableLazyRestore && lazy) {
+    // Only the designs are read now, everything else on first use.
+    context->m_lazy = true;
+    ++BaseClass::lazyRestores_;
+    context->m_root = cap_root;
+<CAPNP_INIT_LAZY_FACTORIES>
+    m_objId = cap_root.getObjectId();
+
+    for (uint32_t index = 0, n = cap_root.getFactoryDesign().size(); index < n; ++index) {
+      BaseClass* const d = GetObject(static_cast<uint32_t>(UHDM_OBJECT_TYPE::uhdmdesign), index);
+      MaterializeObject(d);
+      designs.push_back(uhdm_handleMaker.Make(UHDM_OBJECT_TYPE::uhdmdesign, d));
+    }
+    return designs;
+  }
+
+  // The objects of every file are appended to the factories, shard 0 first.
+  std::vector<RestoreContext*> shards(1, context);
+  for (const std::unique_ptr<RestoreContext>& shard : context->m_shardFiles) {
+    shards.emplace_back(shard.get());
+  }
+  for (RestoreContext* const shard : shards) {
+    const UhdmRoot::Reader shard_root = shard->m_reader->getRoot<UhdmRoot>();
 <CAPNP_INIT_FACTORIES>
+  }
   // This assignment should happen only after the necessary objects are created.
   m_objId = cap_root.getObjectId();
 
+  // The symbol table is complete at this point, so setting names from the
+  // restore threads only looks symbols up and never inserts.
+  const ThreadPool pool(m_threadCount);
+  std::array<std::mutex, 64> vectLocks;
   RestoreAdapter adapter;
+  if (pool.GetThreadCount() > 1) adapter.m_vectLocks = &vectLocks;
+
+  std::vector<ThreadPool::task_t> tasks;
+  for (const RestoreContext* const shard : shards) {
+    const UhdmRoot::Reader shard_root = shard->m_reader->getRoot<UhdmRoot>();
 <CAPNP_RESTORE_FACTORIES>
+  }
+  pool.Run(tasks);
 
    for (auto d : designMaker.objects_) {
     vpiHandle designH = uhdm_handleMaker.Make(UHDM_OBJECT_TYPE::uhdmdesign, d);
     designs.push_back(designH);
   }
 
-  close(fileid);
+  ReleaseRestoreContext();
+  return designs;
+}
+
+const std::vector<vpiHandle> Serializer::RestoreDelta(const std::filesystem::path& basepath,
+                                                      const std::filesystem::path& deltapath) {
+  Purge();
+  std::unique_ptr<RestoreContext> context = RestoreContext::Open(basepath.string(), m_threadCount);
+  const std::unique_ptr<RestoreContext> delta = RestoreContext::Open(deltapath.string(), m_threadCount);
+  if ((context == nullptr) || context->m_delta || !context->m_shardFiles.empty() ||
+      (delta == nullptr) || !delta->m_delta) {
+    return {};
+  }
+
+  const UhdmRoot::Reader base_root = context->m_reader->getRoot<UhdmRoot>();
+  const UhdmRoot::Reader delta_root = delta->m_reader->getRoot<UhdmRoot>();
+  // Deltas are written against any readable base, with the current version.
+  if (!RestoreContext::IsReadable(base_root) || (delta_root.getVersion() != kVersion) ||
+      (delta_root.getDeltaBaseObjectId() != base_root.getObjectId()) ||
+      (delta_root.getDeltaBaseSymbolCount() != RestoreContext::SymbolCount(base_root))) {
+    return {};
+  }
+  if (m_enableLazyRestore) {
+    m_errorHandler(ErrorType::UHDM_UNSUPPORTED_LAZY_RESTORE,
+                   "Deltas are restored eagerly", nullptr, nullptr);
+  }
+  m_version = kVersion;
+  ReleaseRestoreContext();
+  m_restoreContext = context.release();
+
+  // The symbols of the delta are the ones the base doesn't have, numbered
+  // after them.
+  if (!m_restoreContext->LoadSymbols(base_root, &symbolMaker)) {
+    ReleaseRestoreContext();
+    return {};
+  }
+  for (const auto& symbol : delta_root.getSymbols()) {
+    symbolMaker.Make(symbol.cStr());
+  }
+
+  const ThreadPool pool(m_threadCount);
+  std::array<std::mutex, 64> vectLocks;
+  RestoreAdapter adapter;
+  if (pool.GetThreadCount() > 1) adapter.m_vectLocks = &vectLocks;
+
+  DeltaLayout layout(delta_root);
+  std::vector<ThreadPool::task_t> tasks;
+<CAPNP_RESTORE_DELTA>
+  // This assignment should happen only after the necessary objects are created.
+  m_objId = delta_root.getObjectId();
+  pool.Run(tasks);
+  ReleaseRestoreContext();
+
+  for (const std::pair<BaseClass*, uint64_t>& entry : layout.m_uhdmIds) {
+    entry.first->UhdmId(static_cast<uint32_t>(entry.second));
+  }
+  for (const BaseClass* obj : layout.m_erased) Erase(obj);
+  if (!layout.m_erased.empty()) Compact();
+
+  std::vector<vpiHandle> designs;
+  for (auto d : designMaker.objects_) {
+    designs.push_back(uhdm_handleMaker.Make(UHDM_OBJECT_TYPE::uhdmdesign, d));
+  }
   return designs;
 }
 }  // namespace UHDM
@@ -0,0 +1,180 @@
+/*
+ Do not modify, auto-generated by script
+
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// Private to the serializer sources: the message of a file being read, shared
+// by the restore and the delta save which reads its base file, and the
+// layout of streamed files.
+
+#ifndef UHDM_SERIALIZER_RESTORE_H
+#define UHDM_SERIALIZER_RESTORE_H
+#pragma once
+
+#include <uhdm/Serializer.h>
+
+#include <limits.h>
+
+#if defined(_MSC_VER)
+  #include <io.h>
+#else
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <capnp/message.h>
+
+#include "UHDM.capnp.h"
+#include <uhdm/uhdm_types.h>
+
+namespace UHDM {
+// Layout of a file written in Serializer::SaveFormat::kStreamed: the
+// kStreamFileHeader word, one message of raw capnp words per chunk of a
+// factory list, in the order of their objects, then the root message with
+// the designs and symbols, a StreamEntry per message and a StreamFooter.
+// Integers are stored little endian, like the capnp words, see
+// ConvertByteOrder().
+struct StreamEntry final {
+  uint64_t m_offset;  // From the start of the file, word aligned
+  uint64_t m_words;
+};
+
+struct StreamFooter final {
+  uint64_t m_entryCount;
+  char m_magic[8];  // kStreamFileHeader
+};
+
+inline void ConvertByteOrder(StreamEntry* entry) {
+  entry->m_offset = BlockCodec::LittleEndian(entry->m_offset);
+  entry->m_words = BlockCodec::LittleEndian(entry->m_words);
+}
+
+inline void ConvertByteOrder(StreamFooter* footer) {
+  footer->m_entryCount = BlockCodec::LittleEndian(footer->m_entryCount);
+}
+
+struct Serializer::RestoreContext final {
+  ~RestoreContext() {
+    // The readers may still refer to the file content, drop them first.
+    m_shardFiles.clear();
+    m_reader.reset();
+    m_mapping.reset();
+    if (m_fileid >= 0) close(m_fileid);
+  }
+
+  static ::capnp::ReaderOptions GetReaderOptions() {
+    ::capnp::ReaderOptions options;
+    options.traversalLimitInWords = ULLONG_MAX;
+    options.nestingLimit = 1024;
+    return options;
+  }
+
+  // Opens a file in any of the SaveFormat, returns nullptr if it can't be read.
+  static std::unique_ptr<RestoreContext> Open(const std::string& filepath, uint32_t threadCount);
+
+  // Maps the size bytes of the file, or reads them in m_buffer if it can't
+  // be mapped, and returns them.
+  const char* Map(int32_t fileid, size_t size);
+
+  // Loads the symbols of root into symbols, which must be empty. A symbol
+  // pool is used in place when it is mapped, the symbols keep the mapping
+  // then, and copied in one block otherwise. Returns false if it is
+  // malformed.
+  bool LoadSymbols(UhdmRoot::Reader root, SymbolFactory* symbols) const;
+  static uint32_t SymbolCount(UhdmRoot::Reader root);
+
+  // The file was written by a version Restore() reads.
+  static bool IsReadable(UhdmRoot::Reader root) {
+    return (root.getVersion() >= kMinVersion) && (root.getVersion() <= kVersion);
+  }
+
+  void SetOffset(UHDM_OBJECT_TYPE type, uint32_t offset) {
+    const uint32_t slot = static_cast<uint32_t>(type);
+    if (slot >= m_offsets.size()) m_offsets.resize(slot + 1, 0);
+    m_offsets[slot] = offset;
+  }
+
+  uint32_t GetOffset(UHDM_OBJECT_TYPE type) const {
+    const uint32_t slot = static_cast<uint32_t>(type);
+    return (slot < m_offsets.size()) ? m_offsets[slot] : 0;
+  }
+
+  const RestoreContext* GetShard(uint64_t shard) const {
+    return (shard < m_shards.size()) ? m_shards[shard] : nullptr;
+  }
+
+  // The id refers to an object of a shard that isn't restored.
+  bool IsInUnrestoredShard(uint64_t id) const {
+    return !m_shards.empty() && (GetShard(id >> 32) == nullptr);
+  }
+
+  // The objects of the type go to the factory slots from offset on.
+  void InitLazySlots(UHDM_OBJECT_TYPE type, uint32_t offset, uint32_t count) {
+    SetOffset(type, offset);
+    const uint32_t slot = static_cast<uint32_t>(type);
+    if (slot >= m_lazySlots.size()) m_lazySlots.resize(slot + 1);
+    m_lazySlots[slot].resize(count, nullptr);
+  }
+
+  int32_t m_fileid = -1;
+  // Shared with the symbols adopted from it, see LoadSymbols().
+  std::shared_ptr<const void> m_mapping;
+  // File content if it couldn't be mapped, or the decoded compressed message.
+  kj::Array<::capnp::word> m_buffer;
+  std::unique_ptr<::capnp::MessageReader> m_reader;
+
+  // The file was written by SaveDelta().
+  bool m_delta = false;
+
+  // Index in its factory of the first object of each type of this file.
+  std::vector<uint32_t> m_offsets;
+
+  // Sharded restore state, only populated by RestoreShards() in the context
+  // of shard 0. m_shards[shard] is the context of a restored shard, nullptr
+  // for the others; m_shardFiles owns the contexts of the shards but 0.
+  // Files in SaveFormat::kStreamed only use m_shardFiles, for the messages
+  // of their chunks, which hold objects numbered across the whole file.
+  std::vector<const RestoreContext*> m_shards;
+  std::vector<std::unique_ptr<RestoreContext>> m_shardFiles;
+
+  // Lazy restore state, only populated when restoring lazily.
+  // m_lazySlots[type][index] is the object created for the index'th entry
+  // of the factory list of given type, or nullptr if it wasn't reached yet
+  // or was erased since, m_erased then holds (type << 32) | index.
+  // m_entries maps the created objects to their index in their list,
+  // m_pending holds the ones whose content hasn't been read yet and m_unread
+  // the ones read without the objects they refer to, mapped to these, see
+  // Serializer::MaterializeObject(). While an object is read, the objects
+  // it refers to are collected in m_referenced.
+  bool m_lazy = false;
+  UhdmRoot::Reader m_root;
+  std::vector<std::vector<BaseClass*>> m_lazySlots;
+  std::unordered_set<uint64_t> m_erased;
+  std::unordered_map<const BaseClass*, uint32_t> m_entries;
+  std::unordered_set<const BaseClass*> m_pending;
+  std::unordered_map<const BaseClass*, std::vector<const BaseClass*>> m_unread;
+  std::vector<const BaseClass*>* m_referenced = nullptr;
+};
+}  // namespace UHDM
+
+#endif  // UHDM_SERIALIZER_RESTORE_H
@@ -34,14 +34,27 @@
   #include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <set>
 #include <string>
+#include <system_error>
+#include <unordered_map>
 #include <vector>
 
+#include <capnp/any.h>
 #include <capnp/message.h>
 #include <capnp/serialize-packed.h>
+#include <capnp/serialize.h>
 
 #include "UHDM.capnp.h"
+#include "Serializer_restore.h"
+#include <uhdm/ThreadPool.h>
 #include <uhdm/containers.h>
 #include <uhdm/uhdm.h>
 #include <uhdm/uhdm_types.h>
@@ -49,35 +62,611 @@
 #include "uhdm/config.h"
 
 namespace UHDM {
-inline static uint32_t GetId(const BaseClass* p, const Serializer::IdMap &idMap) {
-  auto it = idMap.find(p);
-  return (it == idMap.end()) ? Serializer::kBadIndex : it->second;
+struct Serializer::ShardPlan final {
+  struct Shard final {
+    std::string m_kind;
+    std::string m_name;
+    // Objects of the shard by type, in factory order.
+    std::vector<std::vector<const BaseClass*>> m_objects;
+    // Other shards, but shard 0, the objects of the shard refer to.
+    std::set<uint32_t> m_dependencies;
+
+    const std::vector<const BaseClass*>& Objects(UHDM_OBJECT_TYPE type) const {
+      static const std::vector<const BaseClass*> kEmpty;
+      const uint32_t slot = static_cast<uint32_t>(type);
+      return (slot < m_objects.size()) ? m_objects[slot] : kEmpty;
+    }
+  };
+
+  // Shard of an object and its index among the objects of its type there.
+  struct Location final {
+    uint32_t m_shard = kUnassigned;
+    uint32_t m_index = 0;
+  };
+  static constexpr uint32_t kUnassigned = static_cast<uint32_t>(-1);
+  static constexpr uint32_t kVisiting = kUnassigned - 1;
+
+  // Sizes the locations once, so they can be referred to while assigning.
+  ShardPlan(const Serializer* serializer, const IdMap& objects) : m_serializer(serializer) {
+    for (const auto& entry : objects) {
+      const uint32_t type = static_cast<uint32_t>(entry.first->UhdmType());
+      if (type >= m_locations.size()) m_locations.resize(type + 1);
+      std::vector<Location>& locations = m_locations[type];
+      if (entry.first->UhdmIndex() >= locations.size()) locations.resize(entry.first->UhdmIndex() + 1);
+    }
+    m_shards.emplace_back().m_kind = "design";
+  }
+
+  Location* Find(const BaseClass* p) {
+    if ((p == nullptr) || (p->GetSerializer() != m_serializer)) return nullptr;
+    return &m_locations[static_cast<uint32_t>(p->UhdmType())][p->UhdmIndex()];
+  }
+
+  void AddRoot(const BaseClass* root, std::string_view kind, std::string_view name) {
+    Location* const location = Find(root);
+    if ((location == nullptr) || (location->m_shard != kUnassigned)) return;
+    location->m_shard = static_cast<uint32_t>(m_shards.size());
+    Shard& shard = m_shards.emplace_back();
+    shard.m_kind = kind;
+    shard.m_name = name;
+  }
+
+  // Puts every object in the shard of its nearest root ancestor, or in
+  // shard 0 if it has none, and numbers the objects of each shard.
+  void Assign(const IdMap& objects) {
+    std::vector<Location*> path;
+    for (const auto& entry : objects) {
+      uint32_t shard = 0;
+      path.clear();
+      for (const BaseClass* p = entry.first; p != nullptr; p = p->VpiParent()) {
+        Location* const location = Find(p);
+        if ((location == nullptr) || (location->m_shard == kVisiting)) break;
+        if (location->m_shard != kUnassigned) {
+          shard = location->m_shard;
+          break;
+        }
+        location->m_shard = kVisiting;
+        path.emplace_back(location);
+      }
+      for (Location* location : path) location->m_shard = shard;
+    }
+
+    for (const auto& entry : objects) {
+      Location* const location = Find(entry.first);
+      std::vector<std::vector<const BaseClass*>>& shardObjects = m_shards[location->m_shard].m_objects;
+      const uint32_t type = static_cast<uint32_t>(entry.first->UhdmType());
+      if (type >= shardObjects.size()) shardObjects.resize(type + 1);
+      location->m_index = static_cast<uint32_t>(shardObjects[type].size());
+      shardObjects[type].emplace_back(entry.first);
+    }
+  }
+
+  // Ids carry the shard in their upper half, the one based index of the
+  // object in its shard in their lower half.
+  uint64_t Id(const BaseClass* p) {
+    const Location* const location = Find(p);
+    if ((m_current != 0) && (location->m_shard != 0) && (location->m_shard != m_current)) {
+      m_shards[m_current].m_dependencies.emplace(location->m_shard);
+    }
+    return (static_cast<uint64_t>(location->m_shard) << 32) | (location->m_index + 1);
+  }
+
+  const Serializer* const m_serializer;
+  std::vector<Shard> m_shards;
+  std::vector<std::vector<Location>> m_locations;  // By type and object index
+  uint32_t m_current = 0;  // Shard being saved
+};
+
+struct Serializer::DeltaPlan final {
+  struct Type final {
+    // Base index of the objects by structural key, in factory order.
+    std::unordered_map<uint64_t, std::vector<uint32_t>> m_baseIndex;
+    std::vector<bool> m_matched;  // By base index
+    std::vector<uint32_t> m_index;  // By UhdmIndex, index in the layered list
+    uint32_t m_size = 0;  // Of the layered list
+    // By base index: the key of the object on its own, then including its
+    // parents once m_keyed is set, and its parent.
+    std::vector<uint64_t> m_baseKeys;
+    std::vector<std::pair<uint32_t, uint64_t>> m_baseParents;
+    std::vector<bool> m_keyed;
+  };
+
+  explicit DeltaPlan(const RestoreContext& base) {
+    const UhdmRoot::Reader root = base.m_reader->getRoot<UhdmRoot>();
+    m_valid = base.LoadSymbols(root, &m_baseSymbols);
+    m_baseSymbolCount = m_baseSymbols.Size();
+  }
+
+  static Any::Reader AnyOf(Any::Reader reader) { return reader; }
+  static Any::Builder AnyOf(Any::Builder builder) { return builder; }
+
+  template <typename R>
+  static auto AnyOf(R reader) { return AnyOf(reader.getBase()); }
+
+  // Symbol of vpiName, in the struct of the class that has one.
+  template <typename R>
+  static auto NameId(R reader, int) -> decltype(static_cast<uint64_t>(reader.getVpiName())) {
+    return reader.getVpiName();
+  }
+
+  template <typename R>
+  static uint64_t NameId(R reader, long) { return NameId(reader.getBase(), 0); }
+
+  static uint64_t NameId(Any::Reader, long) { return BadRawSymbolId; }
+
+  static uint64_t Combine(uint64_t seed, uint64_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+  }
+
+  // Objects are paired with their base version by their type, name and
+  // location, and the ones of their parents up to the design, the way full
+  // names are, so the UhdmIds an edit renumbers don't break the pairing.
+  // A collision only costs a larger delta, the content of paired objects is
+  // still compared.
+  static uint64_t LocalKey(uint32_t type, std::string_view name, std::string_view file, uint32_t line,
+                           uint32_t column, uint32_t endLine, uint32_t endColumn) {
+    uint64_t key = Combine(type, std::hash<std::string_view>()(name));
+    key = Combine(key, std::hash<std::string_view>()(file));
+    key = Combine(key, (uint64_t(line) << 32) | column);
+    return Combine(key, (uint64_t(endLine) << 32) | endColumn);
+  }
+
+  Type& At(UHDM_OBJECT_TYPE type) {
+    const uint32_t slot = static_cast<uint32_t>(type);
+    if (slot >= m_types.size()) m_types.resize(slot + 1);
+    return m_types[slot];
+  }
+
+  template <typename U>
+  void AddBase(UHDM_OBJECT_TYPE type, typename ::capnp::List<U>::Reader objects) {
+    Type& entry = At(type);
+    entry.m_size = objects.size();
+    entry.m_matched.resize(objects.size(), false);
+    entry.m_keyed.resize(objects.size(), false);
+    for (uint32_t index = 0, n = objects.size(); index < n; ++index) {
+      const Any::Reader object = AnyOf(objects[index]);
+      entry.m_baseKeys.emplace_back(LocalKey(
+          static_cast<uint32_t>(type), BaseSymbol(NameId(objects[index], 0)), BaseSymbol(object.getVpiFile()),
+          object.getVpiLineNo(), object.getVpiColumnNo(), object.getVpiEndLineNo(), object.getVpiEndColumnNo()));
+      entry.m_baseParents.emplace_back(object.getVpiParent().getType(), object.getVpiParent().getIndex());
+    }
+  }
+
+  std::string_view BaseSymbol(uint64_t id) const {
+    return m_baseSymbols.GetSymbol(SymbolId(static_cast<RawSymbolId>(id), BadRawSymbol));
+  }
+
+  uint64_t BaseKey(uint32_t type, uint64_t id) {
+    if ((type >= m_types.size()) || (id == 0) || (id > m_types[type].m_baseKeys.size()) ||
+        (static_cast<UHDM_OBJECT_TYPE>(type) == UHDM_OBJECT_TYPE::uhdmdesign)) {
+      return 0;
+    }
+    Type& entry = m_types[type];
+    const uint32_t index = static_cast<uint32_t>(id - 1);
+    if (!entry.m_keyed[index]) {
+      entry.m_keyed[index] = true;  // Before the parents, in case of a cycle
+      const std::pair<uint32_t, uint64_t> parent = entry.m_baseParents[index];
+      entry.m_baseKeys[index] = Combine(entry.m_baseKeys[index], BaseKey(parent.first, parent.second));
+    }
+    return entry.m_baseKeys[index];
+  }
+
+  uint64_t Key(const BaseClass* object) {
+    if ((object == nullptr) || (object->UhdmType() == UHDM_OBJECT_TYPE::uhdmdesign)) return 0;
+    auto it = m_keys.find(object);
+    if (it != m_keys.end()) return it->second;
+
+    const uint64_t key = LocalKey(static_cast<uint32_t>(object->UhdmType()), object->VpiName(), object->VpiFile(),
+                                  object->VpiLineNo(), object->VpiColumnNo(), object->VpiEndLineNo(),
+                                  object->VpiEndColumnNo());
+    m_keys.emplace(object, key);  // Before the parents, in case of a cycle
+    const BaseClass* const parent = object->VpiParent();
+    return m_keys[object] = Combine(key, ((parent != nullptr) && (parent->GetSerializer() == object->GetSerializer())) ? Key(parent) : 0);
+  }
+
+  // Objects keep the index of their base version in the layered lists, the
+  // others are appended.
+  void Assign(const IdMap& objects) {
+    for (uint32_t slot = 0, n = m_types.size(); slot < n; ++slot) {
+      Type& type = m_types[slot];
+      for (uint32_t index = 0, m = type.m_baseKeys.size(); index < m; ++index) {
+        type.m_baseIndex[BaseKey(slot, index + 1)].emplace_back(index);
+      }
+      for (auto& entry : type.m_baseIndex) std::reverse(entry.second.begin(), entry.second.end());
+    }
+
+    for (const auto& entry : objects) {
+      const uint64_t key = Key(entry.first);
+      Type& type = At(entry.first->UhdmType());
+      uint32_t index = type.m_size;
+      auto it = type.m_baseIndex.find(key);
+      if ((it != type.m_baseIndex.end()) && !it->second.empty()) {
+        index = it->second.back();
+        it->second.pop_back();
+        type.m_matched[index] = true;
+      } else {
+        ++type.m_size;
+      }
+      if (entry.first->UhdmIndex() >= type.m_index.size()) type.m_index.resize(entry.first->UhdmIndex() + 1);
+      type.m_index[entry.first->UhdmIndex()] = index;
+    }
+  }
+
+  uint32_t Index(const BaseClass* p) const {
+    return m_types[static_cast<uint32_t>(p->UhdmType())].m_index[p->UhdmIndex()];
+  }
+
+  // Symbols of the base keep their id, the others are numbered after them.
+  RawSymbolId Symbol(const SymbolFactory& symbols, RawSymbolId id) {
+    if (id >= m_symbols.size()) m_symbols.resize(id + 1, BadRawSymbolId);
+    RawSymbolId& mapped = m_symbols[id];
+    if ((mapped == BadRawSymbolId) && (id != BadRawSymbolId)) {
+      const std::string_view symbol = symbols.RawSymbol(id);
+      const SymbolId base = m_baseSymbols.GetId(symbol);
+      if (base) {
+        mapped = static_cast<RawSymbolId>(base);
+      } else {
+        mapped = m_baseSymbolCount + static_cast<RawSymbolId>(m_newSymbols.size());
+        m_newSymbols.emplace_back(symbol);
+      }
+    }
+    return mapped;
+  }
+
+  void Save(UhdmRoot::Builder cap_root) const {
+    ::capnp::List<::ObjIndexType>::Builder objects = cap_root.initDeltaObjects(m_objects.size());
+    for (uint32_t index = 0, n = m_objects.size(); index < n; ++index) {
+      objects[index].setType(m_objects[index].first);
+      objects[index].setIndex(m_objects[index].second);
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> removed;
+    for (uint32_t type = 0, n = m_types.size(); type < n; ++type) {
+      const std::vector<bool>& matched = m_types[type].m_matched;
+      for (uint32_t index = 0, m = matched.size(); index < m; ++index) {
+        if (!matched[index]) removed.emplace_back(type, index);
+      }
+    }
+    ::capnp::List<::ObjIndexType>::Builder removedObjects = cap_root.initDeltaRemoved(removed.size());
+    for (uint32_t index = 0, n = removed.size(); index < n; ++index) {
+      removedObjects[index].setType(removed[index].first);
+      removedObjects[index].setIndex(removed[index].second);
+    }
+
+    ::capnp::List<::ObjIndexType>::Builder renumbered = cap_root.initDeltaRenumbered(m_renumbered.size());
+    ::capnp::List<uint64_t>::Builder ids = cap_root.initDeltaRenumberedIds(m_renumbered.size());
+    for (uint32_t index = 0, n = m_renumbered.size(); index < n; ++index) {
+      renumbered[index].setType(m_renumbered[index].first.first);
+      renumbered[index].setIndex(m_renumbered[index].first.second);
+      ids.set(index, m_renumbered[index].second);
+    }
+
+    ::capnp::List<::capnp::Text>::Builder symbols = cap_root.initSymbols(m_newSymbols.size());
+    for (uint32_t index = 0, n = m_newSymbols.size(); index < n; ++index) {
+      symbols.set(index, ::capnp::Text::Reader(m_newSymbols[index].data(), m_newSymbols[index].size()));
+    }
+  }
+
+  bool m_valid = false;
+  RawSymbolId m_baseSymbolCount = 0;
+  SymbolFactory m_baseSymbols;
+  std::vector<RawSymbolId> m_symbols;  // By id in the serializer
+  std::vector<std::string_view> m_newSymbols;
+  std::vector<Type> m_types;
+  // Type and layered index of the objects saved, in the order of the lists.
+  std::vector<std::pair<uint32_t, uint32_t>> m_objects;
+  // Type and layered index of the unchanged objects with another UhdmId
+  // than in the base, and that id.
+  std::vector<std::pair<std::pair<uint32_t, uint32_t>, uint64_t>> m_renumbered;
+  std::unordered_map<const BaseClass*, uint64_t> m_keys;  // See Key()
+};
+
+static bool WriteAll(int32_t fileid, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    const auto written = write(fileid, bytes, static_cast<uint32_t>(std::min<size_t>(size, 1 << 30)));
+    if (written <= 0) return false;
+    bytes += written;
+    size -= written;
+  }
+  return true;
 }
 
 struct Serializer::SaveAdapter {
-  void operator()(const BaseClass *const obj, Serializer *const serializer, const IdMap& idMap, Any::Builder builder) const {
+  // Writes the messages of a SaveFormat::kStreamed save, see StreamEntry.
+  // Chunks are built as many at a time as there are threads, then written
+  // in order and freed.
+  struct Stream final {
+    struct Chunk final {
+      std::unique_ptr<::capnp::MallocMessageBuilder> m_message;
+      ThreadPool::task_t m_fill;
+    };
+
+    Stream(int32_t fileid, uint32_t threadCount) : m_fileid(fileid), m_pool(threadCount) {}
+
+    void Add(std::unique_ptr<::capnp::MallocMessageBuilder> message, ThreadPool::task_t fill) {
+      m_chunks.emplace_back(Chunk{std::move(message), std::move(fill)});
+      if (m_chunks.size() >= m_pool.GetThreadCount()) Flush();
+    }
+
+    void Flush() {
+      std::vector<ThreadPool::task_t> tasks;
+      tasks.reserve(m_chunks.size());
+      for (const Chunk& chunk : m_chunks) tasks.emplace_back(chunk.m_fill);
+      m_pool.Run(tasks);
+      for (const Chunk& chunk : m_chunks) Write(*chunk.m_message);
+      m_chunks.clear();
+    }
+
+    void Write(::capnp::MessageBuilder& message) {
+      const size_t words = ::capnp::computeSerializedSizeInWords(message);
+      m_entries.emplace_back(StreamEntry{m_offset, words});
+      writeMessageToFd(m_fileid, message);
+      m_offset += words * sizeof(::capnp::word);
+    }
+
+    // Writes the entries and the footer, after the root message.
+    bool Finish() {
+      StreamFooter footer = {};
+      footer.m_entryCount = m_entries.size();
+      std::memcpy(footer.m_magic, kStreamFileHeader.data(), sizeof(footer.m_magic));
+      ConvertByteOrder(&footer);
+      for (StreamEntry& entry : m_entries) ConvertByteOrder(&entry);
+      return WriteAll(m_fileid, m_entries.data(), m_entries.size() * sizeof(StreamEntry)) &&
+             WriteAll(m_fileid, &footer, sizeof(footer));
+    }
+
+    const int32_t m_fileid;
+    const ThreadPool m_pool;
+    uint64_t m_offset = kStreamFileHeader.size();
+    std::vector<Chunk> m_chunks;
+    std::vector<StreamEntry> m_entries;
+  };
+
+  // Objects know their index in their factory, ids are one based.
+  static uint64_t GetId(const BaseClass* p, const Serializer* serializer) {
+    if (p->GetSerializer() != serializer) return kBadIndex;
+    if (serializer->m_shardPlan != nullptr) return serializer->m_shardPlan->Id(p);
+    if (serializer->m_deltaPlan != nullptr) return serializer->m_deltaPlan->Index(p) + 1;
+    return p->UhdmIndex() + 1;
+  }
+
+  // Saving in parallel only looks symbols up, the objects only hold symbols
+  // that exist.
+  RawSymbolId SaveSymbol(Serializer *const serializer, std::string_view symbol) const {
+    const RawSymbolId id = (RawSymbolId)(m_lookupSymbols ? serializer->symbolMaker.GetId(symbol)
+                                                         : serializer->symbolMaker.Make(symbol));
+    return (serializer->m_deltaPlan != nullptr) ? serializer->m_deltaPlan->Symbol(serializer->symbolMaker, id) : id;
+  }
+
+  RawSymbolId SaveSymbolId(Serializer *const serializer, SymbolId symbol) const {
+    const RawSymbolId id = (RawSymbolId)symbol;
+    return (serializer->m_deltaPlan != nullptr) ? serializer->m_deltaPlan->Symbol(serializer->symbolMaker, id) : id;
+  }
+
+  void operator()(const BaseClass *const obj, Serializer *const serializer, Any::Builder builder) const {
     if (obj->VpiParent() != nullptr) {
       ::ObjIndexType::Builder vpiParentBuilder = builder.getVpiParent();
-      vpiParentBuilder.setIndex(GetId(obj->VpiParent(), idMap));
+      vpiParentBuilder.setIndex(GetId(obj->VpiParent(), serializer));
       vpiParentBuilder.setType(static_cast<uint32_t>(obj->VpiParent()->UhdmType()));
     }
-    builder.setVpiFile((RawSymbolId)obj->GetSerializer()->symbolMaker.Make(obj->VpiFile()));
+    builder.setVpiFile(SaveSymbol(serializer, obj->VpiFile()));
+#if UHDM_COMPACT_LAYOUT
+    const ObjectLocation location = obj->GetLocation();
+    builder.setVpiLineNo(location.m_line);
+    builder.setVpiColumnNo(location.m_column);
+    builder.setVpiEndLineNo(location.m_endLine);
+    builder.setVpiEndColumnNo(location.m_endColumn);
+#else
     builder.setVpiLineNo(obj->VpiLineNo());
     builder.setVpiColumnNo(obj->VpiColumnNo());
     builder.setVpiEndLineNo(obj->VpiEndLineNo());
     builder.setVpiEndColumnNo(obj->VpiEndColumnNo());
+#endif
     builder.setUhdmId(obj->UhdmId());
   }
 
+  // Allocates the structs and lists the object holds, as the matching
+  // operator() does, without filling them.
+  void Allocate(const BaseClass *const obj, Any::Builder builder) const {
+    if (obj->VpiParent() != nullptr) builder.getVpiParent();
+  }
+
 <CAPNP_SAVE_ADAPTERS>
 
   template<typename T, typename U, typename = typename std::enable_if<std::is_base_of<BaseClass, T>::value>::type>
-  void operator()(const FactoryT<T>& factory, Serializer* serializer, const Serializer::IdMap& idMap,
+  void operator()(const FactoryT<T>& factory, Serializer* serializer,
                   typename ::capnp::List<U>::Builder builder) const {
     uint32_t index = 0;
     for (const T* obj : factory.objects_)
-      operator()(obj, serializer, idMap, builder[index++]);
+      operator()(obj, serializer, builder[index++]);
+  }
+
+  template<typename T, typename U, typename = typename std::enable_if<std::is_base_of<BaseClass, T>::value>::type>
+  void operator()(const std::vector<const BaseClass*>& objects, Serializer* serializer,
+                  typename ::capnp::List<U>::Builder builder) const {
+    uint32_t index = 0;
+    for (const BaseClass* obj : objects)
+      operator()(static_cast<const T*>(obj), serializer, builder[index++]);
+  }
+
+  // Saves the objects of the factory that aren't in the base list or differ
+  // from their base version in the delta, see SaveDelta(). Objects are built
+  // in a scratch message first to compare them.
+  template<typename T, typename U, typename InitList,
+           typename = typename std::enable_if<std::is_base_of<BaseClass, T>::value>::type>
+  void operator()(const FactoryT<T>& factory, Serializer* serializer, typename ::capnp::List<U>::Reader base,
+                  UhdmRoot::Builder delta, InitList initList) const {
+    if (factory.objects_.empty()) return;
+
+    ::capnp::MallocMessageBuilder scratch;
+    typename ::capnp::List<U>::Builder objects = initList(scratch.initRoot<UhdmRoot>(), factory.objects_.size());
+    this->template operator()<T, U>(factory, serializer, objects);
+
+    DeltaPlan* const plan = serializer->m_deltaPlan;
+    std::vector<uint32_t> changed;
+    for (uint32_t index = 0, n = objects.size(); index < n; ++index) {
+      const uint32_t target = plan->Index(factory.objects_[index]);
+      if (target >= base.size()) {
+        changed.emplace_back(index);
+        continue;
+      }
+      // Compared without their UhdmId, unchanged objects only record it
+      // when it differs.
+      Any::Builder object = DeltaPlan::AnyOf(objects[index]);
+      const uint64_t id = object.getUhdmId();
+      const uint64_t baseId = DeltaPlan::AnyOf(base[target]).getUhdmId();
+      object.setUhdmId(baseId);
+      const bool same = (::capnp::AnyStruct::Reader(objects[index].asReader()) == ::capnp::AnyStruct::Reader(base[target]));
+      object.setUhdmId(id);
+      if (!same) {
+        changed.emplace_back(index);
+      } else if (id != baseId) {
+        plan->m_renumbered.emplace_back(std::make_pair(static_cast<uint32_t>(factory.objects_[index]->UhdmType()), target), id);
+      }
+    }
+    if (changed.empty()) return;
+
+    typename ::capnp::List<U>::Builder list = initList(delta, changed.size());
+    for (uint32_t index = 0, n = changed.size(); index < n; ++index) {
+      const T* const obj = factory.objects_[changed[index]];
+      list.setWithCaveats(index, objects[changed[index]].asReader());
+      plan->m_objects.emplace_back(static_cast<uint32_t>(obj->UhdmType()), plan->Index(obj));
+    }
+  }
+
+  // Allocates what the objects of the factory hold in the list on the
+  // calling thread, in object order, and queues filling them in chunks of
+  // kChunkSize objects. Filling doesn't allocate in the message, so chunks
+  // can run concurrently.
+  template<typename T, typename U, typename = typename std::enable_if<std::is_base_of<BaseClass, T>::value>::type>
+  void operator()(const FactoryT<T>& factory, Serializer* serializer, typename ::capnp::List<U>::Builder builder,
+                  std::vector<ThreadPool::task_t>* tasks) const {
+    for (uint32_t index = 0, n = factory.objects_.size(); index < n; ++index)
+      Allocate(factory.objects_[index], builder[index]);
+    for (uint32_t begin = 0, n = factory.objects_.size(); begin < n; begin += kChunkSize) {
+      const uint32_t end = std::min(n, begin + kChunkSize);
+      tasks->emplace_back([this, &factory, serializer, builder, begin, end]() {
+        typename ::capnp::List<U>::Builder objects = builder;
+        for (uint32_t index = begin; index < end; ++index)
+          operator()(factory.objects_[index], serializer, objects[index]);
+      });
+    }
+  }
+
+  template<typename T, typename U, typename InitList,
+           typename = typename std::enable_if<std::is_base_of<BaseClass, T>::value>::type>
+  void operator()(const FactoryT<T>& factory, Serializer* serializer, Stream* stream, InitList initList) const {
+    for (uint32_t begin = 0, n = factory.objects_.size(); begin < n; begin += kStreamChunkSize) {
+      const uint32_t count = std::min(n - begin, kStreamChunkSize);
+      const size_t words = 1 + count * (U::_capnpPrivate::dataWordSize + U::_capnpPrivate::pointerCount);
+      std::unique_ptr<::capnp::MallocMessageBuilder> message =
+          std::make_unique<::capnp::MallocMessageBuilder>(static_cast<uint32_t>(words));
+      ::capnp::MallocMessageBuilder* const builder = message.get();
+      stream->Add(std::move(message), [this, &factory, serializer, builder, initList, begin, count]() {
+        UhdmRoot::Builder root = builder->initRoot<UhdmRoot>();
+        root.setVersion(kVersion);
+        typename ::capnp::List<U>::Builder objects = initList(root, count);
+        for (uint32_t index = 0; index < count; ++index)
+          operator()(factory.objects_[begin + index], serializer, objects[index]);
+      });
+    }
+  }
+
+  // Writes the flat message as independently compressed blocks, see
+  // BlockCodec::FileHeader. Blocks are compressed concurrently.
+  static void WriteCompressedMessage(int32_t fileid, ::capnp::MessageBuilder& message,
+                                     BlockCodec::Codec codec, uint32_t threadCount) {
+    const kj::Array<::capnp::word> words = ::capnp::messageToFlatArray(message);
+    const char* const content = reinterpret_cast<const char*>(words.begin());
+    const size_t size = words.size() * sizeof(::capnp::word);
+
+    const size_t blockCount = (size + BlockCodec::kBlockSize - 1) / BlockCodec::kBlockSize;
+    std::vector<std::vector<char>> blocks(blockCount);
+    std::vector<ThreadPool::task_t> tasks;
+    tasks.reserve(blockCount);
+    for (size_t i = 0; i < blockCount; ++i) {
+      tasks.emplace_back([&blocks, content, size, codec, i]() {
+        const size_t offset = i * BlockCodec::kBlockSize;
+        BlockCodec::Compress(codec, content + offset, std::min(BlockCodec::kBlockSize, size - offset), &blocks[i]);
+      });
+    }
+    ThreadPool(threadCount).Run(tasks);
+
+    BlockCodec::FileHeader header = {};
+    std::memcpy(header.m_magic, kCompressedFileHeader.data(), sizeof(header.m_magic));
+    header.m_codec = static_cast<uint32_t>(codec);
+    header.m_blockCount = static_cast<uint32_t>(blockCount);
+    header.m_rawSize = size;
+
+    std::vector<BlockCodec::BlockEntry> entries(blockCount);
+    uint64_t offset = sizeof(header) + blockCount * sizeof(BlockCodec::BlockEntry);
+    for (size_t i = 0; i < blockCount; ++i) {
+      entries[i].m_offset = offset;
+      entries[i].m_size = static_cast<uint32_t>(blocks[i].size());
+      entries[i].m_rawSize = static_cast<uint32_t>(std::min(BlockCodec::kBlockSize, size - i * BlockCodec::kBlockSize));
+      offset += blocks[i].size();
+      BlockCodec::ConvertByteOrder(&entries[i]);
+    }
+    BlockCodec::ConvertByteOrder(&header);
+
+    if (!WriteAll(fileid, &header, sizeof(header))) return;
+    if (!WriteAll(fileid, entries.data(), entries.size() * sizeof(BlockCodec::BlockEntry))) return;
+    for (const std::vector<char>& block : blocks) {
+      if (!WriteAll(fileid, block.data(), block.size())) return;
+    }
+  }
+
+  // Writes the message to filepath in the format set by SetSaveFormat().
+  static void WriteMessage(const Serializer* serializer, const std::string& filepath, ::capnp::MessageBuilder& message) {
+    const int32_t fileid = open(filepath.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, S_IRWXU);
+    if (fileid < 0) return;
+
+    if ((serializer->m_saveFormat == SaveFormat::kFlat) || (serializer->m_saveFormat == SaveFormat::kStreamed)) {
+      // The header is exactly one word long, so the message that follows stays
+      // word aligned in a mapping of the file. A message built whole has
+      // nothing left to stream.
+      if (WriteAll(fileid, kFlatFileHeader.data(), kFlatFileHeader.size())) {
+        writeMessageToFd(fileid, message);
+      }
+    } else if (serializer->m_saveFormat == SaveFormat::kCompressed) {
+      WriteCompressedMessage(fileid, message, serializer->m_compressionCodec, serializer->m_threadCount);
+    } else {
+      writePackedMessageToFd(fileid, message);
+    }
+    close(fileid);
+  }
+
+  void SaveDesigns(Serializer* serializer, UhdmRoot::Builder cap_root) const {
+    ::capnp::List<Design>::Builder designs = cap_root.initDesigns(serializer->designMaker.objects_.size());
+    uint32_t index = 0;
+    for (auto design : serializer->designMaker.objects_) {
+      designs[index].setVpiName(SaveSymbol(serializer, design->VpiName()));
+      index++;
+    }
+  }
+
+  // Save the symbols after all save function have been invoked.
+  // Ideally, the save should not include the hierarchical nets that can be recreated on the fly.
+  // Something broke this mechanism that saved a lot of memory/disk space.
+  // Until that is repaired we go for the more disk-hungry and memory hungry method which gives correct results.
+  //
+  // Symbols are saved as a pool Restore() uses in place, see SymbolFactory::WritePool().
+  void SaveSymbols(Serializer* serializer, UhdmRoot::Builder cap_root) const {
+    const SymbolFactory& symbols = serializer->symbolMaker;
+    ::capnp::Data::Builder pool = cap_root.initSymbolPool(static_cast<uint32_t>(symbols.PoolSize()));
+    symbols.WritePool(reinterpret_cast<char*>(pool.begin()));
   }
+
+  // Rough size of an object with its bases and relations, to size the first
+  // segment of the message.
+  static constexpr size_t kWordsPerObject = 8;
+  static constexpr size_t kMaxSegmentWords = 1 << 28;
+  // Objects per task of a save on several threads.
+  static constexpr uint32_t kChunkSize = 4096;
+  // Objects per message of a SaveFormat::kStreamed save.
+  static constexpr uint32_t kStreamChunkSize = 1 << 16;
+  bool m_lookupSymbols = false;
 };
 
 void Serializer::Save(const std::filesystem::path& filepath) {
@@ -85,41 +674,178 @@ void Serializer::Save(const std::filesystem::path& filepath) {
 }
 
 void Serializer::Save(const std::string& filepath) {
+  assert(m_symbolLayers.empty());
+  MaterializeAll();
   if (m_enableGC) GarbageCollect();
+  Compact();
+  if (m_enableSymbolGC) CompactSymbols();
+  if (m_saveFormat == SaveFormat::kStreamed) {
+    SaveStreamed(filepath);
+    return;
+  }
+
+  uint32_t objectCount = 0;
+  for (const auto& entry : ObjectStats()) objectCount += entry.second;
+  const size_t words = objectCount * SaveAdapter::kWordsPerObject + 1 + symbolMaker.PoolSize() / sizeof(::capnp::word);
+
+  ::capnp::MallocMessageBuilder message(static_cast<uint32_t>(std::min<size_t>(words, SaveAdapter::kMaxSegmentWords)));
+  UhdmRoot::Builder cap_root = message.initRoot<UhdmRoot>();
+  cap_root.setVersion(kVersion);
+  cap_root.setObjectId(m_objId);
+
+  const ThreadPool pool(m_threadCount);
+  SaveAdapter adapter;
+  adapter.m_lookupSymbols = (pool.GetThreadCount() > 1);
+  adapter.SaveDesigns(this, cap_root);
+
+  if (pool.GetThreadCount() > 1) {
+    // The lists are allocated and sized here, on this thread, so the layout
+    // of the message doesn't depend on the threads, which fill disjoint
+    // slices of them.
+    std::vector<ThreadPool::task_t> tasks;
+<CAPNP_SAVE_LAYOUT>
+    pool.Run(tasks);
+  } else {
+<CAPNP_SAVE>
+  }
 
-  uint32_t index = 0;
-  const std::string file = filepath;
-  const int32_t fileid = open(file.c_str(), O_CREAT | O_WRONLY | O_BINARY, S_IRWXU);
+  adapter.SaveSymbols(this, cap_root);
+  SaveAdapter::WriteMessage(this, filepath, message);
+}
+
+void Serializer::SaveStreamed(const std::string& filepath) {
+  const int32_t fileid = open(filepath.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, S_IRWXU);
+  if (fileid < 0) return;
+  if (!WriteAll(fileid, kStreamFileHeader.data(), kStreamFileHeader.size())) {
+    close(fileid);
+    return;
+  }
 
+  SaveAdapter adapter;
+  SaveAdapter::Stream stream(fileid, m_threadCount);
+  adapter.m_lookupSymbols = (stream.m_pool.GetThreadCount() > 1);
+<CAPNP_SAVE_STREAM>
+  stream.Flush();
+
+  // The root message goes last, its symbols include the ones made saving
+  // the chunks.
   ::capnp::MallocMessageBuilder message;
   UhdmRoot::Builder cap_root = message.initRoot<UhdmRoot>();
   cap_root.setVersion(kVersion);
   cap_root.setObjectId(m_objId);
+  adapter.SaveDesigns(this, cap_root);
+  adapter.SaveSymbols(this, cap_root);
+  stream.Write(message);
+  stream.Finish();
+  close(fileid);
+}
+
+void Serializer::SaveShards(const std::filesystem::path& directory) {
+  assert(m_symbolLayers.empty());
+  MaterializeAll();
+  if (m_enableGC) GarbageCollect();
+  Compact();
+  if (m_enableSymbolGC) CompactSymbols();
 
-  ::capnp::List<Design>::Builder designs = cap_root.initDesigns(designMaker.objects_.size());
-  index = 0;
-  for (auto design : designMaker.objects_) {
-    designs[index].setVpiName((RawSymbolId)design->GetSerializer()->symbolMaker.Make(design->VpiName()));
-    index++;
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+  if (error) return;
+
+  const IdMap objects = AllObjects();
+  ShardPlan plan(this, objects);
+  for (const design* d : designMaker.objects_) {
+    if (d->TopModules() != nullptr) {
+      // Top module instances are usually named after their definition only.
+      for (const module_inst* m : *d->TopModules()) {
+        plan.AddRoot(m, "module", m->VpiName().empty() ? m->VpiDefName() : m->VpiName());
+      }
+    }
+    if (d->TopPackages() != nullptr) {
+      for (const package* p : *d->TopPackages()) plan.AddRoot(p, "package", p->VpiName());
+    }
+    if (d->AllPackages() != nullptr) {
+      for (const package* p : *d->AllPackages()) plan.AddRoot(p, "package", p->VpiName());
+    }
+    if (d->AllClasses() != nullptr) {
+      for (const class_defn* c : *d->AllClasses()) plan.AddRoot(c, "class", c->VpiName());
+    }
   }
+  plan.Assign(objects);
 
-  const IdMap idMap = AllObjects();
+  m_shardPlan = &plan;
   SaveAdapter adapter;
-  <CAPNP_SAVE>
+  const uint32_t shardCount = static_cast<uint32_t>(plan.m_shards.size());
+  std::vector<std::string> files(shardCount);
+  // Shard 0 goes last, its symbols include the ones made saving the others.
+  for (uint32_t i = 1; i <= shardCount; ++i) {
+    const uint32_t id = i % shardCount;
+    const ShardPlan::Shard& shard = plan.m_shards[id];
+    plan.m_current = id;
 
-  // Save the symbols after all save function have been invoked, some symbols are made doing so (VpiFullName)
-  // This is not ideal.
-  // Ideally, the save should not include the hierarchical nets that can be recreated on the fly.
-  // Something broke this mechanism that saved a lot of memory/disk space.
-  // Until that is repaired we go for the more disk-hungry and memory hungry method which gives correct results.
-  ::capnp::List<::capnp::Text>::Builder symbols = cap_root.initSymbols(symbolMaker.m_id2SymbolMap.size());
-  index = 0;
-  for (const auto& symbol : symbolMaker.m_id2SymbolMap) {
-    symbols.set(index, symbol.c_str());
-    index++;
+    ::capnp::MallocMessageBuilder message;
+    UhdmRoot::Builder cap_root = message.initRoot<UhdmRoot>();
+    cap_root.setVersion(kVersion);
+    cap_root.setObjectId(m_objId);
+    if (id == 0) adapter.SaveDesigns(this, cap_root);
+<CAPNP_SAVE_SHARD>
+    if (id == 0) adapter.SaveSymbols(this, cap_root);
+
+    files[id] = "shard" + std::to_string(id) + ".uhdm";
+    SaveAdapter::WriteMessage(this, (directory / files[id]).string(), message);
   }
+  m_shardPlan = nullptr;
+
+  // One line per shard: id, kind, name, file and the shards it refers to,
+  // separated by tabs.
+  std::ofstream manifest(directory / kShardManifest);
+  for (uint32_t id = 0; id < shardCount; ++id) {
+    const ShardPlan::Shard& shard = plan.m_shards[id];
+    manifest << id << '\t' << shard.m_kind << '\t' << shard.m_name << '\t' << files[id] << '\t';
+    const char* separator = "";
+    for (uint32_t dependency : shard.m_dependencies) {
+      manifest << separator << dependency;
+      separator = ",";
+    }
+    manifest << '\n';
+  }
+}
 
-  writePackedMessageToFd(fileid, message);
+void Serializer::SaveDelta(const std::filesystem::path& basepath, const std::filesystem::path& filepath) {
+  assert(m_symbolLayers.empty());
+  MaterializeAll();
+  if (m_enableGC) GarbageCollect();
+  Compact();
+  if (m_enableSymbolGC) CompactSymbols();
+
+  const std::unique_ptr<RestoreContext> base = RestoreContext::Open(basepath.string(), m_threadCount);
+  if ((base == nullptr) || base->m_delta || !base->m_shardFiles.empty()) return;
+  const UhdmRoot::Reader base_root = base->m_reader->getRoot<UhdmRoot>();
+  if (!RestoreContext::IsReadable(base_root)) return;
+
+  DeltaPlan plan(*base);
+  if (!plan.m_valid) return;
+<CAPNP_DELTA_BASE>
+  plan.Assign(AllObjects());
+
+  m_deltaPlan = &plan;
+  SaveAdapter adapter;
+  ::capnp::MallocMessageBuilder message;
+  UhdmRoot::Builder cap_root = message.initRoot<UhdmRoot>();
+  cap_root.setVersion(kVersion);
+  cap_root.setObjectId(m_objId);
+  cap_root.setDeltaBaseObjectId(base_root.getObjectId());
+  cap_root.setDeltaBaseSymbolCount(plan.m_baseSymbolCount);
+  adapter.SaveDesigns(this, cap_root);
+<CAPNP_SAVE_DELTA>
+  m_deltaPlan = nullptr;
+  plan.Save(cap_root);
+
+  const std::string file = filepath.string();
+  const int32_t fileid = open(file.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, S_IRWXU);
+  if (fileid < 0) return;
+  if (WriteAll(fileid, kDeltaFileHeader.data(), kDeltaFileHeader.size())) {
+    writePackedMessageToFd(fileid, message);
+  }
   close(fileid);
 }
 }  // namespace UHDM
@@ -21,9 +21,13 @@
  * Created on March 6, 2017, 11:10 PM
  */
 
+#include <uhdm/BlockCodec.h>
 #include <uhdm/SymbolFactory.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <new>
 
 namespace UHDM {
 
@@ -31,6 +35,15 @@ SymbolFactory::SymbolFactory() : m_parent(nullptr), m_idOffset(0) {
   registerSymbol(getBadSymbol());
 }
 
+SymbolFactory::~SymbolFactory() { Clear(); }
+
+SymbolFactory::Table::Table(uint64_t size)
+    : m_mask(size - 1), m_slots(new std::atomic<const Entry*>[size]) {
+  for (uint64_t slot = 0; slot < size; ++slot) {
+    m_slots[slot].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
 std::string_view SymbolFactory::getEmptyMacroMarker() {
   static constexpr std::string_view k_emptyMacroMarker("@@EMPTY_MACRO@@");
   return k_emptyMacroMarker;
@@ -46,23 +59,16 @@ std::pair<SymbolId, std::string_view> SymbolFactory::add(
     }
   }
 
-  auto found = m_symbol2IdMap.find(symbol);
-  if (found != m_symbol2IdMap.end()) {
-    // Do NOT use m_id2SymbolMap[found->second] to build the returned pair.
-    // MS cl compiler seems to have some bug that ends up actually creating
-    // the string_view from a clone of the string and thus invalid by the time
-    // the caller of this function receives it. Use the already pinned
-    // string_view from the map instead.
-    return {SymbolId(found->second + m_idOffset, found->first), found->first};
+  const uint64_t hash = Hash(symbol);
+  if (RawSymbolId pooled; FindInPool(symbol, hash, &pooled)) {
+    const std::string_view normalized = RawSymbol(pooled);
+    return {SymbolId(pooled + m_idOffset, normalized), normalized};
   }
-  const std::string& normalized = m_id2SymbolMap.emplace_back(symbol);
-  const auto inserted = m_symbol2IdMap.insert({normalized, m_idCounter});
-  assert(inserted.second);  // This new insert must succeed.
-  m_idCounter++;
-  // Read the comment above about using the string from m_id2SymbolMap
-  // to build the returned pair.
-  return {SymbolId(inserted.first->second + m_idOffset, inserted.first->first),
-          inserted.first->first};
+
+  const Entry* entry = Find(symbol, hash);
+  if (entry == nullptr) entry = Insert(symbol, hash);
+  const std::string_view normalized = entry->Symbol();
+  return {SymbolId(entry->m_id + m_idOffset, normalized), normalized};
 }
 
 std::pair<SymbolId, std::string_view> SymbolFactory::get(
@@ -74,14 +80,136 @@ std::pair<SymbolId, std::string_view> SymbolFactory::get(
     }
   }
 
-  // Read the comment in SymbolFactory::add above about using the
-  // string from m_id2SymbolMap to build the returned pair.
-  auto found = m_symbol2IdMap.find(symbol);
-  return (found == m_symbol2IdMap.end())
-             ? std::make_pair(getBadId(), getBadSymbol())
-             : std::make_pair(
-                   SymbolId(found->second + m_idOffset, found->first),
-                   found->first);
+  const uint64_t hash = Hash(symbol);
+  if (RawSymbolId pooled; FindInPool(symbol, hash, &pooled)) {
+    const std::string_view normalized = RawSymbol(pooled);
+    return {SymbolId(pooled + m_idOffset, normalized), normalized};
+  }
+
+  const Entry* const entry = Find(symbol, hash);
+  if (entry == nullptr) return {getBadId(), getBadSymbol()};
+  const std::string_view normalized = entry->Symbol();
+  return {SymbolId(entry->m_id + m_idOffset, normalized), normalized};
+}
+
+const SymbolFactory::Entry* SymbolFactory::Find(std::string_view symbol,
+                                                uint64_t hash) const {
+  const Shard& shard = m_shards[hash >> (64 - kShardBits)];
+  const Table* const table = shard.m_table.load(std::memory_order_acquire);
+  if (table == nullptr) return nullptr;
+  for (uint64_t slot = hash & table->m_mask;;
+       slot = (slot + 1) & table->m_mask) {
+    const Entry* const entry =
+        table->m_slots[slot].load(std::memory_order_acquire);
+    if ((entry == nullptr) ||
+        ((entry->m_hash == hash) && (entry->Symbol() == symbol))) {
+      return entry;
+    }
+  }
+}
+
+const SymbolFactory::Entry* SymbolFactory::Insert(std::string_view symbol,
+                                                  uint64_t hash) {
+  Shard& shard = m_shards[hash >> (64 - kShardBits)];
+  std::lock_guard<std::mutex> guard(shard.m_mutex);
+  // Another thread may have made it since the lookup.
+  if (const Entry* const entry = Find(symbol, hash)) return entry;
+
+  const RawSymbolId id = m_idCounter.fetch_add(1);
+  char* const chars = Allocate(&shard, sizeof(Entry) + symbol.size() + 1);
+  const Entry* const entry =
+      new (chars) Entry{hash, id, static_cast<uint32_t>(symbol.size())};
+  std::memcpy(chars + sizeof(Entry), symbol.data(), symbol.size());
+  chars[sizeof(Entry) + symbol.size()] = '\0';
+  ++shard.m_count;
+
+  // Published by id first, lookups that find it may ask for its symbol.
+  uint64_t offset = 0;
+  const uint32_t index = Segment(id - m_poolCount, &offset);
+  std::atomic<std::atomic<const Entry*>*>& segment = m_segments[index];
+  if (segment.load(std::memory_order_acquire) == nullptr) {
+    std::lock_guard<std::mutex> segmentGuard(m_segmentMutex);
+    if (segment.load(std::memory_order_acquire) == nullptr) {
+      const uint64_t size = uint64_t(1) << (kFirstSegmentBits + index);
+      std::atomic<const Entry*>* const slots =
+          new std::atomic<const Entry*>[size];
+      for (uint64_t i = 0; i < size; ++i) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+      }
+      segment.store(slots, std::memory_order_release);
+    }
+  }
+  segment.load(std::memory_order_acquire)[offset].store(
+      entry, std::memory_order_release);
+
+  const Table* const table = shard.m_table.load(std::memory_order_relaxed);
+  if ((table != nullptr) && (2 * shard.m_count <= table->m_mask + 1)) {
+    Place(table, entry);
+  } else {
+    // Lookups may be running on the current table, the new one is filled
+    // before being published.
+    std::unique_ptr<Table> grown = std::make_unique<Table>(
+        (table == nullptr) ? kFirstTableSize : 2 * (table->m_mask + 1));
+    if (table != nullptr) {
+      for (uint64_t slot = 0; slot <= table->m_mask; ++slot) {
+        if (const Entry* const made =
+                table->m_slots[slot].load(std::memory_order_relaxed)) {
+          Place(grown.get(), made);
+        }
+      }
+    }
+    Place(grown.get(), entry);
+    shard.m_table.store(grown.get(), std::memory_order_release);
+    shard.m_tables.emplace_back(std::move(grown));
+  }
+  return entry;
+}
+
+char* SymbolFactory::Allocate(Shard* shard, uint64_t size) {
+  size = (size + sizeof(uint64_t) - 1) & ~uint64_t(sizeof(uint64_t) - 1);
+  if (size > shard->m_freeSize) {
+    uint64_t blockSize = kFirstBlockSize;
+    for (size_t i = 0;
+         (i < shard->m_blocks.size()) && (blockSize < kLastBlockSize); ++i) {
+      blockSize *= 2;
+    }
+    // Symbols larger than a block get one of their own.
+    blockSize = std::max(blockSize, size);
+    shard->m_blocks.emplace_back(new uint64_t[blockSize / sizeof(uint64_t)]);
+    shard->m_free = reinterpret_cast<char*>(shard->m_blocks.back().get());
+    shard->m_freeSize = blockSize;
+    shard->m_blockBytes += blockSize;
+  }
+  char* const allocated = shard->m_free;
+  shard->m_free += size;
+  shard->m_freeSize -= size;
+  shard->m_usedBytes += size;
+  return allocated;
+}
+
+void SymbolFactory::Place(const Table* table, const Entry* entry) {
+  uint64_t slot = entry->m_hash & table->m_mask;
+  while (table->m_slots[slot].load(std::memory_order_relaxed) != nullptr) {
+    slot = (slot + 1) & table->m_mask;
+  }
+  table->m_slots[slot].store(entry, std::memory_order_release);
+}
+
+uint32_t SymbolFactory::Segment(RawSymbolId index, uint64_t* offset) {
+  const uint64_t biased = uint64_t(index) + (uint64_t(1) << kFirstSegmentBits);
+  uint32_t segment = 0;
+  while ((biased >> (kFirstSegmentBits + segment + 1)) != 0) ++segment;
+  *offset = biased - (uint64_t(1) << (kFirstSegmentBits + segment));
+  return segment;
+}
+
+const SymbolFactory::Entry* SymbolFactory::MadeEntry(RawSymbolId index) const {
+  uint64_t offset = 0;
+  const std::atomic<const Entry*>* const segment =
+      m_segments[Segment(index, &offset)].load(std::memory_order_acquire);
+  return (segment == nullptr)
+             ? nullptr
+             : segment[offset].load(std::memory_order_acquire);
 }
 
 std::string_view SymbolFactory::getSymbol(SymbolId id) const {
@@ -91,8 +219,18 @@ std::string_view SymbolFactory::getSymbol(SymbolId id) const {
     return m_parent->getSymbol(id);
   }
   rid -= m_idOffset;
-  if (rid >= m_id2SymbolMap.size()) return getBadSymbol();
-  return m_id2SymbolMap[rid];
+  if (rid >= Size()) return getBadSymbol();
+  return RawSymbol(rid);
+}
+
+std::string_view SymbolFactory::RawSymbol(RawSymbolId id) const {
+  if (id >= m_poolCount) {
+    // Only null while the thread making it hasn't published it yet.
+    const Entry* const entry = MadeEntry(id - m_poolCount);
+    return (entry == nullptr) ? getBadSymbol() : entry->Symbol();
+  }
+  return std::string_view(m_poolChars + m_poolOffsets[id],
+                          m_poolOffsets[id + 1] - m_poolOffsets[id] - 1);
 }
 
 SymbolId SymbolFactory::copyFrom(SymbolId id, const SymbolFactory* rhs) {
@@ -104,26 +242,49 @@ void SymbolFactory::AppendSymbols(int64_t up_to,
   if (m_parent) m_parent->AppendSymbols(m_idOffset, dest);
   up_to -= m_idOffset;
   assert(up_to >= 0);
-  for (const auto& s : m_id2SymbolMap) {
+  for (RawSymbolId id = 0, n = Size(); id < n; ++id) {
     if (up_to-- <= 0) return;
-    dest->push_back(s);
+    dest->push_back(RawSymbol(id));
   }
 }
 
 std::vector<std::string_view> SymbolFactory::getSymbols() const {
   std::vector<std::string_view> result;
-  result.reserve(m_idOffset + m_id2SymbolMap.size());
-  AppendSymbols(m_idOffset + m_id2SymbolMap.size(), &result);
+  result.reserve(m_idOffset + Size());
+  AppendSymbols(m_idOffset + Size(), &result);
   return result;
 }
 
 void SymbolFactory::Purge() {
-  Symbol2IdMap().swap(m_symbol2IdMap);
-  Id2SymbolMap().swap(m_id2SymbolMap);
-  m_idCounter = 0;
+  Clear();
   registerSymbol(getBadSymbol());
 }
 
+void SymbolFactory::Clear() {
+  for (uint32_t index = 0; index < (1 << kShardBits); ++index) {
+    Shard& shard = m_shards[index];
+    shard.m_table.store(nullptr);
+    std::vector<std::unique_ptr<Table>>().swap(shard.m_tables);
+    shard.m_count = 0;
+    std::vector<std::unique_ptr<uint64_t[]>>().swap(shard.m_blocks);
+    shard.m_free = nullptr;
+    shard.m_freeSize = 0;
+    shard.m_blockBytes = 0;
+    shard.m_usedBytes = 0;
+  }
+  for (std::atomic<std::atomic<const Entry*>*>& segment : m_segments) {
+    delete[] segment.exchange(nullptr);
+  }
+  m_poolOwner.reset();
+  m_poolHashes = nullptr;
+  m_poolOffsets = nullptr;
+  m_poolTable = nullptr;
+  m_poolChars = nullptr;
+  m_poolTableSize = 0;
+  m_poolCount = 0;
+  m_idCounter = 0;
+}
+
 SymbolId SymbolFactory::Make(std::string_view symbol) {
   // IMPORTANT NOTE:
   // This is UHDM specific API and to be used within UHDM only.
@@ -155,4 +316,228 @@ SymbolId SymbolFactory::GetId(std::string_view symbol) const {
                                                         : getId(symbol);
 }
 
+// FNV-1a, the hashes are saved so they must not vary across platforms.
+uint64_t SymbolFactory::Hash(std::string_view symbol) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char c : symbol) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t SymbolFactory::TableSize(uint64_t count) {
+  uint64_t size = 2;
+  while (size < 2 * count) size <<= 1;
+  return size;
+}
+
+// Header, hashes, offsets (one more than symbols, the last one is the
+// size of the characters) and table, each padded to words. Each symbol is
+// followed by a null, for vpi_get_str().
+uint64_t SymbolFactory::CharsOffset(uint64_t count, uint64_t tableSize) {
+  return sizeof(PoolHeader) + (count * sizeof(uint64_t)) +
+         ((count + 1) * sizeof(uint64_t)) +
+         (((tableSize * sizeof(uint32_t)) + 7) & ~uint64_t(7));
+}
+
+bool SymbolFactory::ConvertPoolByteOrder(char* pool, uint64_t size) {
+  using BlockCodec::LittleEndian;
+  if (size < sizeof(PoolHeader)) return false;
+  PoolHeader* const header = reinterpret_cast<PoolHeader*>(pool);
+  header->m_count = LittleEndian(header->m_count);
+  header->m_tableSize = LittleEndian(header->m_tableSize);
+  const uint64_t count = header->m_count;
+  const uint64_t tableSize = header->m_tableSize;
+  if ((count >= UINT32_MAX) || (tableSize > size) ||
+      (CharsOffset(count, tableSize) > size)) {
+    return false;
+  }
+
+  // Hashes and offsets, then the table.
+  uint64_t* const words = reinterpret_cast<uint64_t*>(header + 1);
+  for (uint64_t i = 0; i < 2 * count + 1; ++i) {
+    words[i] = LittleEndian(words[i]);
+  }
+  uint32_t* const table = reinterpret_cast<uint32_t*>(words + 2 * count + 1);
+  for (uint64_t slot = 0; slot < tableSize; ++slot) {
+    table[slot] = LittleEndian(table[slot]);
+  }
+  return true;
+}
+
+uint64_t SymbolFactory::Bytes(uint64_t* usedBytes) const {
+  uint64_t bytes = 0;
+  *usedBytes = 0;
+  for (uint32_t index = 0; index < (1 << kShardBits); ++index) {
+    const Shard& shard = m_shards[index];
+    bytes += shard.m_blockBytes;
+    *usedBytes += shard.m_usedBytes;
+    for (const std::unique_ptr<Table>& table : shard.m_tables) {
+      bytes += sizeof(Table) + (table->m_mask + 1) * sizeof(table->m_slots[0]);
+    }
+  }
+  for (uint32_t index = 0; index < kSegmentCount; ++index) {
+    if (m_segments[index].load() != nullptr) {
+      bytes += (uint64_t(1) << (kFirstSegmentBits + index)) *
+               sizeof(std::atomic<const Entry*>);
+    }
+  }
+  if (m_poolCount != 0) {
+    const uint64_t chars = m_poolOffsets[m_poolCount];
+    bytes += CharsOffset(m_poolCount, m_poolTableSize) + chars;
+    *usedBytes += chars;
+  }
+  return bytes;
+}
+
+uint64_t SymbolFactory::PoolSize() const {
+  assert(m_parent == nullptr);
+  const uint64_t count = Size();
+  uint64_t size = CharsOffset(count, TableSize(count));
+  for (RawSymbolId id = 0; id < count; ++id) size += RawSymbol(id).size() + 1;
+  return size;
+}
+
+void SymbolFactory::WritePool(char* dest) const {
+  assert(m_parent == nullptr);
+  const RawSymbolId count = Size();
+  const PoolHeader header = {count, TableSize(count)};
+  std::vector<uint64_t> hashes(count);
+  std::vector<uint64_t> offsets(count + 1, 0);
+  std::vector<uint32_t> table(header.m_tableSize, 0);
+  for (RawSymbolId id = 0; id < count; ++id) {
+    const std::string_view symbol = RawSymbol(id);
+    // Adopted symbols come with their hash.
+    hashes[id] = (id < m_poolCount) ? m_poolHashes[id]
+                                    : MadeEntry(id - m_poolCount)->m_hash;
+    offsets[id + 1] = offsets[id] + symbol.size() + 1;
+    uint64_t slot = hashes[id] & (header.m_tableSize - 1);
+    while (table[slot] != 0) slot = (slot + 1) & (header.m_tableSize - 1);
+    table[slot] = id + 1;
+  }
+
+  // Little endian, whatever the host.
+  const uint64_t tableBytes = table.size() * sizeof(uint32_t);
+  char* const start = dest;
+  std::memcpy(dest, &header, sizeof(header));
+  dest += sizeof(header);
+  std::memcpy(dest, hashes.data(), hashes.size() * sizeof(uint64_t));
+  dest += hashes.size() * sizeof(uint64_t);
+  std::memcpy(dest, offsets.data(), offsets.size() * sizeof(uint64_t));
+  dest += offsets.size() * sizeof(uint64_t);
+  std::memcpy(dest, table.data(), tableBytes);
+  std::memset(dest + tableBytes, 0, ((tableBytes + 7) & ~uint64_t(7)) - tableBytes);
+  dest += (tableBytes + 7) & ~uint64_t(7);
+  ConvertPoolByteOrder(start, dest - start);
+  for (RawSymbolId id = 0; id < count; ++id) {
+    const std::string_view symbol = RawSymbol(id);
+    std::memcpy(dest, symbol.data(), symbol.size());
+    dest[symbol.size()] = '\0';
+    dest += symbol.size() + 1;
+  }
+}
+
+uint32_t SymbolFactory::PoolSymbolCount(const char* pool, uint64_t size) {
+  PoolHeader header;
+  if (size < sizeof(header)) return 0;
+  std::memcpy(&header, pool, sizeof(header));
+  header.m_count = BlockCodec::LittleEndian(header.m_count);
+  return (header.m_count < UINT32_MAX) ? static_cast<uint32_t>(header.m_count) : 0;
+}
+
+bool SymbolFactory::AdoptPool(std::shared_ptr<const void> owner,
+                              const char* pool, uint64_t size) {
+  if ((m_parent != nullptr) || (Size() != 1) ||
+      ((reinterpret_cast<uintptr_t>(pool) % sizeof(uint64_t)) != 0) ||
+      (size < sizeof(PoolHeader))) {
+    return false;
+  }
+  if (BlockCodec::LittleEndian<uint32_t>(1) != 1) {
+    // The pool is little endian, it can't be used in place.
+    std::shared_ptr<uint64_t[]> copy(new uint64_t[(size + 7) / 8]);
+    std::memcpy(copy.get(), pool, size);
+    if (!ConvertPoolByteOrder(reinterpret_cast<char*>(copy.get()), size)) {
+      return false;
+    }
+    pool = reinterpret_cast<const char*>(copy.get());
+    owner = std::move(copy);
+  }
+
+  // Only the layout is checked, in time proportional to the number of
+  // symbols; the symbols themselves aren't read.
+  const PoolHeader* const header = reinterpret_cast<const PoolHeader*>(pool);
+  const uint64_t count = header->m_count;
+  const uint64_t tableSize = header->m_tableSize;
+  if ((count == 0) || (count >= UINT32_MAX) || (count > size / 8) ||
+      (tableSize < 2 * count) || (tableSize > size) ||
+      ((tableSize & (tableSize - 1)) != 0)) {
+    return false;
+  }
+  const uint64_t charsOffset = CharsOffset(count, tableSize);
+  if (charsOffset > size) return false;
+
+  const uint64_t* const hashes =
+      reinterpret_cast<const uint64_t*>(pool + sizeof(PoolHeader));
+  const uint64_t* const offsets = hashes + count;
+  const uint32_t* const table =
+      reinterpret_cast<const uint32_t*>(offsets + count + 1);
+  if ((offsets[0] != 0) || (offsets[count] > size - charsOffset)) return false;
+  for (uint64_t id = 0; id < count; ++id) {
+    if (offsets[id] >= offsets[id + 1]) return false;
+  }
+  uint64_t used = 0;
+  for (uint64_t slot = 0; slot < tableSize; ++slot) {
+    if (table[slot] > count) return false;
+    if (table[slot] != 0) ++used;
+  }
+  // Half the slots at least are empty, lookups always end.
+  if (used != count) return false;
+
+  const char* const chars = pool + charsOffset;
+  if ((std::string_view(chars, offsets[1] - 1) != getBadSymbol()) ||
+      (chars[offsets[count] - 1] != '\0')) {
+    return false;
+  }
+
+  Clear();
+  m_poolOwner = std::move(owner);
+  m_poolHashes = hashes;
+  m_poolOffsets = offsets;
+  m_poolTable = table;
+  m_poolChars = chars;
+  m_poolTableSize = tableSize;
+  m_poolCount = static_cast<RawSymbolId>(count);
+  m_idCounter = m_poolCount;
+  return true;
+}
+
+uint32_t SymbolFactory::Renumber(const SymbolRenumbering& renumbering) {
+  assert(m_parent == nullptr);
+  const RawSymbolId before = Size();
+  std::vector<std::string> symbols;
+  symbols.reserve(renumbering.m_used.size());
+  for (RawSymbolId id : renumbering.m_used) symbols.emplace_back(RawSymbol(id));
+
+  // The bad symbol keeps id 0, the others are made again in their new order.
+  Purge();
+  for (size_t id = 1; id < symbols.size(); ++id) registerSymbol(symbols[id]);
+  assert(Size() == symbols.size());
+  return before - Size();
+}
+
+bool SymbolFactory::FindInPool(std::string_view symbol, uint64_t hash,
+                               RawSymbolId* id) const {
+  if (m_poolCount == 0) return false;
+  for (uint64_t slot = hash & (m_poolTableSize - 1);;
+       slot = (slot + 1) & (m_poolTableSize - 1)) {
+    const uint32_t entry = m_poolTable[slot];
+    if (entry == 0) return false;
+    if ((m_poolHashes[entry - 1] == hash) && (RawSymbol(entry - 1) == symbol)) {
+      *id = entry - 1;
+      return true;
+    }
+  }
+}
+
 }  // namespace UHDM
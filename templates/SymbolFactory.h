@@ -28,19 +28,53 @@
 
 #include <uhdm/SymbolId.h>
 
-#include <deque>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
-#include <unordered_map>
 #include <vector>
 
 namespace UHDM {
 class Serializer;
 
+// Dense renumbering of the symbols in use, see Serializer::CompactSymbols().
+// Symbols get their new id in the order they are first seen; the bad
+// symbol keeps id 0.
+class SymbolRenumbering final {
+ public:
+  explicit SymbolRenumbering(RawSymbolId count)
+      : m_ids(count, BadRawSymbolId), m_used(1, BadRawSymbolId) {}
+
+  SymbolId Renumber(SymbolId id) {
+    const RawSymbolId raw = (RawSymbolId)id;
+    if ((raw == BadRawSymbolId) || (raw >= m_ids.size())) return BadSymbolId;
+    RawSymbolId& mapped = m_ids[raw];
+    if (mapped == BadRawSymbolId) {
+      mapped = static_cast<RawSymbolId>(m_used.size());
+      m_used.emplace_back(raw);
+    }
+    return SymbolId(mapped, std::string_view());
+  }
+
+ private:
+  std::vector<RawSymbolId> m_ids;   // By old id, the new one
+  std::vector<RawSymbolId> m_used;  // By new id, the old one
+
+  friend class SymbolFactory;
+};
+
+// Symbols can be made and looked up from any number of threads at once.
+// Looking up an existing symbol doesn't lock, making a new one only locks
+// the shard its hash falls in. Ids are dense and never change once handed
+// out, until Purge() or Renumber(). Going over all the symbols (getSymbols(),
+// WritePool(), Renumber()) and AdoptPool() must not race with making any.
 class SymbolFactory {
  public:
   SymbolFactory();
-  ~SymbolFactory() = default;
+  ~SymbolFactory();
 
   // Must never copy: expensive, and string locations would not be stable.
   // It would also be a programming error.
@@ -90,30 +124,132 @@ class SymbolFactory {
   std::string_view GetSymbol(SymbolId id) const;
   SymbolId GetId(std::string_view symbol) const;
 
+  // Serialized form of the symbols, see Serializer::Save(): their stable
+  // hashes and offsets, an open addressing table over the hashes, then their
+  // null terminated characters, all little endian and laid out to be used in place by
+  // AdoptPool(). Writes PoolSize() bytes at dest.
+  uint64_t PoolSize() const;
+  void WritePool(char* dest) const;
+
+  // Makes the symbols of a pool written by WritePool() the symbols of this
+  // factory, which must not hold any but the bad symbol. The pool is used in
+  // place, 8 bytes aligned, without copying or hashing any symbol; owner
+  // keeps it alive. Big endian hosts adopt a copy converted to their byte
+  // order instead. Returns false if the pool is malformed.
+  bool AdoptPool(std::shared_ptr<const void> owner, const char* pool,
+                 uint64_t size);
+
+  // Number of symbols of a pool written by WritePool(), 0 if malformed.
+  static uint32_t PoolSymbolCount(const char* pool, uint64_t size);
+
+  // Keeps only the symbols seen by renumbering, under their new ids.
+  // Returns the number of symbols dropped.
+  uint32_t Renumber(const SymbolRenumbering& renumbering);
+
+  // Bytes held by this factory, not its parent: the arenas, lookup tables
+  // and id segments of the made symbols, and the adopted pool. usedBytes
+  // receives those taken by the symbols themselves. Must not race with
+  // making symbols.
+  uint64_t Bytes(uint64_t* usedBytes) const;
+
  protected:
   // Create a snapshot of the current symbol table. Private, as this
   // functionality should be explicitly accessed through CreateSnapshot().
   SymbolFactory(const SymbolFactory& parent)
-      : m_parent(&parent), m_idOffset(parent.m_idCounter + parent.m_idOffset) {}
+      : m_parent(&parent), m_idOffset(parent.Size() + parent.m_idOffset) {}
 
  private:
+  struct Entry;
+
   void Purge();
+  // Drops all the symbols, pooled or made, without making the bad one.
+  void Clear();
   void AppendSymbols(int64_t up_to, std::vector<std::string_view>* dest) const;
 
-  typedef std::deque<std::string> Id2SymbolMap;
-  typedef std::unordered_map<std::string_view, RawSymbolId> Symbol2IdMap;
+  // Symbol of a raw id of this factory, not counting m_idOffset.
+  std::string_view RawSymbol(RawSymbolId id) const;
+  RawSymbolId Size() const { return m_idCounter.load(); }
+
+  // Pool layout, see WritePool(): a header, then arrays of words.
+  struct PoolHeader {
+    uint64_t m_count;
+    uint64_t m_tableSize;  // Power of two, at least twice m_count
+  };
+  static uint64_t Hash(std::string_view symbol);
+  static uint64_t TableSize(uint64_t count);
+  static uint64_t CharsOffset(uint64_t count, uint64_t tableSize);
+  // Converts the integers of a pool between little endian and the host byte
+  // order, both ways. Returns false if its header is malformed.
+  static bool ConvertPoolByteOrder(char* pool, uint64_t size);
+  bool FindInPool(std::string_view symbol, uint64_t hash,
+                  RawSymbolId* id) const;
+
+  // Made symbols, see add(). An entry is bump allocated in the arena of its
+  // shard, followed by its characters and a null for vpi_get_str(); it never
+  // moves nor changes once published. A shard table is replaced when it
+  // fills up rather than resized, the replaced ones are kept for the lookups
+  // still using them.
+  struct Entry {
+    uint64_t m_hash;
+    RawSymbolId m_id;
+    uint32_t m_size;
+    std::string_view Symbol() const {
+      return std::string_view(reinterpret_cast<const char*>(this + 1), m_size);
+    }
+  };
+  struct Table {
+    explicit Table(uint64_t size);
+    const uint64_t m_mask;  // Size - 1, at least twice the entries
+    const std::unique_ptr<std::atomic<const Entry*>[]> m_slots;
+  };
+  struct Shard {
+    std::mutex m_mutex;  // Held to make symbols only
+    std::atomic<const Table*> m_table{nullptr};
+    std::vector<std::unique_ptr<Table>> m_tables;  // m_table is the last one
+    uint64_t m_count = 0;
+    // Arena blocks, the last one is filled from m_free on.
+    std::vector<std::unique_ptr<uint64_t[]>> m_blocks;
+    char* m_free = nullptr;
+    uint64_t m_freeSize = 0;
+    uint64_t m_blockBytes = 0;
+    uint64_t m_usedBytes = 0;  // By the entries and their characters
+  };
+  static constexpr uint32_t kShardBits = 6;
+  static constexpr uint64_t kFirstTableSize = 16;
+  // Arena blocks double in size from the first one up to the last one.
+  static constexpr uint64_t kFirstBlockSize = 1 << 10;
+  static constexpr uint64_t kLastBlockSize = 1 << 20;
+  // Made entries by id - m_poolCount, in segments that never move: the first
+  // one holds 2^kFirstSegmentBits entries, each next one twice as many.
+  static constexpr uint32_t kFirstSegmentBits = 10;
+  static constexpr uint32_t kSegmentCount = 33 - kFirstSegmentBits;
+
+  const Entry* Find(std::string_view symbol, uint64_t hash) const;
+  const Entry* Insert(std::string_view symbol, uint64_t hash);
+  static void Place(const Table* table, const Entry* entry);
+  static char* Allocate(Shard* shard, uint64_t size);
+  static uint32_t Segment(RawSymbolId index, uint64_t* offset);
+  const Entry* MadeEntry(RawSymbolId index) const;
 
   const SymbolFactory *const m_parent;
   const RawSymbolId m_idOffset;
 
-  RawSymbolId m_idCounter = 0;
+  // Number of symbols, pooled or made, and the id of the next one.
+  std::atomic<RawSymbolId> m_idCounter{0};
 
-  // Stable strings whose address doesn't change with reallocations.
-  Id2SymbolMap m_id2SymbolMap;
+  // Symbols adopted from a pool, see AdoptPool(), have the first ids.
+  std::shared_ptr<const void> m_poolOwner;
+  const uint64_t* m_poolHashes = nullptr;
+  const uint64_t* m_poolOffsets = nullptr;
+  const uint32_t* m_poolTable = nullptr;  // Ids + 1, 0 for empty slots
+  const char* m_poolChars = nullptr;
+  uint64_t m_poolTableSize = 0;
+  RawSymbolId m_poolCount = 0;
 
-  // The key string_views point to the stable backing buffer provided in
-  // m_id2SymbolMap
-  Symbol2IdMap m_symbol2IdMap;
+  const std::unique_ptr<Shard[]> m_shards{new Shard[1 << kShardBits]};
+  std::array<std::atomic<std::atomic<const Entry*>*>, kSegmentCount>
+      m_segments{};
+  std::mutex m_segmentMutex;  // Held to allocate segments
 
   friend Serializer;
 };
@@ -0,0 +1,76 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef UHDM_THREADPOOL_H
+#define UHDM_THREADPOOL_H
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace UHDM {
+// Runs a batch of independent tasks on a fixed number of threads.
+// The calling thread takes part in the work; a pool of one thread runs
+// all tasks inline, in order.
+class ThreadPool final {
+ public:
+  typedef std::function<void()> task_t;
+
+  // A threadCount of 0 uses one thread per hardware core.
+  explicit ThreadPool(uint32_t threadCount)
+      : m_threadCount(ResolveThreadCount(threadCount)) {}
+
+  uint32_t GetThreadCount() const { return m_threadCount; }
+
+  static uint32_t ResolveThreadCount(uint32_t threadCount) {
+    if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+    return (threadCount == 0) ? 1 : threadCount;
+  }
+
+  // Runs all tasks and returns when they are all finished. Tasks are
+  // started in order, so put the expensive ones first.
+  void Run(const std::vector<task_t>& tasks) const {
+    const size_t threadCount =
+        std::min<size_t>(m_threadCount, tasks.size());
+    if (threadCount <= 1) {
+      for (const task_t& task : tasks) task();
+      return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&tasks, &next]() {
+      for (size_t index = next++; index < tasks.size(); index = next++) {
+        tasks[index]();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(threadCount - 1);
+    for (size_t i = 1; i < threadCount; ++i) threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads) thread.join();
+  }
+
+ private:
+  const uint32_t m_threadCount;
+};
+}  // namespace UHDM
+
+#endif  // UHDM_THREADPOOL_H
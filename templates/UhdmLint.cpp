@@ -33,6 +33,21 @@
 
 namespace UHDM {
 
+UhdmLint::UhdmLint(Serializer* serializer, design* des)
+    : serializer_(serializer), design_(des) {
+  // Only the relations leading to the checked objects are walked.
+  setTypeFilter({UHDM_OBJECT_TYPE::uhdmbit_select,
+                 UHDM_OBJECT_TYPE::uhdmfunction,
+                 UHDM_OBJECT_TYPE::uhdmstruct_typespec,
+                 UHDM_OBJECT_TYPE::uhdmmodule_inst,
+                 UHDM_OBJECT_TYPE::uhdmassignment,
+                 UHDM_OBJECT_TYPE::uhdmlogic_net,
+                 UHDM_OBJECT_TYPE::uhdmenum_typespec,
+                 UHDM_OBJECT_TYPE::uhdmproperty_spec,
+                 UHDM_OBJECT_TYPE::uhdmsys_func_call,
+                 UHDM_OBJECT_TYPE::uhdmport});
+}
+
 void UhdmLint::leaveBit_select(const bit_select* object, vpiHandle handle) {
   if (const ref_obj* index = object->VpiIndex<ref_obj>()) {
     if (const real_var* actual = index->Actual_group<real_var>()) {
@@ -108,7 +123,7 @@ void UhdmLint::leaveModule_inst(const module_inst* object, vpiHandle handle) {
 }
 
 void UhdmLint::checkMultiContAssign(
-    const std::vector<UHDM::cont_assign*>* assigns) {
+    const UHDM::VectorOfcont_assign* assigns) {
   for (uint32_t i = 0; i < assigns->size() - 1; i++) {
     const cont_assign* cassign = assigns->at(i);
     if (cassign->VpiStrength0() || cassign->VpiStrength1()) continue;
@@ -33,7 +33,7 @@ namespace UHDM {
 class Serializer;
 class UhdmLint final : public VpiListener {
  public:
-  UhdmLint(Serializer* serializer, design* des) : serializer_(serializer), design_(des) {}
+  UhdmLint(Serializer* serializer, design* des);
 
  private:
   void leaveBit_select(const bit_select* object, vpiHandle handle) override;
@@ -59,7 +59,7 @@ class UhdmLint final : public VpiListener {
 
   void leavePort(const port* object, vpiHandle handle) override;
 
-  void checkMultiContAssign(const std::vector<UHDM::cont_assign*>* assigns);
+  void checkMultiContAssign(const UHDM::VectorOfcont_assign* assigns);
 
   Serializer* serializer_ = nullptr;
   design* design_ = nullptr;
@@ -37,24 +37,10 @@ ScopedVpiHandle::~ScopedVpiHandle() {
 }
 
 bool UhdmListener::didVisitAll(const Serializer& serializer) const {
-  std::set<const any*> allVisited;
-  std::copy(visited.begin(), visited.end(),
-            std::inserter(allVisited, allVisited.begin()));
-
-  const Serializer::IdMap idMap = serializer.AllObjects();
-  std::set<const any*> allObjects;
-  std::transform(
-      idMap.cbegin(), idMap.cend(),
-      std::inserter(allObjects, allObjects.begin()),
-      [](std::unordered_map<const BaseClass*, uint32_t>::const_reference
-             entry) { return entry.first; });
-
-  std::set<const any*> diffObjects;
-  std::set_difference(allObjects.begin(), allObjects.end(), allVisited.begin(),
-                      allVisited.end(),
-                      std::inserter(diffObjects, diffObjects.begin()));
-
-  return diffObjects.empty();
+  for (const auto& entry : serializer.AllObjects()) {
+    if (!visited.contains(entry.first)) return false;
+  }
+  return true;
 }
 
 void UhdmListener::listenBaseClass_(const any* const object) {
@@ -66,7 +52,13 @@ void UhdmListener::listenBaseClass_(const any* const object) {
 <UHDM_PRIVATE_LISTEN_IMPLEMENTATIONS>
 <UHDM_PUBLIC_LISTEN_IMPLEMENTATIONS>
 void UhdmListener::listenAny(const any* const object) {
-  const bool revisiting = visited.find(object) != visited.end();
+  if (isSkipped_(object)) return;
+  if (iterative_) {
+    walk_(object, false);
+    return;
+  }
+  object->GetSerializer()->Materialize(object);
+  const bool revisiting = visited.contains(object);
   if (!revisiting) enterAny(object);
 
   switch (object->UhdmType()) {
@@ -77,4 +69,115 @@ void UhdmListener::listenAny(const any* const object) {
   if (!revisiting) leaveAny(object);
 }
 
+// Relations are resolved and vectors indexed only when the walk reaches
+// them, as the recursion does, so callbacks see the same model.
+void UhdmListener::walk_(const any* const object, bool typed) {
+  // Callbacks may start walks of their own, above this one on the stack.
+  const size_t bottom = workstack.size();
+  work_t& first = workstack.emplace_back();
+  first.object = object;
+  first.kind = typed ? work_t::kind_t::Typed : work_t::kind_t::Any;
+
+  while (workstack.size() > bottom) {
+    const work_t work = workstack.back();
+    workstack.pop_back();
+    switch (work.kind) {
+      case work_t::kind_t::Any:
+      case work_t::kind_t::Typed: {
+        bool anyCallbacks = false;
+        if (work.kind == work_t::kind_t::Any) {
+          if (isSkipped_(work.object)) break;
+          work.object->GetSerializer()->Materialize(work.object);
+          anyCallbacks = !visited.contains(work.object);
+          if (anyCallbacks) enterAny(work.object);
+        }
+        callstack.push_back(work.object);
+        if (!enterTyped_(work.object)) {
+          callstack.pop_back();
+          if (anyCallbacks) leaveAny(work.object);
+          break;
+        }
+        work_t& leave = workstack.emplace_back();
+        leave.object = work.object;
+        leave.kind = work_t::kind_t::Leave;
+        leave.leaveAny = anyCallbacks;
+        if (visited.insert(work.object).second) {
+          work_t& relations = workstack.emplace_back();
+          relations.object = work.object;
+          relations.kind = work_t::kind_t::Relations;
+        }
+      } break;
+      case work_t::kind_t::Leave: {
+        leaveTyped_(work.object);
+        callstack.pop_back();
+        if (work.leaveAny) leaveAny(work.object);
+      } break;
+      case work_t::kind_t::Relations: {
+        // The next relation goes below the work of this one.
+        work_t& next = workstack.emplace_back(work);
+        ++next.step;
+        if (!stepAny_(work.object, work.step)) workstack.pop_back();
+      } break;
+      case work_t::kind_t::Elements: {
+        if (work.step < work.vector->size()) {
+          work_t& next = workstack.emplace_back(work);
+          ++next.step;
+          pushAny_(work.vector->at(work.step));
+        } else {
+          leaveVector_(work.object, work.vector, work.relation);
+        }
+      } break;
+    }
+  }
+}
+
+void UhdmListener::pushAny_(const any* const object) {
+  work_t& work = workstack.emplace_back();
+  work.object = object;
+  work.kind = work_t::kind_t::Any;
+}
+
+bool UhdmListener::enterTyped_(const any* const object) {
+  switch (object->UhdmType()) {
+<UHDM_ENTER_TYPED_IMPLEMENTATION>
+  default: break;
+  }
+  return false;
+}
+
+void UhdmListener::leaveTyped_(const any* const object) {
+  switch (object->UhdmType()) {
+<UHDM_LEAVE_TYPED_IMPLEMENTATION>
+  default: break;
+  }
+}
+
+void UhdmListener::leaveVector_(const any* const object,
+                                const RelationVector<const any>* objects,
+                                uint32_t relation) {
+  switch (relation) {
+<UHDM_LEAVE_VECTOR_IMPLEMENTATION>
+  default: break;
+  }
+}
+
+bool UhdmListener::stepAny_(const any* const object, uint32_t step) {
+  switch (object->UhdmType()) {
+<UHDM_STEP_ANY_IMPLEMENTATION>
+  default: break;
+  }
+  return false;
+}
+
+bool UhdmListener::stepBaseClass_(const any* const object, uint32_t step) {
+  if (step != 0) return false;
+  if (const any* const vpiParent_ = object->VpiParent()) {
+    pushAny_(vpiParent_);
+  }
+  return true;
+}
+
+<UHDM_PRIVATE_STEP_IMPLEMENTATIONS>
+
+<UHDM_REACHABILITY_TABLE>
 } // namespace UHDM
@@ -27,10 +27,12 @@
 #ifndef UHDM_UHDMLISTENER_H
 #define UHDM_UHDMLISTENER_H
 
+#include <uhdm/VisitedSet.h>
 #include <uhdm/containers.h>
 #include <uhdm/sv_vpi_user.h>
 
 #include <algorithm>
+#include <cstdint>
 #include <unordered_set>
 #include <vector>
 
@@ -49,15 +51,16 @@ class ScopedVpiHandle final {
 
 class UhdmListener {
 protected:
-  typedef std::unordered_set<const any *> any_set_t;
+  typedef VisitedSet any_set_t;
   typedef std::vector<const any *> any_stack_t;
 
   any_set_t visited;
   any_stack_t callstack;
+  bool iterative_ = false;
 
 public:
-  // Use implicit constructor to initialize all members
-  // VpiListener()
+  explicit UhdmListener(VisitedSet::Kind visitedKind = VisitedSet::Kind::Hashed)
+      : visited(visitedKind) {}
   virtual ~UhdmListener() = default;
 
 public:
@@ -80,6 +83,28 @@ public:
 
   bool didVisitAll(const Serializer &serializer) const;
 
+  // In the iterative mode, the listenXxx() functions walk the objects with
+  // an explicit stack instead of recursing, in the same order and with the
+  // same callbacks, so deep models don't need a deep native stack.
+  bool isIterative() const { return iterative_; }
+  void setIterative(bool iterative) { iterative_ = iterative; }
+
+  // Restricts the walk to the relations that can lead to objects of the
+  // given types, according to the models, empty to walk them all. Listeners
+  // overriding a few callbacks name their types to skip the rest of the
+  // model. vpiParent is always walked.
+  void setTypeFilter(const std::unordered_set<UHDM_OBJECT_TYPE> &types);
+  // Whether the walk can go down from an object of type from to one of type
+  // to. Classes and groups stand for all their object types.
+  static bool canReach(UHDM_OBJECT_TYPE from, UHDM_OBJECT_TYPE to);
+
+  // Objects listenAny() leaves out, with no callback, as if they weren't
+  // referenced, but for the object the walk started from. nullptr for none,
+  // the set must outlive the walks.
+  void setSkipped(const std::unordered_set<const any *> *skipped) {
+    skipped_ = skipped;
+  }
+
   void listenAny(const any *const object);
 <UHDM_PUBLIC_LISTEN_DECLARATIONS>
 
@@ -89,6 +114,59 @@ public:
 <UHDM_ENTER_LEAVE_DECLARATIONS>
 <UHDM_ENTER_LEAVE_VECTOR_DECLARATIONS>
 private:
+  bool isRelevant_(UHDM_OBJECT_TYPE type) const {
+    return relevant_.empty() || relevant_[static_cast<uint32_t>(type)];
+  }
+
+  bool isSkipped_(const any *const object) const {
+    return (skipped_ != nullptr) && !callstack.empty() &&
+           (callstack.front() != object) &&
+           (skipped_->find(object) != skipped_->end());
+  }
+
+  std::vector<bool> relevant_;  // By type, empty without a type filter
+  const std::unordered_set<const any *> *skipped_ = nullptr;
+
+  // Pending work of the iterative walk.
+  struct work_t {
+    enum class kind_t : uint8_t {
+      Any,       // listenAny(object)
+      Typed,     // listenXxx(object)
+      Leave,     // leaveXxx(object), then leaveAny(object) if flagged
+      Relations, // Relation number step of object, then the next ones
+      Elements,  // Element number step of vector, then the next ones
+    };
+    const any *object = nullptr;
+    const RelationVector<const any> *vector = nullptr;
+    uint32_t step = 0;
+    uint32_t relation = 0;  // Of the vector, for leaveXxx(object, vector)
+    kind_t kind = kind_t::Any;
+    bool leaveAny = false;
+  };
+  typedef std::vector<work_t> work_stack_t;
+
+  work_stack_t workstack;
+
+  void walk_(const any *const object, bool typed);
+  void pushAny_(const any *const object);
+  template <typename T>
+  void pushElements_(const any *const object, const RelationVector<T> *vector,
+                     uint32_t relation) {
+    work_t &work = workstack.emplace_back();
+    work.object = object;
+    work.vector = reinterpret_cast<const RelationVector<const any> *>(vector);
+    work.relation = relation;
+    work.kind = work_t::kind_t::Elements;
+  }
+  bool enterTyped_(const any *const object);
+  void leaveTyped_(const any *const object);
+  void leaveVector_(const any *const object,
+                    const RelationVector<const any> *objects,
+                    uint32_t relation);
+  bool stepAny_(const any *const object, uint32_t step);
+  bool stepBaseClass_(const any *const object, uint32_t step);
+<UHDM_PRIVATE_STEP_DECLARATIONS>
+
   void listenBaseClass_(const any *const object);
 <UHDM_PRIVATE_LISTEN_DECLARATIONS>
 };
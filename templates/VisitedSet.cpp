@@ -0,0 +1,167 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <uhdm/BaseClass.h>
+#include <uhdm/VisitedSet.h>
+
+namespace UHDM {
+VisitedSet::const_iterator VisitedSet::begin() const {
+  switch (m_kind) {
+    case Kind::Ordered: return const_iterator(m_ordered.cbegin());
+    case Kind::Hashed: return const_iterator(m_hashed.cbegin());
+    case Kind::Indexed: break;
+  }
+  return const_iterator(m_objects.cbegin());
+}
+
+VisitedSet::const_iterator VisitedSet::end() const {
+  switch (m_kind) {
+    case Kind::Ordered: return const_iterator(m_ordered.cend());
+    case Kind::Hashed: return const_iterator(m_hashed.cend());
+    case Kind::Indexed: break;
+  }
+  return const_iterator(m_objects.cend());
+}
+
+size_t VisitedSet::size() const {
+  switch (m_kind) {
+    case Kind::Ordered: return m_ordered.size();
+    case Kind::Hashed: return m_hashed.size();
+    case Kind::Indexed: break;
+  }
+  return m_objects.size();
+}
+
+VisitedSet::Key VisitedSet::KeyOf(const BaseClass* object) const {
+  if (object->GetSerializer() != m_serializer) return {kForeign, 0};
+  return {static_cast<uint32_t>(object->UhdmType()), object->UhdmIndex()};
+}
+
+uint32_t* VisitedSet::Slot(const BaseClass* object, const Key& key,
+                           bool grow) {
+  if (key.m_type == kForeign) {
+    if (grow) return &m_foreignSlots[object];
+    auto it = m_foreignSlots.find(object);
+    return (it == m_foreignSlots.end()) ? nullptr : &it->second;
+  }
+
+  if (key.m_type >= m_slots.size()) {
+    if (!grow) return nullptr;
+    m_slots.resize(key.m_type + 1);
+  }
+  std::vector<uint32_t>& slots = m_slots[key.m_type];
+  if (key.m_index >= slots.size()) {
+    if (!grow) return nullptr;
+    slots.resize(key.m_index + 1, 0);
+  }
+  return &slots[key.m_index];
+}
+
+const uint32_t* VisitedSet::Slot(const BaseClass* object) const {
+  return const_cast<VisitedSet*>(this)->Slot(object, KeyOf(object), false);
+}
+
+std::pair<VisitedSet::const_iterator, bool> VisitedSet::insert(
+    const BaseClass* object) {
+  switch (m_kind) {
+    case Kind::Ordered: {
+      auto [it, inserted] = m_ordered.insert(object);
+      return {const_iterator(it), inserted};
+    }
+    case Kind::Hashed: {
+      auto [it, inserted] = m_hashed.insert(object);
+      return {const_iterator(it), inserted};
+    }
+    case Kind::Indexed: break;
+  }
+
+  if (m_serializer == nullptr) m_serializer = object->GetSerializer();
+  const Key key = KeyOf(object);
+  uint32_t* const slot = Slot(object, key, true);
+  if ((*slot != 0) && (*slot <= m_objects.size())) {
+    const auto it = m_objects.begin() + (*slot - 1);
+    if (*it == object) return {const_iterator(it), false};
+    // Left by an object since freed or moved, at the same index.
+    *it = object;
+    return {const_iterator(it), true};
+  }
+  m_objects.emplace_back(object);
+  m_keys.emplace_back(key);
+  *slot = static_cast<uint32_t>(m_objects.size());
+  return {const_iterator(m_objects.cend() - 1), true};
+}
+
+size_t VisitedSet::erase(const BaseClass* object) {
+  switch (m_kind) {
+    case Kind::Ordered: return m_ordered.erase(object);
+    case Kind::Hashed: return m_hashed.erase(object);
+    case Kind::Indexed: break;
+  }
+
+  uint32_t* const slot = Slot(object, KeyOf(object), false);
+  if (!Owns(slot, object)) return 0;
+  // The last object takes the place of the erased one.
+  const uint32_t position = *slot;
+  *slot = 0;
+  if (position != m_objects.size()) {
+    m_objects[position - 1] = m_objects.back();
+    m_keys[position - 1] = m_keys.back();
+    *Slot(m_objects.back(), m_keys.back(), false) = position;
+  }
+  m_objects.pop_back();
+  m_keys.pop_back();
+  return 1;
+}
+
+void VisitedSet::clear() {
+  switch (m_kind) {
+    case Kind::Ordered: m_ordered.clear(); return;
+    case Kind::Hashed: m_hashed.clear(); return;
+    case Kind::Indexed: break;
+  }
+
+  // Only the slots in use are reset, the tables are kept for the next walk.
+  for (const Key& key : m_keys) {
+    if (key.m_type != kForeign) m_slots[key.m_type][key.m_index] = 0;
+  }
+  m_objects.clear();
+  m_keys.clear();
+  m_foreignSlots.clear();
+  m_serializer = nullptr;
+}
+
+VisitedSet::const_iterator VisitedSet::find(const BaseClass* object) const {
+  switch (m_kind) {
+    case Kind::Ordered: return const_iterator(m_ordered.find(object));
+    case Kind::Hashed: return const_iterator(m_hashed.find(object));
+    case Kind::Indexed: break;
+  }
+
+  const uint32_t* const slot = Slot(object);
+  if (!Owns(slot, object)) return end();
+  return const_iterator(m_objects.cbegin() + (*slot - 1));
+}
+
+bool VisitedSet::contains(const BaseClass* object) const {
+  switch (m_kind) {
+    case Kind::Ordered: return m_ordered.find(object) != m_ordered.end();
+    case Kind::Hashed: return m_hashed.find(object) != m_hashed.end();
+    case Kind::Indexed: break;
+  }
+
+  return Owns(Slot(object), object);
+}
+}  // namespace UHDM
@@ -0,0 +1,155 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#ifndef UHDM_VISITEDSET_H
+#define UHDM_VISITEDSET_H
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace UHDM {
+class BaseClass;
+class Serializer;
+
+// Objects visited by a listener. The representation is chosen at
+// construction:
+//  - Ordered, a std::set, iterated in address order,
+//  - Hashed, a std::unordered_set,
+//  - Indexed, per type tables indexed by the position of the objects in
+//    their factory, UhdmIndex(), iterated in insertion order. No hashing
+//    nor allocation per object, for the walks of big designs. Objects from
+//    a serializer other than the one of the first object go to a hash map.
+// Iterators and the results of find() are invalidated by insert() and
+// erase() in the Indexed representation. Indexed entries of objects since
+// freed or moved by a garbage collection are never dereferenced, and are
+// taken over by the object now at their index.
+class VisitedSet final {
+ public:
+  enum class Kind { Ordered, Hashed, Indexed };
+
+  typedef const BaseClass* value_type;
+  typedef const BaseClass* key_type;
+  typedef size_t size_type;
+
+  class const_iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef const BaseClass* value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const BaseClass* const* pointer;
+    typedef const BaseClass* const& reference;
+
+    const_iterator() = default;
+
+    reference operator*() const {
+      return std::visit([](const auto& it) -> reference { return *it; },
+                        m_it);
+    }
+    pointer operator->() const { return &**this; }
+    const_iterator& operator++() {
+      std::visit([](auto& it) { ++it; }, m_it);
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator result = *this;
+      ++*this;
+      return result;
+    }
+    bool operator==(const const_iterator& rhs) const {
+      return m_it == rhs.m_it;
+    }
+    bool operator!=(const const_iterator& rhs) const {
+      return m_it != rhs.m_it;
+    }
+
+   private:
+    friend VisitedSet;
+    typedef std::variant<std::set<const BaseClass*>::const_iterator,
+                         std::unordered_set<const BaseClass*>::const_iterator,
+                         std::vector<const BaseClass*>::const_iterator>
+        iterator_t;
+    template <typename T>
+    explicit const_iterator(T it) : m_it(it) {}
+
+    iterator_t m_it;
+  };
+  typedef const_iterator iterator;
+
+  explicit VisitedSet(Kind kind = Kind::Ordered) : m_kind(kind) {}
+
+  Kind GetKind() const { return m_kind; }
+
+  const_iterator begin() const;
+  const_iterator end() const;
+
+  size_t size() const;
+  bool empty() const { return size() == 0; }
+
+  std::pair<const_iterator, bool> insert(const BaseClass* object);
+  std::pair<const_iterator, bool> emplace(const BaseClass* object) {
+    return insert(object);
+  }
+  size_t erase(const BaseClass* object);
+  void clear();
+
+  const_iterator find(const BaseClass* object) const;
+  size_t count(const BaseClass* object) const {
+    return contains(object) ? 1 : 0;
+  }
+  bool contains(const BaseClass* object) const;
+
+ private:
+  // Type and index of an object in m_slots, kForeign for the objects of
+  // another serializer, which are found by address in m_foreignSlots.
+  struct Key {
+    uint32_t m_type = 0;
+    uint32_t m_index = 0;
+  };
+  static constexpr uint32_t kForeign = UINT32_MAX;
+  Key KeyOf(const BaseClass* object) const;
+
+  // Where the object is in m_objects, plus one, 0 when not in the set. The
+  // object isn't dereferenced.
+  uint32_t* Slot(const BaseClass* object, const Key& key, bool grow);
+  const uint32_t* Slot(const BaseClass* object) const;
+  // Whether the slot holds this object and not one it was left by.
+  bool Owns(const uint32_t* slot, const BaseClass* object) const {
+    return (slot != nullptr) && (*slot != 0) && (*slot <= m_objects.size()) &&
+           (m_objects[*slot - 1] == object);
+  }
+
+  const Kind m_kind;
+  std::set<const BaseClass*> m_ordered;
+  std::unordered_set<const BaseClass*> m_hashed;
+
+  // Indexed
+  std::vector<const BaseClass*> m_objects;
+  std::vector<Key> m_keys;  // Of m_objects, as they were inserted
+  std::vector<std::vector<uint32_t>> m_slots;  // By UhdmType(), UhdmIndex()
+  const Serializer* m_serializer = nullptr;
+  std::unordered_map<const BaseClass*, uint32_t> m_foreignSlots;
+};
+}  // namespace UHDM
+
+#endif /* UHDM_VISITEDSET_H */
@@ -39,8 +39,12 @@ bool VpiListener::inCallstackOfType(UHDM_OBJECT_TYPE type) {
 }
 
 void VpiListener::listenAny(vpiHandle handle) {
+  if (iterative_) {
+    walk_(handle, false);
+    return;
+  }
   const any* object = (const any*)((const uhdm_handle*)handle)->object;
-  const bool revisiting = visited.find(object) != visited.end();
+  const bool revisiting = visited.contains(object);
   if (!revisiting) enterAny(object, handle);
 
   UHDM_OBJECT_TYPE type = ((const uhdm_handle*)handle)->type;
@@ -52,10 +56,160 @@ void VpiListener::listenAny(vpiHandle handle) {
   if (!revisiting) leaveAny(object, handle);
 }
 
+void VpiListener::listenRelation_(const any* const object, int32_t relation) {
+  auto [ref, ignored1, ignored2] = object->GetByVpiType(relation);
+  if (ref == nullptr) return;
+  ref->GetSerializer()->Materialize(ref);
+  uhdm_handle handle(ref->UhdmType(), ref);
+  listenAny(reinterpret_cast<vpiHandle>(&handle));
+}
+
+void VpiListener::listenRelations_(const any* const object, int32_t relation) {
+  auto [ignored, refType, refs] = object->GetByVpiType(relation);
+  if (refs == nullptr) return;
+  // Indexed, as vpi_scan() is, since listeners may grow the vector.
+  for (size_t i = 0; i < refs->size(); ++i) {
+    const any* const ref = refs->at(i);
+    ref->GetSerializer()->Materialize(ref);
+    uhdm_handle handle(ref->UhdmType(), ref);
+    listenAny(reinterpret_cast<vpiHandle>(&handle));
+  }
+}
+
 void VpiListener::listenDesigns(const std::vector<vpiHandle>& designs) {
   for (auto design_h : designs) {
     currentDesign_ = (design*) ((const uhdm_handle*)design_h)->object;
     listenAny(design_h);
   }
 }
+
+// Relations are resolved and vectors indexed only when the walk reaches
+// them, as the recursion does, so callbacks see the same model. The
+// handles are rebuilt on the stack for each callback.
+void VpiListener::walk_(vpiHandle handle, bool typed) {
+  // Callbacks may start walks of their own, above this one on the stack.
+  const size_t bottom = workstack.size();
+  work_t& first = workstack.emplace_back();
+  first.object = (const any*)((const uhdm_handle*)handle)->object;
+  first.handle = handle;
+  first.type = ((const uhdm_handle*)handle)->type;
+  first.kind = typed ? work_t::kind_t::Typed : work_t::kind_t::Any;
+
+  while (workstack.size() > bottom) {
+    const work_t work = workstack.back();
+    workstack.pop_back();
+    switch (work.kind) {
+      case work_t::kind_t::Any:
+      case work_t::kind_t::Typed: {
+        uhdm_handle stackHandle(work.type, work.object);
+        vpiHandle const handle = (work.handle != nullptr)
+            ? work.handle : reinterpret_cast<vpiHandle>(&stackHandle);
+        const bool anyCallbacks = (work.kind == work_t::kind_t::Any) &&
+                                  !visited.contains(work.object);
+        if (anyCallbacks) enterAny(work.object, handle);
+        callstack.push_back(work.object);
+        if (!enterTyped_(work.object, handle)) {
+          callstack.pop_back();
+          if (anyCallbacks) leaveAny(work.object, handle);
+          break;
+        }
+        work_t& leave = workstack.emplace_back(work);
+        leave.kind = work_t::kind_t::Leave;
+        leave.leaveAny = anyCallbacks;
+        if (visited.insert(work.object).second) {
+          work_t& relations = workstack.emplace_back();
+          relations.object = work.object;
+          relations.type = work.type;
+          relations.kind = work_t::kind_t::Relations;
+        }
+      } break;
+      case work_t::kind_t::Leave: {
+        uhdm_handle stackHandle(work.type, work.object);
+        vpiHandle const handle = (work.handle != nullptr)
+            ? work.handle : reinterpret_cast<vpiHandle>(&stackHandle);
+        leaveTyped_(work.object, handle);
+        callstack.pop_back();
+        if (work.leaveAny) leaveAny(work.object, handle);
+      } break;
+      case work_t::kind_t::Relations: {
+        // The next relation goes below the work of this one.
+        work_t& next = workstack.emplace_back(work);
+        ++next.step;
+        if (!stepAny_(work.object, work.type, work.step)) workstack.pop_back();
+      } break;
+      case work_t::kind_t::Elements: {
+        // Indexed, as vpi_scan() is, since listeners may grow the vector.
+        if (work.step < work.vector->size()) {
+          work_t& next = workstack.emplace_back(work);
+          ++next.step;
+          const any* const ref = work.vector->at(work.step);
+          ref->GetSerializer()->Materialize(ref);
+          work_t& element = workstack.emplace_back();
+          element.object = ref;
+          element.type = ref->UhdmType();
+        }
+      } break;
+      case work_t::kind_t::EndIgnoreLastInstance: {
+        ignoreLastInstance(false);
+      } break;
+      case work_t::kind_t::EndUhdmAllIterator: {
+        uhdmAllIterator = false;
+        visited.clear();
+        visited.emplace(work.object);
+      } break;
+    }
+  }
+}
+
+void VpiListener::pushRelation_(const any* const object, int32_t relation) {
+  auto [ref, ignored1, ignored2] = object->GetByVpiType(relation);
+  if (ref == nullptr) return;
+  ref->GetSerializer()->Materialize(ref);
+  work_t& work = workstack.emplace_back();
+  work.object = ref;
+  work.type = ref->UhdmType();
+}
+
+void VpiListener::pushRelations_(const any* const object, int32_t relation) {
+  auto [ignored, refType, refs] = object->GetByVpiType(relation);
+  if (refs == nullptr) return;
+  work_t& work = workstack.emplace_back();
+  work.object = object;
+  work.vector = refs;
+  work.kind = work_t::kind_t::Elements;
+}
+
+void VpiListener::pushEnd_(const any* const object, work_t::kind_t kind) {
+  work_t& work = workstack.emplace_back();
+  work.object = object;
+  work.kind = kind;
+}
+
+bool VpiListener::enterTyped_(const any* const object, vpiHandle handle) {
+  switch (((const uhdm_handle*)handle)->type) {
+<VPI_ENTER_TYPED_IMPLEMENTATION>
+    default: break;
+  }
+  return false;
+}
+
+void VpiListener::leaveTyped_(const any* const object, vpiHandle handle) {
+  switch (((const uhdm_handle*)handle)->type) {
+<VPI_LEAVE_TYPED_IMPLEMENTATION>
+    default: break;
+  }
+}
+
+bool VpiListener::stepAny_(const any* const object, UHDM_OBJECT_TYPE type,
+                           uint32_t step) {
+  switch (type) {
+<VPI_STEP_ANY_IMPLEMENTATION>
+    default: break;
+  }
+  return false;
+}
+
+<VPI_PRIVATE_STEP_IMPLEMENTATIONS>
+
+<VPI_REACHABILITY_TABLE>
 }  // namespace UHDM
@@ -27,24 +27,48 @@
 #ifndef UHDM_VPILISTENER_H
 #define UHDM_VPILISTENER_H
 
+#include <uhdm/VisitedSet.h>
 #include <uhdm/containers.h>
 #include <uhdm/vpi_user.h>
 
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
 namespace UHDM {
 class VpiListener {
 protected:
   typedef std::vector<const any *> any_stack_t;
 
-  VisitedContainer visited;
+  VisitedSet visited;
   any_stack_t callstack;
+  bool iterative_ = false;
 
 public:
-  // Use implicit constructor to initialize all members
-  // VpiListener()
+  explicit VpiListener(VisitedSet::Kind visitedKind = VisitedSet::Kind::Ordered)
+      : visited(visitedKind) {}
 
   virtual ~VpiListener() = default;
 
 public:
+  const VisitedSet &getVisited() const { return visited; }
+
+  // In the iterative mode, the listenXxx() functions walk the objects with
+  // an explicit stack instead of recursing, in the same order and with the
+  // same callbacks, so deep models don't need a deep native stack.
+  bool isIterative() const { return iterative_; }
+  void setIterative(bool iterative) { iterative_ = iterative; }
+
+  // Restricts the walk to the relations that can lead to objects of the
+  // given types, according to the models, empty to walk them all. Listeners
+  // overriding a few callbacks name their types to skip the rest of the
+  // model. Relations to objects of other types, or objects reached through
+  // them, are walked only on the way to the given types.
+  void setTypeFilter(const std::unordered_set<UHDM_OBJECT_TYPE>& types);
+  // Whether the walk can go from an object of type from to one of type to.
+  // Classes and groups stand for all their object types.
+  static bool canReach(UHDM_OBJECT_TYPE from, UHDM_OBJECT_TYPE to);
+
   void listenAny(vpiHandle handle);
   void listenDesigns(const std::vector<vpiHandle>& designs);
 <VPI_PUBLIC_LISTEN_DECLARATIONS>
@@ -61,7 +85,50 @@ protected:
   bool uhdmAllIterator = false;
   design* currentDesign_ = nullptr;
 private:
+  bool isRelevant_(UHDM_OBJECT_TYPE type) const {
+    return relevant_.empty() || relevant_[static_cast<uint32_t>(type)];
+  }
+
+  std::vector<bool> relevant_;  // By type, empty without a type filter
+
+  // Relations are walked with handles on the stack rather than through
+  // vpi_handle()/vpi_iterate(), the handles given to the enter/leave
+  // callbacks are only valid for the duration of the callback.
+  void listenRelation_(const any* const object, int32_t relation);
+  void listenRelations_(const any* const object, int32_t relation);
 <VPI_PRIVATE_LISTEN_DECLARATIONS>
+
+  // Pending work of the iterative walk.
+  struct work_t {
+    enum class kind_t : uint8_t {
+      Any,                     // listenAny(handle)
+      Typed,                   // listenXxx(handle)
+      Leave,                   // leaveXxx(), then leaveAny() if flagged
+      Relations,               // Relation number step, then the next ones
+      Elements,                // Element number step, then the next ones
+      EndIgnoreLastInstance,   // ignoreLastInstance(false)
+      EndUhdmAllIterator,      // End of the uhdmallXxx relation of object
+    };
+    const any* object = nullptr;
+    vpiHandle handle = nullptr;  // Given by the caller, for the first one
+    const RelationVector<const any>* vector = nullptr;
+    uint32_t step = 0;
+    UHDM_OBJECT_TYPE type = static_cast<UHDM_OBJECT_TYPE>(0);  // Of the handle
+    kind_t kind = kind_t::Any;
+    bool leaveAny = false;
+  };
+  typedef std::vector<work_t> work_stack_t;
+
+  work_stack_t workstack;
+
+  void walk_(vpiHandle handle, bool typed);
+  void pushRelation_(const any* const object, int32_t relation);
+  void pushRelations_(const any* const object, int32_t relation);
+  void pushEnd_(const any* const object, work_t::kind_t kind);
+  bool enterTyped_(const any* const object, vpiHandle handle);
+  void leaveTyped_(const any* const object, vpiHandle handle);
+  bool stepAny_(const any* const object, UHDM_OBJECT_TYPE type, uint32_t step);
+<VPI_PRIVATE_STEP_DECLARATIONS>
 };
 }  // namespace UHDM
 
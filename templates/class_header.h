@@ -40,6 +40,7 @@ namespace UHDM {
 
 class <CLASSNAME><FINAL_CLASS> : public <EXTENDS> {
   UHDM_IMPLEMENT_RTTI(<CLASSNAME>, <EXTENDS>)
+  friend Serializer;
 public:
   // Implicit constructor used to initialize all members,
   // comment: <CLASSNAME>();
@@ -60,7 +61,7 @@ private:
 typedef FactoryT<<CLASSNAME>> <CLASSNAME>Factory;
 <END_DISABLE_OBJECT_FACTORY>
 
-typedef FactoryT<std::vector<<CLASSNAME> *>> VectorOf<CLASSNAME>Factory;
+typedef FactoryT<RelationVector<<CLASSNAME>>> VectorOf<CLASSNAME>Factory;
 
 }  // namespace UHDM
 
@@ -39,7 +39,7 @@ typedef BaseClass any;
 
 <UHDM_FACTORIES_FORWARD_DECL>
 
-typedef FactoryT<std::vector<BaseClass*>> VectorOfanyFactory;
+typedef FactoryT<RelationVector<BaseClass>> VectorOfanyFactory;
 <UHDM_CONTAINER_FACTORIES_FORWARD_DECL>
 };
 
@@ -30,6 +30,11 @@
 #include <uhdm/vpi_user.h>
 #include <uhdm/uhdm_vpi_user.h>
 
+// Set by scripts/generate.py --compact-layout, see BaseClass.
+#define UHDM_COMPACT_LAYOUT <COMPACT_LAYOUT>
+// Set by scripts/generate.py --pooled-relations, see RelationPool.
+#define UHDM_POOLED_RELATIONS <POOLED_RELATIONS>
+
 namespace UHDM {
 class BaseClass;
 typedef BaseClass any;
@@ -29,6 +29,8 @@
 
 #include <uhdm/uhdm_types.h>
 
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <string_view>
 
@@ -37,12 +39,17 @@ namespace UHDM {
   class design;
 };
 
+class uhdm_handleFactory;
+
 struct uhdm_handle {
-  uhdm_handle(UHDM::UHDM_OBJECT_TYPE type, const void* object) :
-    type(type), object(object), index(0) {}
+  uhdm_handle(UHDM::UHDM_OBJECT_TYPE type, const void* object,
+              uhdm_handleFactory* factory = nullptr) :
+    type(type), object(object), index(0), factory(factory) {}
   const UHDM::UHDM_OBJECT_TYPE type;
   const void* object;
   uint32_t index;
+  // That made the handle on the heap, nullptr for the ones on the stack.
+  uhdm_handleFactory* const factory;
 };
 
 class uhdm_handleFactory {
@@ -50,15 +57,32 @@ class uhdm_handleFactory {
 
  public:
   vpiHandle Make(UHDM::UHDM_OBJECT_TYPE type, const void* object) {
-    return (vpiHandle) new uhdm_handle(type, object);
+    madeCount_.fetch_add(1, std::memory_order_relaxed);
+    liveCount_.fetch_add(1, std::memory_order_relaxed);
+    return (vpiHandle) new uhdm_handle(type, object, this);
   }
 
   bool Erase(vpiHandle handle) {
+    liveCount_.fetch_sub(1, std::memory_order_relaxed);
     delete (uhdm_handle*)handle;
     return true;
   }
 
   void Purge() {}
+
+  // Handles made so far, released or not.
+  uint64_t MadeCount() const {
+    return madeCount_.load(std::memory_order_relaxed);
+  }
+
+  // Handles made and not released yet.
+  uint64_t LiveCount() const {
+    return liveCount_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<uint64_t> madeCount_{0};
+  std::atomic<uint64_t> liveCount_{0};
 };
 
 /** Obtain a vpiHandle from a BaseClass (any) object */
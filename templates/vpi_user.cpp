@@ -219,12 +219,7 @@ std::string VpiDelay2String(const s_vpi_delay* delay) {
 }
 
 vpiHandle NewVpiHandle(const UHDM::BaseClass* object) {
-  return reinterpret_cast<vpiHandle>(
-      new uhdm_handle(object->UhdmType(), object));
-}
-
-static vpiHandle NewHandle(UHDM_OBJECT_TYPE type, const void* object) {
-  return reinterpret_cast<vpiHandle>(new uhdm_handle(type, object));
+  return object->GetSerializer()->MakeUhdmHandle(object->UhdmType(), object);
 }
 
 vpiHandle vpi_handle_by_index(vpiHandle object, PLI_INT32 indx) { return 0; }
@@ -244,7 +239,7 @@ vpiHandle vpi_handle(PLI_INT32 type, vpiHandle refHandle) {
   const uhdm_handle* const handle = (const uhdm_handle*)refHandle;
   const BaseClass* const object = (const BaseClass*)handle->object;
   auto [ref, ignored1, ignored2] = object->GetByVpiType(type);
-  return (ref != nullptr) ? NewHandle(ref->UhdmType(), ref) : nullptr;
+  return (ref != nullptr) ? NewVpiHandle(ref) : nullptr;
 }
 
 vpiHandle vpi_handle_multi(PLI_INT32 type, vpiHandle refHandle1,
@@ -258,7 +253,9 @@ vpiHandle vpi_iterate(PLI_INT32 type, vpiHandle refHandle) {
   const uhdm_handle* const handle = (const uhdm_handle*)refHandle;
   const BaseClass* const object = (const BaseClass*)handle->object;
   auto [ignored, refType, refVector] = object->GetByVpiType(type);
-  return (refVector != nullptr) ? NewHandle(refType, refVector) : nullptr;
+  return (refVector != nullptr)
+             ? object->GetSerializer()->MakeUhdmIterator(refType, refVector)
+             : nullptr;
 }
 
 PLI_INT32 vpi_compare_objects(vpiHandle handle1, vpiHandle handle2) {
@@ -276,13 +273,12 @@ PLI_INT32 vpi_compare_objects(vpiHandle handle1, vpiHandle handle2) {
 vpiHandle vpi_scan(vpiHandle iterator) {
   if (!iterator) return 0;
   uhdm_handle* handle = (uhdm_handle*)iterator;
-  const std::vector<const BaseClass*>* vect =
-      (const std::vector<const BaseClass*>*)handle->object;
+  const RelationVector<const BaseClass>* vect =
+      (const RelationVector<const BaseClass>*)handle->object;
   if (handle->index < vect->size()) {
     const BaseClass* const object = vect->at(handle->index);
-    uhdm_handle* h = new uhdm_handle(object->UhdmType(), object);
     ++handle->index;
-    return (vpiHandle) h;
+    return NewVpiHandle(object);
   }
   return nullptr;
 }
@@ -292,7 +288,12 @@ PLI_INT32 vpi_free_object(vpiHandle object) {
 }
 
 PLI_INT32 vpi_release_handle(vpiHandle object) {
-  delete (uhdm_handle*)object;
+  uhdm_handle* const handle = (uhdm_handle*)object;
+  if ((handle != nullptr) && (handle->factory != nullptr)) {
+    handle->factory->Erase(object);
+  } else {
+    delete handle;
+  }
   return 0;
 }
 
@@ -0,0 +1,91 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "uhdm/BlockCodec.h"
+
+namespace UHDM {
+namespace {
+std::string Roundtrip(BlockCodec::Codec codec, const std::string& input,
+                      size_t* compressedSize = nullptr) {
+  std::vector<char> compressed;
+  BlockCodec::Compress(codec, input.data(), input.size(), &compressed);
+  if (compressedSize != nullptr) *compressedSize = compressed.size();
+
+  std::string output(input.size(), '\0');
+  EXPECT_TRUE(BlockCodec::Decompress(codec, compressed.data(),
+                                     compressed.size(), output.data(),
+                                     output.size()));
+  return output;
+}
+
+TEST(BlockCodecTest, LzRoundtrip) {
+  EXPECT_EQ(Roundtrip(BlockCodec::Codec::kLz, ""), "");
+  EXPECT_EQ(Roundtrip(BlockCodec::Codec::kLz, "abc"), "abc");
+
+  // Long literal runs and long, overlapping matches use extra length bytes.
+  std::string input;
+  for (uint32_t i = 0; i < 1000; ++i) input += static_cast<char>(i * 7919);
+  input += std::string(5000, 'x');
+  for (uint32_t i = 0; i < 200; ++i) input += "module_inst work@top.u" + std::to_string(i);
+
+  size_t compressedSize = 0;
+  EXPECT_EQ(Roundtrip(BlockCodec::Codec::kLz, input, &compressedSize), input);
+  EXPECT_LT(compressedSize, input.size() / 2);
+
+  EXPECT_EQ(Roundtrip(BlockCodec::Codec::kNone, input), input);
+}
+
+TEST(BlockCodecTest, LzRejectsCorruptInput) {
+  const std::string input(1000, 'a');
+  std::vector<char> compressed;
+  BlockCodec::Compress(BlockCodec::Codec::kLz, input.data(), input.size(),
+                       &compressed);
+
+  std::string output(input.size(), '\0');
+  EXPECT_FALSE(BlockCodec::Decompress(BlockCodec::Codec::kLz, compressed.data(),
+                                      compressed.size(), output.data(),
+                                      output.size() - 1));
+  EXPECT_FALSE(BlockCodec::Decompress(BlockCodec::Codec::kLz, compressed.data(),
+                                      compressed.size() / 2, output.data(),
+                                      output.size()));
+}
+
+TEST(BlockCodecTest, HeaderIsLittleEndian) {
+  BlockCodec::FileHeader header = {};
+  header.m_codec = 1;
+  header.m_blockCount = 0x01020304;
+  header.m_rawSize = 0x0102030405060708;
+  BlockCodec::ConvertByteOrder(&header);
+
+  const unsigned char* const bytes =
+      reinterpret_cast<const unsigned char*>(&header);
+  EXPECT_EQ(bytes[8], 1);
+  EXPECT_EQ(bytes[12], 0x04);
+  EXPECT_EQ(bytes[15], 0x01);
+  EXPECT_EQ(bytes[16], 0x08);
+  EXPECT_EQ(bytes[23], 0x01);
+
+  BlockCodec::ConvertByteOrder(&header);
+  EXPECT_EQ(header.m_codec, 1u);
+  EXPECT_EQ(header.m_blockCount, 0x01020304u);
+  EXPECT_EQ(header.m_rawSize, 0x0102030405060708u);
+}
+}  // namespace
+}  // namespace UHDM
@@ -1,10 +1,15 @@
 // -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <string>
 
 #include "gtest/gtest.h"
 #include "test_util.h"
 #include "uhdm/ElaboratorListener.h"
 #include "uhdm/VpiListener.h"
+#include "uhdm/clone_tree.h"
 #include "uhdm/uhdm.h"
 #include "uhdm/vpi_visitor.h"
 
@@ -127,3 +132,405 @@ TEST(ClassesTest, DesignSaveRestoreRoundtrip) {
   const std::string elaborated = designs_to_string(restoredDesigns);
   EXPECT_NE(restored, elaborated);  // Elaboration should've done _something_
 }
+
+// A save and restore of build_designs() in one of the formats, with the
+// options the format is restored with.
+struct RoundtripCase {
+  const char* m_name;
+  Serializer::SaveFormat m_format = Serializer::SaveFormat::kPacked;
+  BlockCodec::Codec m_codec = BlockCodec::Codec::kLz;
+  uint32_t m_saveThreads = 1;
+  uint32_t m_restoreThreads = 1;
+  bool m_lazy = false;
+  bool m_mapped = false;   // RestoreMapped() instead of Restore()
+  bool m_sharded = false;  // SaveShards()/RestoreShards() instead
+};
+
+static std::string file_header(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary);
+  std::string header(8, '\0');
+  file.read(header.data(), header.size());
+  return header;
+}
+
+class ClassesRoundtripTest : public testing::TestWithParam<RoundtripCase> {};
+
+TEST_P(ClassesRoundtripTest, DesignSaveRestore) {
+  const RoundtripCase& param = GetParam();
+  Serializer serializer;
+  const std::vector<vpiHandle>& designs = build_designs(&serializer);
+  const std::string before = designs_to_string(designs);
+
+  serializer.SetSaveFormat(param.m_format);
+  serializer.SetCompressionCodec(param.m_codec);
+  serializer.SetThreadCount(param.m_saveThreads);
+  const std::string name = std::string("classes_roundtrip_") + param.m_name;
+  const std::filesystem::path path =
+      std::filesystem::path(testing::TempDir()) / name;
+  if (param.m_sharded) {
+    serializer.SaveShards(path);
+    // The design in shard 0, the top module and its classes in shard 1.
+    std::ifstream manifest(path / Serializer::kShardManifest);
+    std::string line;
+    uint32_t shardCount = 0;
+    while (std::getline(manifest, line)) ++shardCount;
+    EXPECT_EQ(shardCount, 2u);
+  } else {
+    serializer.Save(path);
+    const std::string header = file_header(path.string());
+    switch (param.m_format) {
+      case Serializer::SaveFormat::kPacked:
+        EXPECT_NE(header.substr(0, 4), "UHDM");
+        break;
+      case Serializer::SaveFormat::kFlat:
+        EXPECT_EQ(header, "UHDMFLAT");
+        break;
+      case Serializer::SaveFormat::kCompressed:
+        EXPECT_EQ(header, "UHDMBLKZ");
+        break;
+      case Serializer::SaveFormat::kStreamed:
+        EXPECT_EQ(header, "UHDMSTRM");
+        break;
+    }
+  }
+
+  uint32_t eagerRestores = 0;
+  serializer.SetErrorHandler([&eagerRestores](ErrorType type, const std::string&,
+                                              const any*, const any*) {
+    if (type == ErrorType::UHDM_UNSUPPORTED_LAZY_RESTORE) ++eagerRestores;
+  });
+  serializer.SetThreadCount(param.m_restoreThreads);
+  serializer.SetLazyRestoreEnabled(param.m_lazy);
+  const std::vector<vpiHandle>& restoredDesigns =
+      param.m_sharded  ? serializer.RestoreShards(path, {"M1"})
+      : param.m_mapped ? serializer.RestoreMapped(path)
+                       : serializer.Restore(path);
+  EXPECT_EQ(serializer.ObjectStats()["design"], 1u);
+  // Streamed files and shards are always restored eagerly.
+  const bool lazy = param.m_lazy && !param.m_sharded &&
+                    (param.m_format != Serializer::SaveFormat::kStreamed);
+  EXPECT_EQ(serializer.ObjectStats()["function"], lazy ? 0u : 3u);
+  EXPECT_EQ(eagerRestores, (param.m_lazy && !lazy) ? 1u : 0u);
+
+  // Walking through vpi handles reads the objects on demand.
+  EXPECT_EQ(before, designs_to_string(restoredDesigns));
+
+  serializer.MaterializeAll();
+  EXPECT_EQ(serializer.ObjectStats()["function"], 3u);
+
+  if (param.m_sharded) {
+    // Without its shard, the top module is dropped from the design.
+    const std::vector<vpiHandle>& restored = serializer.RestoreShards(path, {});
+    ASSERT_EQ(restored.size(), 1u);
+    const design* d = UhdmDesignFromVpiHandle(restored[0]);
+    EXPECT_EQ(d->VpiName(), "design1");
+    ASSERT_NE(d->TopModules(), nullptr);
+    EXPECT_TRUE(d->TopModules()->empty());
+    EXPECT_EQ(serializer.ObjectStats()["module_inst"], 0u);
+    EXPECT_EQ(serializer.ObjectStats()["class_defn"], 0u);
+  }
+}
+
+using Format = Serializer::SaveFormat;
+INSTANTIATE_TEST_SUITE_P(
+    ClassesTest, ClassesRoundtripTest,
+    testing::Values(
+        RoundtripCase{"packed_lazy", Format::kPacked, BlockCodec::Codec::kLz,
+                      1, 1, true},
+        RoundtripCase{"packed_parallel_restore", Format::kPacked,
+                      BlockCodec::Codec::kLz, 1, 4},
+        RoundtripCase{"packed_parallel_save", Format::kPacked,
+                      BlockCodec::Codec::kLz, 4, 1},
+        RoundtripCase{"flat", Format::kFlat},
+        RoundtripCase{"flat_mapped", Format::kFlat, BlockCodec::Codec::kLz, 1,
+                      1, false, true},
+        RoundtripCase{"flat_mapped_lazy", Format::kFlat,
+                      BlockCodec::Codec::kLz, 1, 1, true, true},
+        RoundtripCase{"compressed", Format::kCompressed,
+                      BlockCodec::Codec::kLz, 2, 2},
+        // RestoreMapped() falls back to decompressing.
+        RoundtripCase{"compressed_mapped", Format::kCompressed,
+                      BlockCodec::Codec::kLz, 1, 1, false, true},
+        RoundtripCase{"compressed_none", Format::kCompressed,
+                      BlockCodec::Codec::kNone},
+        RoundtripCase{"streamed", Format::kStreamed},
+        RoundtripCase{"streamed_mapped_lazy", Format::kStreamed,
+                      BlockCodec::Codec::kLz, 2, 2, true, true},
+        RoundtripCase{"sharded", Format::kPacked, BlockCodec::Codec::kLz, 1,
+                      1, false, false, true},
+        RoundtripCase{"sharded_lazy", Format::kFlat, BlockCodec::Codec::kLz,
+                      1, 1, true, false, true}),
+    [](const testing::TestParamInfo<RoundtripCase>& info) {
+      return std::string(info.param.m_name);
+    });
+
+TEST(ClassesTest, LazyRestoreKeepsIdsAndOrder) {
+  Serializer serializer;
+  build_designs(&serializer);
+  const std::string path = testing::TempDir() + "/classes_lazy_order.uhdm";
+  serializer.Save(path);
+
+  // The objects in factory order, then one made after the restore.
+  auto ids = [](Serializer* restored) {
+    std::vector<std::pair<UHDM_OBJECT_TYPE, uint32_t>> ids;
+    for (const auto& entry : restored->AllObjects()) {
+      ids.emplace_back(entry.first->UhdmType(), entry.first->UhdmId());
+    }
+    ids.emplace_back(uhdmmodule_inst, restored->MakeModule_inst()->UhdmId());
+    return ids;
+  };
+  Serializer eager;
+  for (vpiHandle d : eager.Restore(path)) vpi_release_handle(d);
+
+  Serializer lazy;
+  lazy.SetLazyRestoreEnabled(true);
+  const std::vector<vpiHandle> designs = lazy.Restore(path);
+  // Objects are reached in walk order, not in file order.
+  designs_to_string(designs);
+  for (vpiHandle d : designs) vpi_release_handle(d);
+  EXPECT_EQ(ids(&lazy), ids(&eager));
+}
+
+TEST(ClassesTest, LazyRestoreAccessorChains) {
+  Serializer serializer;
+  build_designs(&serializer);
+  const std::string path = testing::TempDir() + "/classes_lazy_chains.uhdm";
+  serializer.Save(path);
+
+  Serializer lazy;
+  lazy.SetLazyRestoreEnabled(true);
+  const std::vector<vpiHandle> designs = lazy.Restore(path);
+  ASSERT_EQ(designs.size(), 1u);
+  const design* const d = UhdmDesignFromVpiHandle(designs[0]);
+  // Several relations away from the design, through plain accessors only.
+  const class_defn* const child = d->TopModules()->at(0)->Class_defns()->at(1);
+  EXPECT_EQ(child->VpiName(), "Child");
+  const class_defn* const base =
+      child->Extends()->Class_typespec()->Actual_typespec<class_typespec>()->Class_defn();
+  EXPECT_EQ(base->VpiName(), "Base");
+  EXPECT_EQ(base->Task_funcs()->at(1)->VpiName(), "f2");
+  EXPECT_EQ(base->VpiParent<module_inst>()->VpiDefName(), "M1");
+  for (vpiHandle h : designs) vpi_release_handle(h);
+}
+
+TEST(ClassesTest, ObjectIndexFollowsErase) {
+  Serializer serializer;
+  module_inst* m1 = serializer.MakeModule_inst();
+  module_inst* m2 = serializer.MakeModule_inst();
+  module_inst* m3 = serializer.MakeModule_inst();
+  EXPECT_EQ(m1->UhdmIndex(), 0u);
+  EXPECT_EQ(m3->UhdmIndex(), 2u);
+
+  // Erasing leaves a tombstone, compacting renumbers.
+  EXPECT_TRUE(serializer.Erase(m2));
+  EXPECT_EQ(m3->UhdmIndex(), 2u);
+  EXPECT_EQ(serializer.ObjectStats()["module_inst"], 2u);
+
+  serializer.Compact();
+  EXPECT_EQ(m3->UhdmIndex(), 1u);
+
+  const Serializer::IdMap idMap = serializer.AllObjects();
+  ASSERT_EQ(idMap.size(), 2u);
+  EXPECT_EQ(idMap[1].first, m3);
+  EXPECT_EQ(idMap[1].second, 2u);
+}
+
+TEST(ClassesTest, CloneKeepsItsOwnIndex) {
+  Serializer serializer;
+  design* d = serializer.MakeDesign();
+  d->VpiName("design1");
+  module_inst* m1 = serializer.MakeModule_inst();
+  m1->VpiName("m1");
+  m1->VpiParent(d);
+  VectorOfmodule_inst* modules = serializer.MakeModule_instVec();
+  modules->push_back(m1);
+  d->AllModules(modules);
+
+  ElaboratorContext context(&serializer);
+  module_inst* clone = any_cast<module_inst*>(clone_tree(m1, &context));
+  ASSERT_NE(clone, nullptr);
+  EXPECT_EQ(m1->UhdmIndex(), 0u);
+  EXPECT_EQ(clone->UhdmIndex(), 1u);
+  EXPECT_EQ(clone->VpiName(), "m1");
+
+  // Erasing the clone leaves the source in its factory, and saved.
+  EXPECT_TRUE(serializer.Erase(clone));
+  EXPECT_EQ(m1->UhdmIndex(), 0u);
+  const std::string filename = testing::TempDir() + "/classes_clone_test.uhdm";
+  serializer.Save(filename);
+  const std::vector<vpiHandle>& restoredDesigns = serializer.Restore(filename);
+  ASSERT_EQ(restoredDesigns.size(), 1u);
+  vpiHandle itr = vpi_iterate(uhdmallModules, restoredDesigns[0]);
+  ASSERT_NE(itr, nullptr);
+  vpiHandle module = vpi_scan(itr);
+  ASSERT_NE(module, nullptr);
+  EXPECT_STREQ(vpi_get_str(vpiName, module), "m1");
+  vpi_release_handle(module);
+  EXPECT_EQ(vpi_scan(itr), nullptr);
+}
+
+// Holds in the default and in the compact layout.
+TEST(ClassesTest, ObjectLayout) {
+  Serializer serializer;
+  module_inst* m1 = serializer.MakeModule_inst();
+  module_inst* m2 = serializer.MakeModule_inst();
+  m1->VpiFile("fake1.sv");
+  m1->VpiLineNo(10);
+  m1->VpiColumnNo(3);
+  m1->VpiEndLineNo(12);
+  m1->VpiEndColumnNo(7);
+  m2->VpiFile("fake1.sv");
+  m2->VpiLineNo(10);
+  EXPECT_EQ(m1->GetSerializer(), &serializer);
+  EXPECT_EQ(m1->VpiFile(), "fake1.sv");
+  EXPECT_EQ(m1->VpiLineNo(), 10u);
+  EXPECT_EQ(m1->VpiColumnNo(), 3u);
+  EXPECT_EQ(m1->VpiEndLineNo(), 12u);
+  EXPECT_EQ(m1->VpiEndColumnNo(), 7u);
+  EXPECT_EQ(m2->VpiColumnNo(), 0u);
+
+  // Relations of card any and client data are independent of each other.
+  ClientData data;
+  VectorOfport* ports = serializer.MakePortVec();
+  VectorOfnet* nets = serializer.MakeNetVec();
+  EXPECT_EQ(m1->Ports(), nullptr);
+  m1->Ports(ports);
+  m1->Data(&data);
+  m1->Nets(nets);
+  EXPECT_EQ(m1->Ports(), ports);
+  EXPECT_EQ(m1->Nets(), nets);
+  EXPECT_EQ(m1->Data(), &data);
+  EXPECT_EQ(m2->Ports(), nullptr);
+  m1->Ports(nullptr);
+  EXPECT_EQ(m1->Ports(), nullptr);
+  EXPECT_EQ(m1->Nets(), nets);
+  EXPECT_EQ(m1->Data(), &data);
+  m1->Data(nullptr);
+
+  // A clone keeps its own place in its factory.
+  begin* b1 = serializer.MakeBegin();
+  b1->VpiLineNo(20);
+  b1->Stmts(serializer.MakeAnyVec());
+  ElaboratorContext* elaboratorContext =
+      new ElaboratorContext(&serializer, true);
+  begin* b2 = b1->DeepClone(nullptr, elaboratorContext);
+  delete elaboratorContext;
+  EXPECT_EQ(b1->UhdmIndex(), 0u);
+  EXPECT_EQ(b2->UhdmIndex(), 1u);
+  EXPECT_EQ(b2->VpiLineNo(), 20u);
+  EXPECT_NE(b2->Stmts(), b1->Stmts());
+  EXPECT_TRUE(serializer.Erase(b2));
+  EXPECT_EQ(serializer.ObjectStats()["begin"], 1u);
+
+  std::ostringstream stats;
+  serializer.PrintStats(stats, "layout");
+  EXPECT_NE(stats.str().find("bytes/obj"), std::string::npos);
+}
+
+TEST(ClassesTest, MemoryStats) {
+  Serializer serializer;
+  module_inst* m = serializer.MakeModule_inst();
+  m->VpiName("top");
+  VectorOfport* ports = serializer.MakePortVec();
+  ports->reserve(4);
+  ports->push_back(serializer.MakePort());
+  m->Ports(ports);
+
+  const Serializer::MemoryUsages stats = serializer.MemoryStats();
+  const Serializer::MemoryUsage& modules = stats.m_objects.at("module_inst");
+  EXPECT_EQ(modules.m_count, 1u);
+  EXPECT_GE(modules.m_usedBytes, sizeof(module_inst));
+  EXPECT_GE(modules.m_bytes, modules.m_usedBytes);
+  const Serializer::MemoryUsage& relations = stats.m_relations.at("port");
+  EXPECT_EQ(relations.m_count, 1u);
+  EXPECT_GE(relations.m_bytes, relations.m_usedBytes + 3 * sizeof(port*));
+  EXPECT_GE(stats.m_symbols.m_count, 2u);
+  EXPECT_GT(stats.m_symbols.m_usedBytes, 0u);
+  EXPECT_EQ(stats.m_objects.count("begin"), 0u);
+  EXPECT_EQ(stats.m_handles.m_count, 0u);
+
+  // Handles count until they are released, stack ones not at all.
+  vpiHandle module = serializer.MakeUhdmHandle(uhdmmodule_inst, m);
+  vpiHandle iterator = vpi_iterate(vpiPort, module);
+  uhdm_handle onStack(uhdmmodule_inst, m);
+  vpiHandle port = vpi_scan(iterator);
+  const Serializer::MemoryUsage handles = serializer.MemoryStats().m_handles;
+  EXPECT_EQ(handles.m_count, 3u);
+  EXPECT_EQ(handles.m_bytes, 3 * sizeof(uhdm_handle));
+  vpi_release_handle(port);
+  vpi_release_handle(iterator);
+  EXPECT_EQ(serializer.MemoryStats().m_handles.m_count, 1u);
+
+  std::ostringstream memstats;
+  serializer.PrintMemoryStats(memstats, "memory");
+  EXPECT_NE(memstats.str().find("VectorOfport"), std::string::npos);
+  EXPECT_NE(memstats.str().find("handles"), std::string::npos);
+  vpi_release_handle(module);
+  EXPECT_EQ(serializer.MemoryStats().m_handles.m_count, 0u);
+}
+
+TEST(ClassesTest, DesignDeltaSaveRestore) {
+  Serializer serializer;
+  build_designs(&serializer);
+  const std::string base = testing::TempDir() + "/classes_delta_base.uhdm";
+  const std::string delta = testing::TempDir() + "/classes_delta.uhdm";
+  serializer.Save(base);
+
+  // Edit the restored design: rename it, add a module and drop a class.
+  const std::vector<vpiHandle>& designs = serializer.Restore(base);
+  design* d = UhdmDesignFromVpiHandle(designs[0]);
+  d->VpiName("design2");
+  module_inst* m1 = d->TopModules()->front();
+  module_inst* m2 = serializer.MakeModule_inst();
+  m2->VpiDefName("M2");
+  m2->VpiParent(d);
+  d->TopModules()->push_back(m2);
+  m1->Class_defns()->pop_back();
+  m1->Class_defns()->front()->Deriveds()->clear();
+  const std::string after = designs_to_string(designs);
+
+  serializer.SaveDelta(base, delta);
+  EXPECT_LT(std::filesystem::file_size(delta),
+            std::filesystem::file_size(base));
+
+  EXPECT_EQ(after, designs_to_string(serializer.RestoreDelta(base, delta)));
+  EXPECT_EQ(serializer.ObjectStats()["module_inst"], 2u);
+  EXPECT_EQ(serializer.ObjectStats()["class_defn"], 1u);
+
+  // A delta doesn't restore on its own.
+  EXPECT_TRUE(serializer.Restore(delta).empty());
+}
+
+TEST(ClassesTest, DesignDeltaShiftedIds) {
+  Serializer serializer;
+  build_designs(&serializer);
+  const std::string base = testing::TempDir() + "/classes_delta_ids_base.uhdm";
+  const std::string delta = testing::TempDir() + "/classes_delta_ids.uhdm";
+  serializer.Save(base);
+
+  // The same design built again after other objects, so every UhdmId
+  // differs from the base, with one module changed.
+  Serializer rebuilt;
+  rebuilt.MakeConstant();
+  rebuilt.MakeConstant();
+  const std::vector<vpiHandle>& designs = build_designs(&rebuilt);
+  module_inst* m1 = UhdmDesignFromVpiHandle(designs[0])->AllModules()->front();
+  m1->VpiDefName("M3");
+  const std::string after = designs_to_string(designs);
+
+  rebuilt.SaveDelta(base, delta);
+  EXPECT_LT(std::filesystem::file_size(delta),
+            std::filesystem::file_size(base));
+
+  Serializer restored;
+  const std::vector<vpiHandle>& restoredDesigns =
+      restored.RestoreDelta(base, delta);
+  EXPECT_EQ(after, designs_to_string(restoredDesigns));
+  EXPECT_EQ(restored.ObjectStats(), rebuilt.ObjectStats());
+  const module_inst* r1 =
+      UhdmDesignFromVpiHandle(restoredDesigns[0])->AllModules()->front();
+  EXPECT_EQ(r1->VpiDefName(), "M3");
+  EXPECT_EQ(r1->UhdmId(), m1->UhdmId());
+  EXPECT_EQ(r1->Class_defns()->front()->UhdmId(),
+            m1->Class_defns()->front()->UhdmId());
+}
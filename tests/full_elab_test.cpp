@@ -221,3 +221,26 @@ TEST(FullElabTest, ElaborationRoundtrip) {
   const std::string after = designs_to_string(designs);
   EXPECT_NE(before, after);  // We expect the elaboration to have some impact :)
 }
+
+TEST(FullElabTest, IterativeElaboration) {
+  Serializer recursiveSerializer;
+  const std::vector<vpiHandle>& recursiveDesigns =
+      build_designs(&recursiveSerializer);
+  ElaboratorContext* recursiveContext =
+      new ElaboratorContext(&recursiveSerializer, true);
+  recursiveContext->m_elaborator.listenDesigns(recursiveDesigns);
+  delete recursiveContext;
+
+  Serializer iterativeSerializer;
+  const std::vector<vpiHandle>& iterativeDesigns =
+      build_designs(&iterativeSerializer);
+  ElaboratorContext* iterativeContext =
+      new ElaboratorContext(&iterativeSerializer, true);
+  iterativeContext->m_elaborator.setIterative(true);
+  iterativeContext->m_elaborator.listenDesigns(iterativeDesigns);
+  delete iterativeContext;
+
+  EXPECT_EQ(designs_to_string(iterativeDesigns),
+            designs_to_string(recursiveDesigns));
+  EXPECT_EQ(dumpStats(iterativeSerializer), dumpStats(recursiveSerializer));
+}
@@ -66,3 +66,61 @@ TEST(GarbageCollectTest, NoLeakExpectation) {
     vpi_release_handle(design);
   }
 }
+
+TEST(GarbageCollectTest, SweepUnreachable) {
+  Serializer serializer;
+  design* d = serializer.MakeDesign();
+  module_inst* m1 = serializer.MakeModule_inst();
+  module_inst* m2 = serializer.MakeModule_inst();
+  VectorOfmodule_inst* modules = serializer.MakeModule_instVec();
+  modules->push_back(m1);
+  modules->push_back(m2);
+  d->AllModules(modules);
+  serializer.MakeModule_inst();  // Unreachable
+
+  EXPECT_EQ(serializer.GarbageCollect(), sizeof(module_inst));
+  EXPECT_EQ(serializer.ObjectStats()["module_inst"], 2u);
+
+  // Objects that survived a collection are swept once unreachable, and the
+  // freed slots are reused without growing the slabs.
+  const size_t reserved =
+      serializer.MemoryStats().m_objects.at("module_inst").m_bytes;
+  modules->pop_back();
+  serializer.MakeModule_inst();
+  EXPECT_EQ(serializer.GarbageCollect(), 2 * sizeof(module_inst));
+  EXPECT_EQ(serializer.ObjectStats()["module_inst"], 1u);
+  serializer.MakeModule_inst();
+  EXPECT_EQ(serializer.MemoryStats().m_objects.at("module_inst").m_bytes,
+            reserved);
+}
+
+TEST(GarbageCollectTest, SymbolCompaction) {
+  Serializer serializer;
+  design* d = serializer.MakeDesign();
+  d->VpiName("design1");
+  module_inst* m1 = serializer.MakeModule_inst();
+  m1->VpiName("u1");
+  m1->VpiDefName("M1");
+  VectorOfmodule_inst* modules = serializer.MakeModule_instVec();
+  modules->push_back(m1);
+  d->AllModules(modules);
+  module_inst* m2 = serializer.MakeModule_inst();  // Unreachable
+  m2->VpiName("u2");
+  serializer.MakeSymbol("dead");
+
+  EXPECT_EQ(serializer.GarbageCollect(), sizeof(module_inst));
+  EXPECT_EQ(serializer.CompactSymbols(), 2u);
+  EXPECT_EQ(serializer.GetSymbolId("dead"), SymbolFactory::getBadId());
+  EXPECT_EQ(serializer.GetSymbolId("u2"), SymbolFactory::getBadId());
+  EXPECT_EQ(d->VpiName(), "design1");
+  EXPECT_EQ(m1->VpiName(), "u1");
+  EXPECT_EQ(m1->VpiDefName(), "M1");
+  EXPECT_EQ(serializer.GetSymbol(serializer.GetSymbolId("u1")), "u1");
+
+  // Nothing left to drop, symbols made afterwards get fresh ids.
+  EXPECT_EQ(serializer.CompactSymbols(), 0u);
+  m1->VpiName("u3");
+  EXPECT_EQ(m1->VpiName(), "u3");
+  EXPECT_EQ(serializer.CompactSymbols(), 1u);
+  EXPECT_EQ(m1->VpiName(), "u3");
+}
@@ -0,0 +1,83 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ Copyright 2022 The UHDM Team.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "uhdm/RelationPool.h"
+
+namespace UHDM {
+namespace {
+struct Element {};
+struct OtherElement {};
+
+TEST(RelationPoolTest, BuffersAreReused) {
+  RelationPool pool;
+  void* const first = pool.Allocate(3);
+  void* const second = pool.Allocate(3);
+  // Carved one after the other from the same chunk.
+  EXPECT_EQ(static_cast<void**>(second), static_cast<void**>(first) + 3);
+  EXPECT_EQ(pool.UsedBytes(), 6 * sizeof(void*));
+  pool.Deallocate(first, 3);
+  EXPECT_EQ(pool.Allocate(3), first);
+  // Rounded up to a power of two past the exact sizes.
+  void* const big = pool.Allocate(20);
+  pool.Deallocate(big, 20);
+  EXPECT_EQ(pool.Allocate(32), big);
+  EXPECT_GE(pool.ReservedBytes(), pool.UsedBytes());
+  // Too big for the pool.
+  void* const huge = pool.Allocate(RelationPool::kMaxPooledSize + 1);
+  EXPECT_EQ(pool.UsedBytes(), (6 + 32) * sizeof(void*));
+  pool.Deallocate(huge, RelationPool::kMaxPooledSize + 1);
+}
+
+TEST(RelationPoolTest, VectorGrows) {
+  RelationPool pool;
+  std::vector<Element*, RelationAllocator<Element*>> v{
+      RelationAllocator<Element*>(&pool)};
+  std::vector<Element> elements(100);
+  for (Element& element : elements) v.push_back(&element);
+  ASSERT_EQ(v.size(), elements.size());
+  for (size_t i = 0; i < elements.size(); ++i) EXPECT_EQ(v[i], &elements[i]);
+  EXPECT_GE(pool.UsedBytes(), v.capacity() * sizeof(Element*));
+
+  // Copies may outlive the pool, they come from the heap.
+  const std::vector<Element*, RelationAllocator<Element*>> copy(v);
+  EXPECT_EQ(copy.get_allocator().Pool(), nullptr);
+  EXPECT_EQ(copy, v);
+
+  v.clear();
+  v.shrink_to_fit();
+  EXPECT_TRUE(v.empty());
+  EXPECT_EQ(pool.UsedBytes(), 0u);
+}
+
+TEST(RelationPoolTest, MovesCarryThePool) {
+  RelationPool pool;
+  std::vector<Element*, RelationAllocator<Element*>> v{
+      RelationAllocator<Element*>(&pool)};
+  Element element;
+  v.push_back(&element);
+  std::vector<Element*, RelationAllocator<Element*>> moved;
+  moved = std::move(v);
+  EXPECT_EQ(moved.get_allocator().Pool(), &pool);
+  moved.clear();
+  moved.shrink_to_fit();
+  EXPECT_EQ(pool.UsedBytes(), 0u);
+}
+
+}  // namespace
+}  // namespace UHDM
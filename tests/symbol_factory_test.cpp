@@ -14,13 +14,16 @@
  limitations under the License.
 */
 
+#include <set>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "uhdm/SymbolFactory.h"
+#include "uhdm/uhdm.h"
 
 namespace UHDM {
 using testing::ElementsAre;
@@ -86,5 +89,133 @@ TEST(SymbolFactoryTest, SymbolStringsAreStable) {
   EXPECT_EQ(before_data, after_data);
 }
 
+TEST(SymbolFactoryTest, SymbolsAreNullTerminated) {
+  SymbolFactory table;
+  const SymbolId foo_id = table.Make("foo");
+  // Larger than an arena block.
+  const std::string large(3 << 20, 'x');
+  const SymbolId large_id = table.Make(large);
+  const SymbolId bar_id = table.Make("bar");
+  EXPECT_STREQ(table.GetSymbol(foo_id).data(), "foo");
+  EXPECT_STREQ(table.GetSymbol(bar_id).data(), "bar");
+  EXPECT_EQ(table.GetSymbol(large_id), large);
+  EXPECT_EQ(table.GetSymbol(large_id).data()[large.size()], '\0');
+
+  std::vector<uint64_t> pool((table.PoolSize() + 7) / 8);
+  table.WritePool(reinterpret_cast<char *>(pool.data()));
+  SymbolFactory adopted;
+  ASSERT_TRUE(adopted.AdoptPool(
+      nullptr, reinterpret_cast<const char *>(pool.data()), table.PoolSize()));
+  EXPECT_STREQ(adopted.GetSymbol(foo_id).data(), "foo");
+  EXPECT_STREQ(adopted.GetSymbol(bar_id).data(), "bar");
+  EXPECT_EQ(adopted.GetSymbol(large_id), large);
+}
+
+TEST(SymbolFactoryTest, PoolRoundtrip) {
+  SymbolFactory table;
+  const SymbolId foo_id = table.Make("foo");
+  const SymbolId bar_id = table.Make("bar");
+  for (int32_t i = 0; i < 100; ++i) table.Make("baz" + std::to_string(i));
+
+  std::vector<uint64_t> pool((table.PoolSize() + 7) / 8);
+  table.WritePool(reinterpret_cast<char *>(pool.data()));
+  EXPECT_EQ(SymbolFactory::PoolSymbolCount(
+                reinterpret_cast<const char *>(pool.data()), table.PoolSize()),
+            103u);
+  // Little endian whatever the host, the count comes first.
+  const uint8_t *const bytes = reinterpret_cast<const uint8_t *>(pool.data());
+  EXPECT_EQ(bytes[0], 103u);
+  EXPECT_EQ(bytes[7], 0u);
+
+  SymbolFactory adopted;
+  ASSERT_TRUE(adopted.AdoptPool(
+      nullptr, reinterpret_cast<const char *>(pool.data()), table.PoolSize()));
+  EXPECT_EQ(adopted.GetId("foo"), foo_id);
+  EXPECT_EQ(adopted.GetId("bar"), bar_id);
+  EXPECT_EQ(adopted.GetSymbol(foo_id), "foo");
+  EXPECT_EQ(adopted.GetId("baz42"), table.GetId("baz42"));
+  EXPECT_EQ(adopted.GetId("qux"), SymbolFactory::getBadId());
+  EXPECT_EQ(adopted.getSymbols(), table.getSymbols());
+
+  // Symbols made afterwards are numbered after the pool.
+  const SymbolId qux_id = adopted.Make("qux");
+  EXPECT_EQ((RawSymbolId)qux_id, 103u);
+  EXPECT_EQ(adopted.Make("foo"), foo_id);
+  EXPECT_EQ(adopted.GetSymbol(qux_id), "qux");
+
+  // A pool can only be adopted by an empty factory, and must be well formed.
+  EXPECT_FALSE(adopted.AdoptPool(
+      nullptr, reinterpret_cast<const char *>(pool.data()), table.PoolSize()));
+  SymbolFactory truncated;
+  EXPECT_FALSE(truncated.AdoptPool(
+      nullptr, reinterpret_cast<const char *>(pool.data()), 16));
+}
+
+TEST(SymbolFactoryTest, ConcurrentMake) {
+  SymbolFactory table;
+  const SymbolId foo_id = table.Make("foo");
+
+  // Every thread makes the same symbols, in a different order.
+  constexpr int32_t kThreads = 8;
+  constexpr int32_t kSymbols = 20000;
+  std::vector<std::vector<SymbolId>> ids(kThreads,
+                                         std::vector<SymbolId>(kSymbols));
+  std::vector<std::thread> threads;
+  for (int32_t t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&table, &ids, foo_id, t]() {
+      for (int32_t i = 0; i < kSymbols; ++i) {
+        const int32_t n = (t % 2) ? i : kSymbols - 1 - i;
+        ids[t][n] = table.Make("sym" + std::to_string(n));
+        EXPECT_EQ(table.GetSymbol(ids[t][n]), "sym" + std::to_string(n));
+        EXPECT_EQ(table.GetId("foo"), foo_id);
+      }
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+
+  // Each symbol got one id, and ids are dense.
+  std::set<RawSymbolId> unique;
+  for (int32_t n = 0; n < kSymbols; ++n) {
+    for (int32_t t = 1; t < kThreads; ++t) EXPECT_EQ(ids[t][n], ids[0][n]);
+    unique.insert((RawSymbolId)ids[0][n]);
+  }
+  EXPECT_EQ(unique.size(), size_t(kSymbols));
+  EXPECT_EQ(*unique.begin(), 2u);
+  EXPECT_EQ(*unique.rbegin(), RawSymbolId(kSymbols + 1));
+  EXPECT_EQ(table.getSymbols().size(), size_t(kSymbols + 2));
+}
+
+TEST(SymbolFactoryTest, SerializerSymbolLayers) {
+  Serializer serializer;
+  const SymbolId foo_id = serializer.MakeSymbol("foo");
+
+  // A dropped layer takes its symbols with it.
+  serializer.PushSymbolLayer();
+  EXPECT_EQ(serializer.GetSymbolLayerCount(), 1u);
+  EXPECT_EQ(serializer.MakeSymbol("foo"), foo_id);
+  const SymbolId tmp_id = serializer.MakeSymbol("tmp");
+  EXPECT_EQ(serializer.GetSymbol(tmp_id), "tmp");
+  EXPECT_EQ(serializer.GetSymbolId("foo"), foo_id);
+  serializer.PopSymbolLayer();
+  EXPECT_EQ(serializer.GetSymbolLayerCount(), 0u);
+  EXPECT_EQ(serializer.GetSymbolId("tmp"), SymbolFactory::getBadId());
+  EXPECT_EQ(serializer.GetSymbol(foo_id), "foo");
+
+  // A kept one moves them below under the same ids, through nested layers.
+  serializer.PushSymbolLayer();
+  const SymbolId bar_id = serializer.MakeSymbol("bar");
+  serializer.PushSymbolLayer();
+  const SymbolId baz_id = serializer.MakeSymbol("baz");
+  serializer.MakeSymbol("qux");
+  EXPECT_EQ(serializer.GetSymbol(bar_id), "bar");
+  serializer.PopSymbolLayer(true);
+  EXPECT_EQ(serializer.GetSymbolId("baz"), baz_id);
+  serializer.PopSymbolLayer(true);
+  EXPECT_EQ(serializer.GetSymbolId("bar"), bar_id);
+  EXPECT_EQ(serializer.GetSymbol(baz_id), "baz");
+  EXPECT_EQ(serializer.MakeSymbol("foo"), foo_id);
+  EXPECT_EQ(serializer.CompactSymbols(), 4u);
+}
+
 }  // namespace
 }  // namespace UHDM
@@ -3,10 +3,12 @@
 #include <algorithm>
 #include <iostream>
 #include <memory>
+#include <set>
 #include <stack>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "uhdm/ParallelUhdmListener.h"
 #include "uhdm/UhdmListener.h"
 #include "uhdm/uhdm.h"
 
@@ -14,6 +16,11 @@ using namespace UHDM;
 using testing::ElementsAre;
 
 class MyUhdmListener : public UhdmListener {
+ public:
+  explicit MyUhdmListener(
+      VisitedSet::Kind visitedKind = VisitedSet::Kind::Hashed)
+      : UhdmListener(visitedKind) {}
+
  protected:
   void enterModule_inst(const module_inst* object) override {
     if (visited.find(object) != visited.end()) return;
@@ -139,3 +146,334 @@ TEST(UhdmListenerTest, ProgramModule) {
   // it isn't connected to the graph with a forward edge.
   EXPECT_FALSE(listener->didVisitAll(serializer));
 }
+
+TEST(UhdmListenerTest, VisitedKinds) {
+  Serializer serializer;
+  const UHDM::design* const design = buildModuleProg(&serializer);
+
+  MyUhdmListener hashed(VisitedSet::Kind::Hashed);
+  hashed.listenDesign(design);
+  const std::set<const any*> expected(hashed.getVisited().begin(),
+                                      hashed.getVisited().end());
+  EXPECT_EQ(expected.size(), hashed.getVisited().size());
+
+  for (VisitedSet::Kind kind :
+       {VisitedSet::Kind::Ordered, VisitedSet::Kind::Indexed}) {
+    MyUhdmListener listener(kind);
+    listener.listenDesign(design);
+    EXPECT_EQ(listener.collected(), hashed.collected());
+    EXPECT_FALSE(listener.didVisitAll(serializer));
+
+    const VisitedSet& visited = listener.getVisited();
+    EXPECT_EQ(visited.size(), expected.size());
+    EXPECT_EQ(std::set<const any*>(visited.begin(), visited.end()), expected);
+    for (const any* object : expected) {
+      ASSERT_NE(visited.find(object), visited.end());
+      EXPECT_EQ(*visited.find(object), object);
+    }
+  }
+}
+
+TEST(UhdmListenerTest, IndexedVisitedErase) {
+  Serializer serializer;
+  const design* const d = buildModuleProg(&serializer);
+  const module_inst* const m1 = d->AllModules()->front();
+  const module_inst* const m2 = m1->Modules()->at(0);
+  const module_inst* const m3 = m1->Modules()->at(1);
+
+  VisitedSet visited(VisitedSet::Kind::Indexed);
+  EXPECT_TRUE(visited.insert(m1).second);
+  EXPECT_TRUE(visited.insert(m2).second);
+  EXPECT_TRUE(visited.insert(m3).second);
+  EXPECT_FALSE(visited.insert(m2).second);
+  EXPECT_TRUE(visited.insert(d).second);
+  EXPECT_EQ(visited.size(), 4);
+
+  EXPECT_EQ(visited.erase(m2), 1);
+  EXPECT_EQ(visited.erase(m2), 0);
+  EXPECT_FALSE(visited.contains(m2));
+  EXPECT_TRUE(visited.contains(m1));
+  EXPECT_TRUE(visited.contains(m3));
+  EXPECT_TRUE(visited.contains(d));
+  EXPECT_EQ(*visited.find(d), d);
+
+  visited.clear();
+  EXPECT_TRUE(visited.empty());
+  EXPECT_FALSE(visited.contains(m1));
+  EXPECT_TRUE(visited.insert(m3).second);
+  EXPECT_EQ(visited.size(), 1);
+}
+
+TEST(UhdmListenerTest, IndexedVisitedCollected) {
+  Serializer serializer;
+  design* const d = serializer.MakeDesign();
+  module_inst* const m1 = serializer.MakeModule_inst();
+  module_inst* const m2 = serializer.MakeModule_inst();
+  VectorOfmodule_inst* const modules = serializer.MakeModule_instVec();
+  modules->push_back(m1);
+  modules->push_back(m2);
+  d->AllModules(modules);
+  module_inst* const m3 = serializer.MakeModule_inst();  // Unreachable
+
+  VisitedSet visited(VisitedSet::Kind::Indexed);
+  for (const any* object : {(const any*)d, (const any*)m1, (const any*)m2,
+                            (const any*)m3}) {
+    EXPECT_TRUE(visited.insert(object).second);
+  }
+
+  // The freed slots are reused by new objects, at the indexes of others.
+  modules->pop_back();
+  EXPECT_EQ(serializer.GarbageCollect(), 2 * sizeof(module_inst));
+  const module_inst* const m4 = serializer.MakeModule_inst();
+  const module_inst* const m5 = serializer.MakeModule_inst();
+  EXPECT_TRUE(visited.contains(m1));
+  EXPECT_FALSE(visited.contains(m4));
+  EXPECT_FALSE(visited.contains(m5));
+  EXPECT_EQ(visited.find(m4), visited.end());
+  EXPECT_EQ(visited.erase(m5), 0);
+
+  EXPECT_TRUE(visited.insert(m4).second);
+  EXPECT_FALSE(visited.insert(m4).second);
+  EXPECT_TRUE(visited.contains(m4));
+  EXPECT_EQ(visited.erase(m4), 1);
+  EXPECT_FALSE(visited.contains(m4));
+
+  visited.clear();
+  EXPECT_TRUE(visited.empty());
+  EXPECT_FALSE(visited.contains(m1));
+  EXPECT_TRUE(visited.insert(m5).second);
+  EXPECT_EQ(visited.size(), 1);
+}
+
+class CountingUhdmListener : public UhdmListener {
+ protected:
+  void enterBegin(const begin* object) override {
+    ++entered_;
+    depth_ = std::max(depth_, callstack.size());
+  }
+  void leaveBegin(const begin* object) override { ++left_; }
+
+ public:
+  size_t entered_ = 0;
+  size_t left_ = 0;
+  size_t depth_ = 0;
+};
+
+TEST(UhdmListenerTest, Iterative) {
+  Serializer serializer;
+  const UHDM::design* const design = buildModuleProg(&serializer);
+
+  MyUhdmListener recursive;
+  recursive.listenDesign(design);
+
+  MyUhdmListener iterative;
+  iterative.setIterative(true);
+  iterative.listenDesign(design);
+  EXPECT_EQ(iterative.collected(), recursive.collected());
+  EXPECT_EQ(iterative.getCallstack().size(), 0);
+  const std::set<const any*> expected(recursive.getVisited().begin(),
+                                      recursive.getVisited().end());
+  EXPECT_EQ(std::set<const any*>(iterative.getVisited().begin(),
+                                 iterative.getVisited().end()),
+            expected);
+}
+
+TEST(UhdmListenerTest, IterativeDeepNesting) {
+  // Deep enough to overflow the native stack of a recursive walk.
+  constexpr size_t kDepth = 200000;
+  Serializer serializer;
+  begin* const top = serializer.MakeBegin();
+  begin* parent = top;
+  for (size_t i = 1; i < kDepth; ++i) {
+    begin* const child = serializer.MakeBegin();
+    child->VpiParent(parent);
+    VectorOfany* const stmts = serializer.MakeAnyVec();
+    stmts->push_back(child);
+    parent->Stmts(stmts);
+    parent = child;
+  }
+
+  CountingUhdmListener listener;
+  listener.setIterative(true);
+  listener.listenAny(top);
+  EXPECT_EQ(listener.entered_, 2 * kDepth - 1);  // Parents are entered again
+  EXPECT_EQ(listener.left_, listener.entered_);
+  // The deepest one enters its parent again, from its vpiParent.
+  EXPECT_EQ(listener.depth_, kDepth + 1);
+  EXPECT_EQ(listener.getVisited().size(), kDepth);
+}
+
+TEST(UhdmListenerTest, TypeFilter) {
+  EXPECT_TRUE(UhdmListener::canReach(uhdmdesign, uhdmmodule_inst));
+  EXPECT_TRUE(UhdmListener::canReach(uhdmmodule_inst, uhdmexpr));
+  EXPECT_TRUE(UhdmListener::canReach(uhdmattribute, uhdmattribute));
+  EXPECT_FALSE(UhdmListener::canReach(uhdmattribute, uhdmmodule_inst));
+
+  Serializer serializer;
+  const UHDM::design* const design = buildModuleProg(&serializer);
+  module_inst* const m1 = design->AllModules()->front();
+  attribute* const a1 = serializer.MakeAttribute();
+  a1->VpiParent(m1);
+  VectorOfattribute* const attributes = serializer.MakeAttributeVec();
+  attributes->push_back(a1);
+  m1->Attributes(attributes);
+
+  for (bool iterative : {false, true}) {
+    MyUhdmListener unfiltered;
+    unfiltered.setIterative(iterative);
+    unfiltered.listenDesign(design);
+    EXPECT_TRUE(unfiltered.getVisited().contains(a1));
+
+    // Only walks what leads to the types it listens to.
+    MyUhdmListener filtered;
+    filtered.setIterative(iterative);
+    filtered.setTypeFilter({uhdmmodule_inst, uhdmprogram});
+    filtered.listenDesign(design);
+    EXPECT_EQ(filtered.collected(), unfiltered.collected());
+    EXPECT_FALSE(filtered.getVisited().contains(a1));
+    EXPECT_LT(filtered.getVisited().size(), unfiltered.getVisited().size());
+
+    filtered.setTypeFilter({});
+    filtered.getVisited().clear();
+    filtered.listenDesign(design);
+    EXPECT_TRUE(filtered.getVisited().contains(a1));
+  }
+}
+
+TEST(UhdmListenerTest, Parallel) {
+  Serializer serializer;
+  design* const d = buildModuleProg(&serializer);
+  // More top modules than threads.
+  VectorOfmodule_inst* const topModules = serializer.MakeModule_instVec();
+  for (int32_t i = 0; i < 16; ++i) {
+    module_inst* const m = serializer.MakeModule_inst();
+    m->VpiName("top" + std::to_string(i));
+    m->VpiDefName("T");
+    m->VpiParent(d);
+    topModules->push_back(m);
+  }
+  d->TopModules(topModules);
+
+  MyUhdmListener serial;
+  serial.listenDesign(d);
+  const std::set<const any*> expected(serial.getVisited().begin(),
+                                      serial.getVisited().end());
+
+  std::vector<std::string> reduced;
+  for (uint32_t threadCount : {1, 4}) {
+    ParallelUhdmListener<MyUhdmListener> parallel(threadCount);
+    std::vector<std::string> collected;
+    std::set<const any*> visited;
+    parallel.listenDesign(d, [&](MyUhdmListener& listener) {
+      collected.insert(collected.end(), listener.collected().begin(),
+                       listener.collected().end());
+      visited.insert(listener.getVisited().begin(),
+                     listener.getVisited().end());
+    });
+    // Reduced in the same order whatever the number of threads.
+    if (reduced.empty()) reduced = collected;
+    EXPECT_EQ(collected, reduced);
+
+    std::vector<std::string> sorted = serial.collected();
+    std::sort(sorted.begin(), sorted.end());
+    std::sort(collected.begin(), collected.end());
+    EXPECT_EQ(collected, sorted);
+    EXPECT_EQ(visited, expected);
+  }
+}
+
+class ModuleCountingListener : public UhdmListener {
+ protected:
+  void enterModule_inst(const module_inst* object) override { ++entered_; }
+
+ public:
+  size_t entered_ = 0;
+};
+
+TEST(UhdmListenerTest, ParallelSharedObjects) {
+  Serializer serializer;
+  design* const d = serializer.MakeDesign();
+  module_inst* const m1 = serializer.MakeModule_inst();
+  module_inst* const m2 = serializer.MakeModule_inst();
+  module_inst* const shared = serializer.MakeModule_inst();
+  module_inst* const top = serializer.MakeModule_inst();
+  for (module_inst* const m : {m1, m2, top}) m->VpiParent(d);
+  shared->VpiParent(m1);
+
+  // m2 is a root and in the subtree of top, shared in those of m1 and top.
+  VectorOfmodule_inst* const m1Modules = serializer.MakeModule_instVec();
+  m1Modules->push_back(shared);
+  m1->Modules(m1Modules);
+  VectorOfmodule_inst* const topModules = serializer.MakeModule_instVec();
+  topModules->push_back(m2);
+  topModules->push_back(shared);
+  top->Modules(topModules);
+
+  VectorOfmodule_inst* const allModules = serializer.MakeModule_instVec();
+  allModules->push_back(m1);
+  allModules->push_back(m2);
+  d->AllModules(allModules);
+  VectorOfmodule_inst* const designTops = serializer.MakeModule_instVec();
+  designTops->push_back(top);
+  d->TopModules(designTops);
+
+  for (uint32_t threadCount : {1, 4}) {
+    ParallelUhdmListener<ModuleCountingListener> parallel(threadCount);
+    std::vector<size_t> entered;
+    parallel.listenDesign(d, [&](ModuleCountingListener& listener) {
+      entered.emplace_back(listener.entered_);
+    });
+    // Each listener skips the roots it doesn't start from, and they all
+    // enter what they share. shared goes back up to m1 through vpiParent,
+    // which only the listener of m1 enters again: top, shared for top, m1,
+    // shared, m1 for m1, then m2 alone and nothing for the design.
+    EXPECT_THAT(entered, ElementsAre(2, 3, 1, 0));
+  }
+}
+
+class ScopeCountingListener : public UhdmListener {
+ protected:
+  void enterPackage(const package* object) override { ++packages_; }
+  void enterClass_defn(const class_defn* object) override { ++classes_; }
+
+ public:
+  size_t packages_ = 0;
+  size_t classes_ = 0;
+};
+
+TEST(UhdmListenerTest, ParallelPackageClasses) {
+  Serializer serializer;
+  design* const d = serializer.MakeDesign();
+  package* const p = serializer.MakePackage();
+  p->VpiParent(d);
+  VectorOfpackage* const packages = serializer.MakePackageVec();
+  packages->push_back(p);
+  d->AllPackages(packages);
+
+  // The classes of the package are roots too.
+  VectorOfclass_defn* const classes = serializer.MakeClass_defnVec();
+  VectorOfclass_defn* const allClasses = serializer.MakeClass_defnVec();
+  for (int32_t i = 0; i < 3; ++i) {
+    class_defn* const c = serializer.MakeClass_defn();
+    c->VpiName("c" + std::to_string(i));
+    c->VpiParent(p);
+    classes->push_back(c);
+    allClasses->push_back(c);
+  }
+  p->Class_defns(classes);
+  d->AllClasses(allClasses);
+
+  for (uint32_t threadCount : {1, 4}) {
+    ParallelUhdmListener<ScopeCountingListener> parallel(threadCount);
+    std::vector<size_t> packagesEntered;
+    std::vector<size_t> classesEntered;
+    parallel.listenDesign(d, [&](ScopeCountingListener& listener) {
+      packagesEntered.emplace_back(listener.packages_);
+      classesEntered.emplace_back(listener.classes_);
+    });
+    // The package is walked once, not once more per class through vpiParent,
+    // and each class by its own listener alone.
+    EXPECT_THAT(packagesEntered, ElementsAre(1, 0, 0, 0, 0));
+    EXPECT_THAT(classesEntered, ElementsAre(0, 1, 1, 1, 0));
+  }
+}
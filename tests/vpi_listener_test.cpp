@@ -146,3 +146,85 @@ TEST(UhdmListenerTracerTest, ProgramModule) {
   listener->listenDesigns(design);
   EXPECT_THAT(out.str(), HasSubstr("enterDesign: [0,0:0,0]"));
 }
+
+class HandleCheckingListener : public VpiListener {
+ public:
+  explicit HandleCheckingListener(const Serializer* serializer)
+      : serializer_(serializer),
+        madeCount_(serializer->GetMadeHandleCount()) {}
+
+ protected:
+  void enterModule_inst(const module_inst* object, vpiHandle handle) override {
+    // The handles of the walk live on its stack.
+    EXPECT_EQ(serializer_->GetMadeHandleCount(), madeCount_);
+    EXPECT_EQ(vpi_get(vpiType, handle), vpiModule);
+    const char* const defName = vpi_get_str(vpiDefName, handle);
+    ASSERT_NE(defName, nullptr);
+    defNames_.emplace_back(defName);
+  }
+
+ public:
+  const std::vector<std::string>& defNames() const { return defNames_; }
+
+ private:
+  const Serializer* const serializer_;
+  const uint64_t madeCount_;
+  std::vector<std::string> defNames_;
+};
+
+TEST(VpiListenerTest, StackHandles) {
+  Serializer serializer;
+  const std::vector<vpiHandle>& design = buildModuleProg(&serializer);
+
+  const uint64_t madeCount = serializer.GetMadeHandleCount();
+  HandleCheckingListener listener(&serializer);
+  listener.listenDesigns(design);
+  EXPECT_THAT(listener.defNames(), ElementsAre("M1", "M2", "M3"));
+  EXPECT_EQ(serializer.GetMadeHandleCount(), madeCount);
+}
+
+TEST(VpiListenerTest, Iterative) {
+  Serializer serializer;
+  const std::vector<vpiHandle>& design = buildModuleProg(&serializer);
+
+  std::stringstream recursiveOut;
+  VpiListenerTracer recursive(recursiveOut);
+  recursive.listenDesigns(design);
+
+  std::stringstream iterativeOut;
+  VpiListenerTracer iterative(iterativeOut);
+  iterative.setIterative(true);
+  iterative.listenDesigns(design);
+  EXPECT_EQ(iterativeOut.str(), recursiveOut.str());
+
+  MyVpiListener listener;
+  listener.setIterative(true);
+  listener.listenDesigns(design);
+  const std::vector<std::string> expected = {
+      "Module: /M1 parent: design1",
+      "Program: /PR1 parent: -",
+      "Module: u1/M2 parent: -",
+      "Module: u2/M3 parent: -",
+  };
+  EXPECT_EQ(listener.collected(), expected);
+}
+
+TEST(VpiListenerTest, TypeFilter) {
+  EXPECT_TRUE(VpiListener::canReach(uhdmdesign, uhdmprogram));
+  EXPECT_FALSE(VpiListener::canReach(uhdmnull_stmt, uhdmprogram));
+
+  Serializer serializer;
+  const std::vector<vpiHandle>& design = buildModuleProg(&serializer);
+
+  MyVpiListener unfiltered;
+  unfiltered.listenDesigns(design);
+
+  for (bool iterative : {false, true}) {
+    MyVpiListener filtered;
+    filtered.setIterative(iterative);
+    filtered.setTypeFilter({uhdmmodule_inst, uhdmprogram});
+    filtered.listenDesigns(design);
+    EXPECT_EQ(filtered.collected(), unfiltered.collected());
+    EXPECT_LE(filtered.getVisited().size(), unfiltered.getVisited().size());
+  }
+}
@@ -78,6 +78,8 @@ static int32_t usage(const char *progname) {
           "Options:\n"
           "\t--elab          : Elaborate the restored design.\n"
           "\t--stats         : Print objects counts (by type).\n"
+          "\t--memstats      : Print memory use (by type of object and "
+          "relation).\n"
           "\t--verbose       : print diagnostic messages.\n"
           "\t--version       : print version and exit.\n"
           "\nIf golden file is given to compare, exit code represent if output "
@@ -92,6 +94,7 @@ int32_t main(int32_t argc, char **argv) {
   bool elab = false;
   bool verbose = false;
   bool dumpstats = false;
+  bool dumpmemstats = false;
   std::string uhdmFile;
   std::string goldenFile;
 
@@ -103,6 +106,8 @@ int32_t main(int32_t argc, char **argv) {
       elab = true;
     } else if (arg == "--stats") {
       dumpstats = true;
+    } else if (arg == "--memstats") {
+      dumpmemstats = true;
     } else if (arg == "--verbose") {
       verbose = true;
     } else if (arg == "--version") {
@@ -140,6 +145,10 @@ int32_t main(int32_t argc, char **argv) {
     serializer.PrintStats(std::cout, uhdmFile);
   }
 
+  if (dumpmemstats) {
+    serializer.PrintMemoryStats(std::cout, uhdmFile);
+  }
+
   std::cout << uhdmFile << ": Restored design Pre-Elab: " << std::endl;
   visit_designs(restoredDesigns, std::cout);
 
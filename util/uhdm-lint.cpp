@@ -178,6 +178,9 @@ int32_t main(int32_t argc, char **argv) {
           case UHDM::UHDM_FORCING_UNSIGNED_TYPE:
             errmsg = "Critical: Forcing signal to unsigned type due to unsigned port binding ";
             break;
+          case UHDM::UHDM_UNSUPPORTED_LAZY_RESTORE:
+            errmsg = "Unsupported lazy restore";
+            break;
         }
 
         if (object1) {